@@ -0,0 +1,564 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Offline analyzer for raw captures as written by main.
+ *
+ * The capture is mmap'ed and split into chunks that are analyzed in parallel
+ * by a work-stealing thread pool, using the same kernels as the streaming
+ * stages. The per-chunk results are merged in order afterwards:
+ *
+ *  o statistics are merged with slogic_stats_merge, which accounts for the
+ *    pulses spanning two chunks.
+ *  o edges only depend on the sample before the chunk and are concatenated.
+ *  o the UART decoder is run speculatively from the start of every chunk as
+ *    if the line was idle there. The merge pass decodes sequentially from
+ *    where the previous chunk's last frame ended until it reaches a position
+ *    where the speculative decoder was idle too. From there on both decoders
+ *    are in the same state and the speculative frames are used as they are.
+ *  o timing rules are checked in a single pass over the whole capture after
+ *    the pool is done, their state doesn't split at chunk boundaries.
+ */
+#include "slogic.h"
+#include "stats.h"
+#include "timing.h"
+#include "uart.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+
+const char *me = "analyze";
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+/* Command line arguments */
+struct slogic_sample_rate *sample_rate = NULL;
+int n_threads = 0;
+size_t chunk_size = DEFAULT_CHUNK_SIZE;
+bool stats_enabled = false;
+int edge_channel = -1;
+int uart_channel = -1;
+unsigned int uart_baud_rate = 0;
+bool benchmark = false;
+const char *timing_rules_file_name = NULL;
+const char *input_file_name = NULL;
+
+struct chunk {
+	size_t begin;
+	size_t end;
+
+	struct slogic_stats stats;
+
+	uint64_t *edges;
+	size_t n_edges;
+	size_t edges_capacity;
+
+	/* Speculatively decoded frames, see the comment at the top */
+	struct slogic_uart_frame *frames;
+	size_t n_frames;
+	size_t frames_capacity;
+};
+
+struct analysis {
+	const uint8_t *data;
+	size_t size;
+	struct chunk *chunks;
+	size_t n_chunks;
+	struct slogic_uart uart;
+};
+
+/*
+ * Work-stealing pool. Every worker starts out with an equal share of the
+ * chunks and takes them from the front of its range. A worker that runs out
+ * steals the back half of another worker's range. As the chunks don't create
+ * new work, a worker that finds nothing to steal is done.
+ */
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	size_t begin;
+	size_t end;
+	int index;
+	struct pool *pool;
+	unsigned int steals;
+};
+
+struct pool {
+	struct worker *workers;
+	int n_workers;
+	struct analysis *analysis;
+};
+
+void short_usage(const char *message, ...)
+{
+	char p[1024];
+	va_list ap;
+
+	fprintf(stderr, "usage: %s -r <sample rate> [-j <threads>] [-S] [-e <channel>] [-U <channel>:<baud>] "
+		"[-V <rules>] <capture file>\n\n", me);
+	va_start(ap, message);
+	(void)vsnprintf(p, 1024, message, ap);
+	va_end(ap);
+	fprintf(stderr, "Error: %s\n", p);
+}
+
+void full_usage()
+{
+	fprintf(stderr, "usage: %s -r <sample rate> [-j <threads>] [-S] [-e <channel>] [-U <channel>:<baud>] "
+		"[-V <rules>] <capture file>\n", me);
+	fprintf(stderr, "\n");
+	fprintf(stderr, " -r: The sample rate the capture was made with.\n");
+	fprintf(stderr, " -S: Print signal statistics. This is the default if nothing else is selected.\n");
+	fprintf(stderr, " -e: Print the position of every edge on the channel.\n");
+	fprintf(stderr, " -U: Decode 8N1 serial data on the channel with the given baud rate.\n");
+	fprintf(stderr, " -V: Check the timing rules in this file and print every violation.\n");
+	fprintf(stderr, " -j: Number of threads. Defaults to the number of CPUs.\n");
+	fprintf(stderr, " -c: Chunk size in bytes. Defaults to %d.\n", DEFAULT_CHUNK_SIZE);
+	fprintf(stderr, " -B: Benchmark: run the analysis with 1, 2, 4, 8 and 16 threads and print the throughput.\n");
+	fprintf(stderr, " -h: This help message.\n");
+	fprintf(stderr, "\n");
+}
+
+/* Returns true if everything was OK */
+bool parse_args(int argc, char **argv)
+{
+	int c;
+	char *endptr;
+
+	while ((c = getopt(argc, argv, "r:j:c:Se:U:V:Bh")) != -1) {
+		switch (c) {
+		case 'r':
+			sample_rate = slogic_parse_sample_rate(optarg);
+			if (!sample_rate) {
+				short_usage("Invalid sample rate: %s", optarg);
+				return false;
+			}
+			break;
+		case 'j':
+			n_threads = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || n_threads <= 0) {
+				short_usage("Invalid number of threads, must be a positive integer: %s", optarg);
+				return false;
+			}
+			break;
+		case 'c':
+			chunk_size = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || optarg[0] == '-' || chunk_size == 0) {
+				short_usage("Invalid chunk size, must be a positive integer: %s", optarg);
+				return false;
+			}
+			break;
+		case 'S':
+			stats_enabled = true;
+			break;
+		case 'e':
+			edge_channel = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || edge_channel < 0 || edge_channel >= SLOGIC_N_CHANNELS) {
+				short_usage("Invalid channel: %s", optarg);
+				return false;
+			}
+			break;
+		case 'U':
+			uart_channel = strtol(optarg, &endptr, 10);
+			if (*endptr != ':' || uart_channel < 0 || uart_channel >= SLOGIC_N_CHANNELS) {
+				short_usage("Invalid serial channel, must be <channel>:<baud>: %s", optarg);
+				return false;
+			}
+			uart_baud_rate = strtol(endptr + 1, &endptr, 10);
+			if (*endptr != '\0' || uart_baud_rate == 0) {
+				short_usage("Invalid baud rate, must be <channel>:<baud>: %s", optarg);
+				return false;
+			}
+			break;
+		case 'V':
+			timing_rules_file_name = optarg;
+			break;
+		case 'B':
+			benchmark = true;
+			break;
+		case 'h':
+			full_usage();
+			return false;
+		default:
+		case '?':
+			short_usage("Unknown argument: %c. Use %s -h for usage.", optopt, me);
+			return false;
+		}
+	}
+
+	if (optind != argc - 1) {
+		short_usage("A capture file has to be specified.");
+		return false;
+	}
+	input_file_name = argv[optind];
+
+	if (!sample_rate) {
+		short_usage("A sample rate has to be specified.");
+		return false;
+	}
+
+	if (edge_channel < 0 && uart_channel < 0 && !timing_rules_file_name) {
+		stats_enabled = true;
+	}
+
+	if (!n_threads) {
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n_threads <= 0) {
+			n_threads = 1;
+		}
+	}
+
+	return true;
+}
+
+static void on_edge(uint64_t position, uint8_t changed, uint8_t level, void *user_data)
+{
+	struct chunk *chunk = user_data;
+
+	if (chunk->n_edges == chunk->edges_capacity) {
+		chunk->edges_capacity = chunk->edges_capacity ? 2 * chunk->edges_capacity : 1024;
+		chunk->edges = realloc(chunk->edges, chunk->edges_capacity * sizeof(*chunk->edges));
+		if (!chunk->edges) {
+			log_printf(&logger, ERR, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	chunk->edges[chunk->n_edges++] = position;
+}
+
+static void add_frame(struct chunk *chunk, const struct slogic_uart_frame *frame)
+{
+	if (chunk->n_frames == chunk->frames_capacity) {
+		chunk->frames_capacity = chunk->frames_capacity ? 2 * chunk->frames_capacity : 1024;
+		chunk->frames = realloc(chunk->frames, chunk->frames_capacity * sizeof(*chunk->frames));
+		if (!chunk->frames) {
+			log_printf(&logger, ERR, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	chunk->frames[chunk->n_frames++] = *frame;
+}
+
+static void analyze_chunk(struct analysis *analysis, size_t index)
+{
+	struct chunk *chunk = &analysis->chunks[index];
+	const uint8_t *data = analysis->data;
+	uint8_t previous = chunk->begin ? data[chunk->begin - 1] : data[0];
+	struct slogic_uart_frame frame;
+	size_t position;
+
+	if (stats_enabled) {
+		slogic_stats_init_at(&chunk->stats, chunk->begin, previous);
+		slogic_stats_feed(&chunk->stats, &data[chunk->begin], chunk->end - chunk->begin);
+	}
+
+	if (edge_channel >= 0) {
+		slogic_find_edges(&data[chunk->begin], chunk->end - chunk->begin, chunk->begin, previous,
+				  1 << edge_channel, on_edge, chunk);
+	}
+
+	if (uart_channel >= 0) {
+		position = chunk->begin;
+		while (slogic_uart_decode(&analysis->uart, data, analysis->size, position, chunk->end, &frame) == 1) {
+			add_frame(chunk, &frame);
+			position = frame.end;
+		}
+	}
+}
+
+static bool take_chunk(struct worker *worker, size_t *index)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->begin < worker->end) {
+		*index = worker->begin++;
+		found = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+static bool steal_chunks(struct worker *worker)
+{
+	struct pool *pool = worker->pool;
+	struct worker *victim;
+	size_t n;
+	int i;
+
+	for (i = 1; i < pool->n_workers; i++) {
+		victim = &pool->workers[(worker->index + i) % pool->n_workers];
+
+		pthread_mutex_lock(&victim->lock);
+		n = (victim->end - victim->begin + 1) / 2;
+		if (victim->begin < victim->end) {
+			victim->end -= n;
+			pthread_mutex_unlock(&victim->lock);
+
+			pthread_mutex_lock(&worker->lock);
+			worker->begin = victim->end;
+			worker->end = victim->end + n;
+			worker->steals++;
+			pthread_mutex_unlock(&worker->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return false;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *worker = arg;
+	size_t index;
+
+	do {
+		while (take_chunk(worker, &index)) {
+			analyze_chunk(worker->pool->analysis, index);
+		}
+	} while (steal_chunks(worker));
+
+	return NULL;
+}
+
+static int run_pool(struct analysis *analysis, int n_workers)
+{
+	struct pool pool;
+	unsigned int steals = 0;
+	int i;
+
+	pool.workers = calloc(n_workers, sizeof(struct worker));
+	if (!pool.workers) {
+		return -1;
+	}
+	pool.n_workers = n_workers;
+	pool.analysis = analysis;
+
+	for (i = 0; i < n_workers; i++) {
+		struct worker *worker = &pool.workers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->index = i;
+		worker->pool = &pool;
+		worker->begin = analysis->n_chunks * i / n_workers;
+		worker->end = analysis->n_chunks * (i + 1) / n_workers;
+	}
+
+	for (i = 0; i < n_workers; i++) {
+		if (pthread_create(&pool.workers[i].thread, NULL, worker_main, &pool.workers[i])) {
+			log_printf(&logger, ERR, "Failed to create worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < n_workers; i++) {
+		pthread_join(pool.workers[i].thread, NULL);
+		pthread_mutex_destroy(&pool.workers[i].lock);
+		steals += pool.workers[i].steals;
+	}
+	log_printf(&logger, DEBUG, "%d threads, %u steals\n", n_workers, steals);
+
+	free(pool.workers);
+	return 0;
+}
+
+static void reset_chunks(struct analysis *analysis)
+{
+	size_t i;
+
+	for (i = 0; i < analysis->n_chunks; i++) {
+		struct chunk *chunk = &analysis->chunks[i];
+		chunk->n_edges = 0;
+		chunk->n_frames = 0;
+	}
+}
+
+static void print_stats(struct analysis *analysis)
+{
+	struct slogic_stats stats = analysis->chunks[0].stats;
+	size_t i;
+
+	for (i = 1; i < analysis->n_chunks; i++) {
+		slogic_stats_merge(&stats, &analysis->chunks[i].stats);
+	}
+	slogic_stats_report(&stats, sample_rate->samples_per_second, stdout);
+}
+
+static void print_edges(struct analysis *analysis)
+{
+	size_t i, j;
+
+	for (i = 0; i < analysis->n_chunks; i++) {
+		for (j = 0; j < analysis->chunks[i].n_edges; j++) {
+			printf("edge %llu\n", (unsigned long long)analysis->chunks[i].edges[j]);
+		}
+	}
+}
+
+static void print_frame(const struct slogic_uart_frame *frame)
+{
+	printf("uart %llu 0x%02x%s\n", (unsigned long long)frame->position, frame->data,
+	       frame->framing_error ? " framing error" : "");
+}
+
+/* The resync merge, see the comment at the top */
+static void print_frames(struct analysis *analysis)
+{
+	struct slogic_uart_frame frame;
+	uint64_t resume = 0;
+	uint64_t position;
+	size_t resynced = 0;
+	size_t i, j;
+
+	for (i = 0; i < analysis->n_chunks; i++) {
+		struct chunk *chunk = &analysis->chunks[i];
+
+		position = resume > chunk->begin ? resume : chunk->begin;
+		j = 0;
+		for (;;) {
+			while (j < chunk->n_frames && chunk->frames[j].position < position) {
+				j++;
+			}
+			if (j == 0 || chunk->frames[j - 1].end <= position) {
+				/* The speculative decoder was idle here as well */
+				for (; j < chunk->n_frames; j++) {
+					print_frame(&chunk->frames[j]);
+					position = chunk->frames[j].end;
+				}
+				break;
+			}
+			resynced++;
+			if (slogic_uart_decode(&analysis->uart, analysis->data, analysis->size, position, chunk->end,
+					       &frame) != 1) {
+				break;
+			}
+			print_frame(&frame);
+			position = frame.end;
+		}
+		resume = position;
+	}
+	log_printf(&logger, DEBUG, "%zu frames decoded sequentially while merging\n", resynced);
+}
+
+static void print_violation(const struct slogic_timing_violation *violation, void *user_data)
+{
+	printf("timing %llu %llu %llu %s\n", (unsigned long long)violation->position,
+	       (unsigned long long)violation->reference, (unsigned long long)violation->samples,
+	       violation->rule->text);
+}
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	struct analysis analysis;
+	struct slogic_timing_checker timing;
+	struct stat st;
+	size_t i;
+	int fd;
+
+	if (!parse_args(argc, argv)) {
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(input_file_name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror("opening capture file");
+		exit(EXIT_FAILURE);
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "The capture file is empty\n");
+		exit(EXIT_FAILURE);
+	}
+
+	analysis.size = st.st_size;
+	analysis.data = mmap(NULL, analysis.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (analysis.data == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	analysis.n_chunks = (analysis.size + chunk_size - 1) / chunk_size;
+	analysis.chunks = calloc(analysis.n_chunks, sizeof(struct chunk));
+	if (!analysis.chunks) {
+		log_printf(&logger, ERR, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < analysis.n_chunks; i++) {
+		analysis.chunks[i].begin = i * chunk_size;
+		analysis.chunks[i].end = i + 1 == analysis.n_chunks ? analysis.size : (i + 1) * chunk_size;
+	}
+	if (uart_channel >= 0) {
+		slogic_uart_init(&analysis.uart, uart_channel, uart_baud_rate, sample_rate->samples_per_second);
+	}
+	if (timing_rules_file_name) {
+		slogic_timing_init(&timing, benchmark ? NULL : print_violation, NULL);
+		if (slogic_timing_load(&timing, timing_rules_file_name, sample_rate->samples_per_second)) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (benchmark) {
+		int threads;
+		for (threads = 1; threads <= 16; threads *= 2) {
+			double start = now();
+			double elapsed;
+
+			reset_chunks(&analysis);
+			run_pool(&analysis, threads);
+			elapsed = now() - start;
+			printf("%2d threads: %8.3fs %10.1f MB/s\n", threads, elapsed, analysis.size / elapsed / 1e6);
+		}
+		if (timing_rules_file_name) {
+			double start = now();
+			double elapsed;
+
+			slogic_timing_feed(&timing, analysis.data, analysis.size);
+			elapsed = now() - start;
+			printf("timing rules: %8.3fs %10.1f MB/s\n", elapsed, analysis.size / elapsed / 1e6);
+		}
+	} else {
+		run_pool(&analysis, n_threads);
+
+		if (edge_channel >= 0) {
+			print_edges(&analysis);
+		}
+		if (uart_channel >= 0) {
+			print_frames(&analysis);
+		}
+		if (timing_rules_file_name) {
+			slogic_timing_feed(&timing, analysis.data, analysis.size);
+			slogic_timing_report(&timing, stdout);
+		}
+		if (stats_enabled) {
+			print_stats(&analysis);
+		}
+	}
+
+	for (i = 0; i < analysis.n_chunks; i++) {
+		free(analysis.chunks[i].edges);
+		free(analysis.chunks[i].frames);
+	}
+	free(analysis.chunks);
+	munmap((void *)analysis.data, analysis.size);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,181 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "compare.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+/* Same generic vectors as the glitch filter */
+typedef uint8_t vector __attribute__ ((vector_size(16)));
+#define VECTOR_SIZE sizeof(vector)
+/* Vectors whose differences are ORed together before testing, to keep the loop free of branches */
+#define VECTORS_PER_BLOCK 4
+#define BLOCK_SIZE (VECTORS_PER_BLOCK * VECTOR_SIZE)
+
+static inline vector load(const uint8_t *p)
+{
+	vector v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline bool any(vector v)
+{
+	uint64_t words[2];
+	memcpy(words, &v, sizeof(words));
+	return (words[0] | words[1]) != 0;
+}
+
+/* Returns the index of the first sample that differs on the masked channels, n if there is none */
+static size_t find_mismatch(const uint8_t *a, const uint8_t *b, size_t n, uint8_t mask)
+{
+	size_t i = 0;
+	size_t k;
+
+	for (; i + BLOCK_SIZE <= n; i += BLOCK_SIZE) {
+		vector diff = { 0 };
+		for (k = 0; k < BLOCK_SIZE; k += VECTOR_SIZE) {
+			diff |= load(&a[i + k]) ^ load(&b[i + k]);
+		}
+		if (any(diff & mask)) {
+			break;
+		}
+	}
+	for (; i < n; i++) {
+		if ((a[i] ^ b[i]) & mask) {
+			return i;
+		}
+	}
+	return n;
+}
+
+int slogic_compare_open(struct slogic_compare *compare, const char *golden_file_name, uint8_t mask, bool align)
+{
+	struct stat st;
+	void *golden;
+	size_t i;
+	int fd;
+
+	memset(compare, 0, sizeof(*compare));
+	compare->mask = mask;
+	compare->aligned = true;
+
+	fd = open(golden_file_name, O_RDONLY);
+	if (fd < 0) {
+		log_printf(&logger, ERR, "Failed to open %s: %s\n", golden_file_name, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size == 0) {
+		log_printf(&logger, ERR, "%s is empty or can't be read\n", golden_file_name);
+		close(fd);
+		return -1;
+	}
+	/* Fault everything in now, page faults in the event loop would cost more than the comparison */
+	golden = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (golden == MAP_FAILED) {
+		log_printf(&logger, ERR, "Failed to map %s: %s\n", golden_file_name, strerror(errno));
+		return -1;
+	}
+	(void)madvise(golden, st.st_size, MADV_SEQUENTIAL);
+	compare->golden = golden;
+	compare->golden_size = st.st_size;
+
+	if (align) {
+		for (i = 1; i < compare->golden_size; i++) {
+			if ((compare->golden[i] ^ compare->golden[i - 1]) & mask) {
+				break;
+			}
+		}
+		if (i < compare->golden_size) {
+			compare->golden_pos = i;
+			compare->aligned = false;
+		} else {
+			log_printf(&logger, WARNING, "No edge in %s to align on, comparing from the start\n",
+				   golden_file_name);
+		}
+	}
+	compare->result = SLOGIC_COMPARE_MORE;
+	return 0;
+}
+
+void slogic_compare_close(struct slogic_compare *compare)
+{
+	if (compare->golden) {
+		munmap((void *)compare->golden, compare->golden_size);
+		compare->golden = NULL;
+	}
+}
+
+size_t slogic_compare_golden_samples(const struct slogic_compare *compare)
+{
+	/* Before alignment the level before the edge is compared as well */
+	return compare->golden_size - compare->golden_pos + (compare->aligned ? 0 : 1);
+}
+
+static enum slogic_compare_result mismatch(struct slogic_compare *compare, uint64_t live_sample, size_t golden_sample,
+					   uint8_t actual)
+{
+	compare->mismatch_sample = live_sample;
+	compare->golden_sample = golden_sample;
+	compare->expected = compare->golden[golden_sample];
+	compare->actual = actual;
+	compare->channel = __builtin_ctz((compare->expected ^ actual) & compare->mask);
+	compare->result = SLOGIC_COMPARE_MISMATCH;
+	return compare->result;
+}
+
+enum slogic_compare_result slogic_compare_feed(struct slogic_compare *compare, const uint8_t *data, size_t size)
+{
+	size_t i = 0;
+	size_t n, k;
+
+	if (compare->result != SLOGIC_COMPARE_MORE) {
+		return compare->result;
+	}
+
+	if (!compare->aligned) {
+		for (; i < size; i++) {
+			if (compare->started && ((data[i] ^ compare->last) & compare->mask)) {
+				break;
+			}
+			compare->last = data[i];
+			compare->started = true;
+		}
+		if (i == size) {
+			compare->live_pos += size;
+			return compare->result;
+		}
+		compare->aligned = true;
+		compare->live_start = compare->live_pos + i - 1;
+		if ((compare->last ^ compare->golden[compare->golden_pos - 1]) & compare->mask) {
+			return mismatch(compare, compare->live_start, compare->golden_pos - 1, compare->last);
+		}
+		compare->compared++;
+	}
+
+	n = size - i;
+	if (n > compare->golden_size - compare->golden_pos) {
+		n = compare->golden_size - compare->golden_pos;
+	}
+	k = find_mismatch(&data[i], &compare->golden[compare->golden_pos], n, compare->mask);
+	compare->compared += k;
+	if (k < n) {
+		return mismatch(compare, compare->live_pos + i + k, compare->golden_pos + k, data[i + k]);
+	}
+	compare->golden_pos += n;
+	compare->live_pos += size;
+	if (compare->golden_pos == compare->golden_size) {
+		compare->result = SLOGIC_COMPARE_MATCH;
+	}
+	return compare->result;
+}
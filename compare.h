@@ -0,0 +1,74 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __COMPARE_H__
+#define __COMPARE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Streaming comparison of a capture against a golden reference capture. Only
+ * the channels in the mask are compared.
+ *
+ * With alignment on, the comparison starts at the first edge on the masked
+ * channels: the samples before the first edge of the golden capture and
+ * before the first edge of the live capture are skipped, except for the
+ * level right before the edge, which has to match too.
+ */
+enum slogic_compare_result {
+	SLOGIC_COMPARE_MORE = 0,
+	/* All of the golden capture matched */
+	SLOGIC_COMPARE_MATCH,
+	SLOGIC_COMPARE_MISMATCH,
+};
+
+struct slogic_compare {
+	/* Set on SLOGIC_COMPARE_MISMATCH */
+	uint64_t mismatch_sample;	/* index in the live capture */
+	uint64_t golden_sample;	/* index in the golden capture */
+	int channel;		/* lowest channel that differs */
+	uint8_t expected;
+	uint8_t actual;
+	/* Number of samples compared so far */
+	uint64_t compared;
+	/* Index of the first compared sample in the live capture */
+	uint64_t live_start;
+
+	/* Internal */
+	const uint8_t *golden;
+	size_t golden_size;
+	size_t golden_pos;
+	uint64_t live_pos;
+	uint8_t mask;
+	bool aligned;
+	bool started;
+	uint8_t last;
+	enum slogic_compare_result result;
+};
+
+/* Maps the golden capture. Returns 0 on success */
+int slogic_compare_open(struct slogic_compare *compare, const char *golden_file_name, uint8_t mask, bool align);
+
+void slogic_compare_close(struct slogic_compare *compare);
+
+/* Number of samples in the golden capture that will be compared */
+size_t slogic_compare_golden_samples(const struct slogic_compare *compare);
+
+/*
+ * Compares the next chunk of the live capture. Once the result is no longer
+ * SLOGIC_COMPARE_MORE, further chunks are ignored and the result repeated.
+ */
+enum slogic_compare_result slogic_compare_feed(struct slogic_compare *compare, const uint8_t * data, size_t size);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
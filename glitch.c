@@ -0,0 +1,216 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "glitch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The filter works on whole vectors of samples with GCC's generic vector
+ * extensions, which map to SSE2/AVX2 on x86 and NEON on ARM.
+ *
+ * For each sample t and channel c with minimum width w:
+ *
+ *  stable[t]: samples t .. t + w - 1 are all the same
+ *  cover[t]:  stable[t - k] for some k in 0 .. w - 1, i.e. the sample is part
+ *             of a run that is at least w samples long
+ *
+ * Samples that are not covered are glitches and get the previous output
+ * level. The widths differ per channel, which is handled by masking each
+ * term of the ORs with the channels it applies to.
+ */
+typedef uint8_t vector __attribute__ ((vector_size(16)));
+#define VECTOR_SIZE sizeof(vector)
+/* Room for reading and writing whole vectors past the end of the data */
+#define PADDING (2 * VECTOR_SIZE)
+
+static inline vector load(const uint8_t *p)
+{
+	vector v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store(uint8_t *p, vector v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+int slogic_glitch_filter_init(struct slogic_glitch_filter *filter, const unsigned int *min_width)
+{
+	unsigned int max_width = 1;
+	unsigned int k;
+	int channel;
+
+	memset(filter, 0, sizeof(*filter));
+
+	for (channel = 0; channel < SLOGIC_N_CHANNELS; channel++) {
+		filter->min_width[channel] = min_width[channel] ? min_width[channel] : 1;
+		if (filter->min_width[channel] > SLOGIC_GLITCH_MAX_WIDTH) {
+			return -1;
+		}
+		if (filter->min_width[channel] > max_width) {
+			max_width = filter->min_width[channel];
+		}
+	}
+	filter->lookahead = max_width - 1;
+	filter->skip = filter->lookahead;
+
+	for (k = 0; k < SLOGIC_GLITCH_MAX_WIDTH; k++) {
+		for (channel = 0; channel < SLOGIC_N_CHANNELS; channel++) {
+			if (filter->min_width[channel] >= k + 2) {
+				filter->change_masks[k] |= 1 << channel;
+			}
+			if (filter->min_width[channel] >= k + 1) {
+				filter->cover_masks[k] |= 1 << channel;
+			}
+		}
+	}
+	filter->last_cover = 0xff;
+
+	return 0;
+}
+
+void slogic_glitch_filter_free(struct slogic_glitch_filter *filter)
+{
+	free(filter->samples);
+	free(filter->changes);
+	free(filter->stable);
+	free(filter->out);
+	filter->samples = filter->changes = filter->stable = filter->out = NULL;
+	filter->capacity = 0;
+}
+
+static int ensure_capacity(struct slogic_glitch_filter *filter, size_t n)
+{
+	uint8_t *samples, *changes, *stable, *out;
+
+	if (n + PADDING <= filter->capacity) {
+		return 0;
+	}
+	n += PADDING;
+
+	/* The samples hold the context from the previous chunk, the rest is scratch */
+	samples = realloc(filter->samples, n);
+	if (!samples) {
+		return -1;
+	}
+	filter->samples = samples;
+
+	changes = malloc(n);
+	stable = malloc(n);
+	out = malloc(n);
+	if (!changes || !stable || !out) {
+		free(changes);
+		free(stable);
+		free(out);
+		return -1;
+	}
+	free(filter->changes);
+	free(filter->stable);
+	free(filter->out);
+	filter->changes = changes;
+	filter->stable = stable;
+	filter->out = out;
+	filter->capacity = n;
+	return 0;
+}
+
+size_t slogic_glitch_filter_feed(struct slogic_glitch_filter *filter, const uint8_t *data, size_t size,
+				 const uint8_t **out)
+{
+	size_t lookahead = filter->lookahead;
+	/* lookahead samples already delivered, followed by lookahead samples held back */
+	size_t context = 2 * lookahead;
+	size_t n = context + size;
+	uint8_t *samples;
+	uint8_t *cover;
+	size_t i, k;
+
+	if (!lookahead) {
+		*out = data;
+		return size;
+	}
+	if (!size || ensure_capacity(filter, n)) {
+		*out = filter->out;
+		return 0;
+	}
+	*out = filter->out;
+	samples = filter->samples;
+
+	if (!filter->started) {
+		/* Pretend that the signal has been stable before the first sample */
+		memset(samples, data[0], context);
+		filter->last_out = data[0];
+		filter->started = true;
+	}
+	memcpy(&samples[context], data, size);
+
+	for (i = 0; i < n - 1; i += VECTOR_SIZE) {
+		store(&filter->changes[i], load(&samples[i]) ^ load(&samples[i + 1]));
+	}
+
+	for (i = 0; i < n - lookahead; i += VECTOR_SIZE) {
+		vector changed = { 0 };
+		for (k = 0; k < lookahead; k++) {
+			changed |= load(&filter->changes[i + k]) & filter->change_masks[k];
+		}
+		store(&filter->stable[i], ~changed);
+	}
+
+	/* The changes are not needed any more, reuse them for the cover of the samples to deliver */
+	cover = filter->changes;
+	for (i = 0; i < size; i += VECTOR_SIZE) {
+		vector covered = { 0 };
+		for (k = 0; k <= lookahead; k++) {
+			covered |= load(&filter->stable[i + lookahead - k]) & filter->cover_masks[k];
+		}
+		store(&cover[i], covered);
+	}
+
+	samples += lookahead;
+	for (i = 0; i < size; i++) {
+		uint8_t glitches;
+
+		if (filter->last_cover == 0xff && i + 8 <= size) {
+			uint64_t covered;
+			memcpy(&covered, &cover[i], sizeof(covered));
+			if (covered == ~0ULL) {
+				/* Fast path, nothing to filter */
+				memcpy(&filter->out[i], &samples[i], 8);
+				filter->last_out = samples[i + 7];
+				i += 7;
+				continue;
+			}
+		}
+
+		filter->out[i] = (samples[i] & cover[i]) | (filter->last_out & ~cover[i]);
+		filter->last_out = filter->out[i];
+
+		glitches = filter->last_cover & ~cover[i];
+		while (glitches) {
+			filter->glitches[__builtin_ctz(glitches)]++;
+			glitches &= glitches - 1;
+		}
+		filter->last_cover = cover[i];
+	}
+
+	memmove(filter->samples, &filter->samples[size], context);
+
+	/* The first samples out of the filter are from before the stream started */
+	k = filter->skip < size ? filter->skip : size;
+	filter->skip -= k;
+	*out = &filter->out[k];
+	return size - k;
+}
+
+size_t slogic_glitch_filter_flush(struct slogic_glitch_filter *filter, const uint8_t **out)
+{
+	uint8_t tail[SLOGIC_GLITCH_MAX_WIDTH];
+
+	if (!filter->lookahead || !filter->started) {
+		*out = filter->out;
+		return 0;
+	}
+	memset(tail, filter->samples[2 * filter->lookahead - 1], filter->lookahead);
+	return slogic_glitch_filter_feed(filter, tail, filter->lookahead, out);
+}
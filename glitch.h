@@ -0,0 +1,74 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __GLITCH_H__
+#define __GLITCH_H__
+
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/* Upper limit for the minimum pulse width, the cost per sample grows with it */
+#define SLOGIC_GLITCH_MAX_WIDTH 64
+
+/*
+ * Streaming minimum pulse width filter. A pulse on a channel that is shorter
+ * than the channel's minimum width is removed, the channel keeps the level
+ * it had before the pulse. A burst of short pulses counts as one glitch.
+ *
+ * Deciding if a pulse is long enough requires looking ahead, so the output
+ * lags the input by the largest width - 1 samples. slogic_glitch_filter_flush
+ * returns the samples that are still held back at the end of the stream.
+ */
+struct slogic_glitch_filter {
+	/* Number of glitches removed per channel */
+	uint64_t glitches[SLOGIC_N_CHANNELS];
+
+	/* Internal */
+	unsigned int min_width[SLOGIC_N_CHANNELS];
+	unsigned int lookahead;
+	size_t skip;
+	uint8_t change_masks[SLOGIC_GLITCH_MAX_WIDTH];
+	uint8_t cover_masks[SLOGIC_GLITCH_MAX_WIDTH];
+	uint8_t *samples;
+	uint8_t *changes;
+	uint8_t *stable;
+	uint8_t *out;
+	size_t capacity;
+	uint8_t last_out;
+	uint8_t last_cover;
+	bool started;
+};
+
+/*
+ * min_width holds the minimum pulse width in samples for each channel, 0 or
+ * 1 turns filtering off for the channel. Returns 0 on success.
+ */
+int slogic_glitch_filter_init(struct slogic_glitch_filter *filter, const unsigned int *min_width);
+
+void slogic_glitch_filter_free(struct slogic_glitch_filter *filter);
+
+/*
+ * Filters a chunk. Returns the number of filtered samples in *out, which stay
+ * valid until the next call. As the output lags the input, the first calls
+ * return fewer samples than they are given. After the flush the number of
+ * samples out is the same as the number of samples in.
+ */
+size_t slogic_glitch_filter_feed(struct slogic_glitch_filter *filter, const uint8_t * data, size_t size,
+				 const uint8_t ** out);
+
+/* Returns the samples held back by the filter, assuming the signal doesn't change after the last sample */
+size_t slogic_glitch_filter_flush(struct slogic_glitch_filter *filter, const uint8_t ** out);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -6,8 +6,12 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 
-void log_printf(struct logger *logger, enum log_level level, const char *format, ...)
+enum log_level log_threshold = INFO;
+
+void log_print(struct logger *logger, enum log_level level, const char *format, ...)
 {
 	char p[1024];
 	va_list ap;
@@ -16,3 +20,224 @@ void log_printf(struct logger *logger, enum log_level level, const char *format,
 	va_end(ap);
 	fprintf(stderr, "%s, %s", logger->name, p);
 }
+
+/*
+ * Binary tracing
+ */
+
+/* Number of records per thread, has to be a power of two */
+#define LOG_TRACE_RING_SIZE 4096
+/* How often the writer thread drains the rings */
+#define LOG_TRACE_FLUSH_USEC 10000
+
+/*
+ * Single producer (the thread owning the ring), single consumer (the writer
+ * thread). The producer only writes head, the consumer only writes tail.
+ */
+struct log_trace_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t thread;
+	uint64_t dropped;
+	struct log_trace_ring *next;
+	struct log_trace_record records[LOG_TRACE_RING_SIZE];
+};
+
+int log_tracing = 0;
+
+static __thread struct log_trace_ring *log_trace_ring;
+static struct log_trace_ring *log_trace_rings;
+static struct log_trace_site *log_trace_sites;
+static uint32_t log_trace_next_site_id;
+static pthread_mutex_t log_trace_sites_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t log_trace_next_thread;
+
+static FILE *log_trace_file;
+static pthread_t log_trace_writer;
+static int log_trace_running;
+
+static struct log_trace_ring *log_trace_allocate_ring()
+{
+	struct log_trace_ring *ring = calloc(1, sizeof(struct log_trace_ring));
+	if (!ring) {
+		return NULL;
+	}
+	ring->thread = __atomic_fetch_add(&log_trace_next_thread, 1, __ATOMIC_RELAXED);
+	ring->next = __atomic_load_n(&log_trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_trace_rings, &ring->next, ring, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) ;
+	return ring;
+}
+
+/*
+ * Runs once per site, so a lock is fine. The id is only published once the
+ * site is on the list, a thread that sees the id can't push a record the
+ * writer finds before the site.
+ */
+static uint32_t log_trace_register_site(struct log_trace_site *site)
+{
+	uint32_t id;
+
+	pthread_mutex_lock(&log_trace_sites_mutex);
+	id = __atomic_load_n(&site->id, __ATOMIC_RELAXED);
+	if (!id) {
+		/* Nobody got there first */
+		id = ++log_trace_next_site_id;
+		site->next = log_trace_sites;
+		__atomic_store_n(&log_trace_sites, site, __ATOMIC_RELEASE);
+		__atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log_trace_sites_mutex);
+	return id;
+}
+
+void log_trace_push(struct log_trace_site *site, unsigned int n_args, const uint64_t *args)
+{
+	struct log_trace_ring *ring = log_trace_ring;
+	struct log_trace_record *record;
+	struct timespec now;
+	uint32_t id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+	uint32_t head;
+	unsigned int i;
+
+	if (!ring) {
+		ring = log_trace_ring = log_trace_allocate_ring();
+		if (!ring) {
+			return;
+		}
+	}
+	if (!id) {
+		id = log_trace_register_site(site);
+	}
+
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_TRACE_RING_SIZE) {
+		ring->dropped++;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record = &ring->records[head & (LOG_TRACE_RING_SIZE - 1)];
+	record->timestamp = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	record->site = id;
+	record->n_args = n_args < LOG_TRACE_MAX_ARGS ? n_args : LOG_TRACE_MAX_ARGS;
+	for (i = 0; i < record->n_args; i++) {
+		record->args[i] = args[i];
+	}
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_trace_write_u32(uint32_t value)
+{
+	fwrite(&value, sizeof(value), 1, log_trace_file);
+}
+
+static void log_trace_write_sites()
+{
+	struct log_trace_site *site = __atomic_load_n(&log_trace_sites, __ATOMIC_ACQUIRE);
+
+	for (; site; site = site->next) {
+		if (site->written) {
+			/* Sites are pushed to the front, the rest is already written */
+			break;
+		}
+		log_trace_write_u32(LOG_TRACE_TAG_SITE);
+		log_trace_write_u32(site->id);
+		log_trace_write_u32(site->line);
+		log_trace_write_u32(strlen(site->file));
+		log_trace_write_u32(strlen(site->format));
+		fputs(site->file, log_trace_file);
+		fputs(site->format, log_trace_file);
+		site->written = 1;
+	}
+}
+
+static void log_trace_drain()
+{
+	struct log_trace_ring *ring;
+	uint32_t head, tail, count;
+
+	for (ring = __atomic_load_n(&log_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		/*
+		 * Sites are registered before their first record is pushed, so
+		 * the sites of the records up to head are on the list by now.
+		 */
+		log_trace_write_sites();
+		tail = ring->tail;
+		while (tail != head) {
+			/* Write up to the end of the ring in one go */
+			count = head - tail;
+			if ((tail & (LOG_TRACE_RING_SIZE - 1)) + count > LOG_TRACE_RING_SIZE) {
+				count = LOG_TRACE_RING_SIZE - (tail & (LOG_TRACE_RING_SIZE - 1));
+			}
+			log_trace_write_u32(LOG_TRACE_TAG_RECORDS);
+			log_trace_write_u32(ring->thread);
+			log_trace_write_u32(count);
+			fwrite(&ring->records[tail & (LOG_TRACE_RING_SIZE - 1)], sizeof(struct log_trace_record), count,
+			       log_trace_file);
+			tail += count;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+	fflush(log_trace_file);
+}
+
+static void *log_trace_writer_main(void *arg)
+{
+	while (__atomic_load_n(&log_trace_running, __ATOMIC_ACQUIRE)) {
+		usleep(LOG_TRACE_FLUSH_USEC);
+		log_trace_drain();
+	}
+	return NULL;
+}
+
+int log_trace_start(const char *file_name)
+{
+	log_trace_file = fopen(file_name, "w");
+	if (!log_trace_file) {
+		return -1;
+	}
+	fwrite(LOG_TRACE_MAGIC, strlen(LOG_TRACE_MAGIC), 1, log_trace_file);
+
+	log_trace_running = 1;
+	if (pthread_create(&log_trace_writer, NULL, log_trace_writer_main, NULL)) {
+		fclose(log_trace_file);
+		log_trace_file = NULL;
+		return -1;
+	}
+	log_tracing = 1;
+	return 0;
+}
+
+int log_trace_writer_thread(pthread_t *thread)
+{
+	if (!log_trace_file) {
+		return -1;
+	}
+	*thread = log_trace_writer;
+	return 0;
+}
+
+void log_trace_stop()
+{
+	struct log_trace_ring *ring;
+	uint64_t dropped = 0;
+
+	if (!log_trace_file) {
+		return;
+	}
+	log_tracing = 0;
+	__atomic_store_n(&log_trace_running, 0, __ATOMIC_RELEASE);
+	pthread_join(log_trace_writer, NULL);
+	log_trace_drain();
+	fclose(log_trace_file);
+	log_trace_file = NULL;
+
+	for (ring = log_trace_rings; ring; ring = ring->next) {
+		dropped += ring->dropped;
+	}
+	if (dropped) {
+		fprintf(stderr, "Trace: %llu records dropped\n", (unsigned long long)dropped);
+	}
+}
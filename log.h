@@ -1,6 +1,9 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#include <pthread.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 /* *INDENT-OFF* */
 extern "C" {
@@ -9,6 +12,7 @@ extern "C" {
 
 struct logger {
 	char *name;
+	/* Log everything from this logger, regardless of log_threshold */
 	int verbose;
 };
 
@@ -20,7 +24,106 @@ enum log_level {
 	DEBUG
 };
 
-void log_printf(struct logger *logger, enum log_level level, const char *format, ...);
+/*
+ * Statements above LOG_MAX_LEVEL are removed at compile time. "make RELEASE=1"
+ * sets it to INFO so the DEBUG statements on the capture path cost nothing.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL DEBUG
+#endif
+
+/* Messages above this level are only printed for verbose loggers. Defaults to INFO */
+extern enum log_level log_threshold;
+
+#define log_enabled(logger, level) \
+	((level) <= LOG_MAX_LEVEL && ((level) <= log_threshold || (logger)->verbose))
+
+/*
+ * The level is checked before any of the arguments are evaluated or
+ * formatted.
+ */
+#define log_printf(logger, level, ...) \
+	do { \
+		if (log_enabled(logger, level)) { \
+			log_print(logger, level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+void log_print(struct logger *logger, enum log_level level, const char *format, ...);
+
+/*
+ * Binary tracing.
+ *
+ * When tracing is on, log_trace() statements don't format anything. They
+ * push a fixed size record with the site, a timestamp and up to
+ * LOG_TRACE_MAX_ARGS integer arguments into a lock-free ring owned by the
+ * calling thread. A background thread drains the rings to the trace file,
+ * which is formatted offline with trace_dump. When tracing is off,
+ * log_trace() is the same as log_printf().
+ *
+ * Only integer arguments can be traced.
+ */
+#define LOG_TRACE_MAX_ARGS 4
+
+struct log_trace_site {
+	const char *file;
+	int line;
+	const char *format;
+	/* Assigned on first use, 0 until then */
+	uint32_t id;
+	struct log_trace_site *next;
+	int written;
+};
+
+struct log_trace_record {
+	/* CLOCK_MONOTONIC in nanoseconds */
+	uint64_t timestamp;
+	uint32_t site;
+	uint32_t n_args;
+	uint64_t args[LOG_TRACE_MAX_ARGS];
+};
+
+/* Set by log_trace_start(), don't change it directly */
+extern int log_tracing;
+
+#define log_trace(logger, level, format, ...) \
+	do { \
+		if ((level) <= LOG_MAX_LEVEL && log_tracing) { \
+			static struct log_trace_site log_trace_site = { __FILE__, __LINE__, format, 0, 0, 0 }; \
+			uint64_t log_trace_args[] = { 0, ##__VA_ARGS__ }; \
+			log_trace_push(&log_trace_site, sizeof(log_trace_args) / sizeof(log_trace_args[0]) - 1, \
+				       &log_trace_args[1]); \
+		} else { \
+			log_printf(logger, level, format, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+void log_trace_push(struct log_trace_site *site, unsigned int n_args, const uint64_t *args);
+
+/* Starts writing trace records to the file, returns 0 on success */
+int log_trace_start(const char *file_name);
+
+/* Writes the remaining records and closes the trace file */
+void log_trace_stop();
+
+/* Gets the thread writing the trace file, returns -1 if tracing is not running */
+int log_trace_writer_thread(pthread_t *thread);
+
+/*
+ * Trace file format, all integers in host byte order:
+ *
+ *  "SLTRACE1"
+ *  followed by entries, each starting with a uint32_t tag:
+ *   LOG_TRACE_TAG_SITE:    uint32_t id, uint32_t line, uint32_t file length,
+ *                          uint32_t format length, file, format
+ *   LOG_TRACE_TAG_RECORDS: uint32_t thread, uint32_t count,
+ *                          count * struct log_trace_record
+ *
+ * A site is always written before the first record that refers to it.
+ */
+#define LOG_TRACE_MAGIC "SLTRACE1"
+#define LOG_TRACE_TAG_SITE 1
+#define LOG_TRACE_TAG_RECORDS 2
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
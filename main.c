@@ -1,22 +1,92 @@
 // vim: sw=8:ts=8:noexpandtab
 #include "slogic.h"
+#include "compare.h"
+#include "glitch.h"
+#include "net.h"
+#include "shm.h"
+#include "squelch.h"
+#include "store.h"
+#include "rt.h"
+#include "stats.h"
+#include "timing.h"
 #include "usbutil.h"
 #include "log.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <libusb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+/* What main has always recorded when not told otherwise */
+#define DEFAULT_N_SAMPLES (24 * 1024 * 1024)
+#define DEFAULT_POLL_COUNT 1000
+#define NET_RING_SIZE (64 * 1024 * 1024)
+#define NET_CLOSE_TIMEOUT_MS 2000
+#define SHM_RING_SIZE (64 * 1024 * 1024)
+#define SHM_RING_FRAMES 16384
+/* Amount of the live capture kept in memory in compare mode, written out on a mismatch */
+#define COMPARE_HISTORY_SIZE (16 * 1024 * 1024)
+#define MAX_POLLFDS 16
+/* Longest wait for the device in one go, a ctrl-c right before the poll is noticed after this */
+#define MAX_POLL_WAIT_MS 1000
+/* Violations printed per timing rule, the ones after that are only counted */
+#define TIMING_MAX_REPORTS 100
+/* Threads hashing the chunks of a capture going into a store */
+#define STORE_WORKERS 2
+
 /* Command line arguments */
 struct slogic_sample_rate *sample_rate = NULL;
 const char *output_file_name = NULL;
 FILE *output_file;
+const char *gap_file_name = NULL;
+FILE *gap_file;
+const char *trace_file_name = NULL;
+const char *net_address = NULL;
+struct slogic_net_server *net_server;
+const char *shm_socket_path = NULL;
+struct slogic_shm_producer *shm_producer;
+const char *store_directory = NULL;
+const char *store_capture_name = NULL;
+struct slogic_store *store;
+uint64_t n_delivered = 0;
+/* Samples estimated lost in recovery gaps, the sample offsets of the streams skip them */
+uint64_t n_lost = 0;
+bool stats_mode = false;
+struct slogic_stats stats;
+bool glitch_filter_enabled = false;
+unsigned int glitch_widths[SLOGIC_N_CHANNELS];
+struct slogic_glitch_filter glitch_filter;
 size_t n_samples = 0;
+const char *pattern_file_name = NULL;
+bool pattern_loop = false;
+unsigned int poll_depth = 0;
+int consumer_cpu = -1;
+bool lock_memory = false;
+bool jitter_report = false;
+struct slogic_jitter jitter;
+const char *compare_file_name = NULL;
+uint8_t compare_mask = 0xff;
+bool compare_align = false;
+struct slogic_compare compare;
+bool compare_done = false;
+uint8_t *compare_history;
+uint64_t compare_history_size = 0;
+const char *timing_rules_file_name = NULL;
+struct slogic_timing_checker timing;
+bool squelch_enabled = false;
+uint64_t squelch_pre, squelch_post;
+struct slogic_squelch squelch;
+volatile sig_atomic_t interrupted = 0;
+bool pollfds_changed;
 
 const char *me = "main";
 
@@ -44,9 +114,39 @@ void full_usage()
 	fprintf(stderr, "usage: %s -f <output file> -r <sample rate> [-n <number of samples>]\n", me);
 	fprintf(stderr, "\n");
 	fprintf(stderr, " -n: Number of samples to record\n");
-	fprintf(stderr, "     Defaults to one second of samples for the specified sample rate\n");
+	fprintf(stderr, "     Defaults to %d samples\n", DEFAULT_N_SAMPLES);
 	fprintf(stderr, " -f: The output file. Using '-' means that the bytes will be output to stdout.\n");
 	fprintf(stderr, " -h: This help message.\n");
+	fprintf(stderr, " -G: Remove pulses shorter than the given number of samples.\n");
+	fprintf(stderr, "     Either one width for all channels or a list of <channel>=<width>, e.g. 0=3,5=10.\n");
+	fprintf(stderr, "     The maximum width is %d.\n", SLOGIC_GLITCH_MAX_WIDTH);
+	fprintf(stderr, " -p: Output the samples in this file on the channels instead of recording.\n");
+	fprintf(stderr, "     Experimental, needs -X: the start playback command is a guess.\n");
+	fprintf(stderr, " -l: Repeat the pattern given with -p until interrupted.\n");
+	fprintf(stderr, " -X: Allow the experimental commands that haven't been traced from the original software.\n");
+	fprintf(stderr, " -P: Poll the input byte with this many reads in flight instead of recording.\n");
+	fprintf(stderr, "     Writes '<seq> <time> <value>' lines, -n is the number of reads. -r is not needed.\n");
+	fprintf(stderr, " -N: Serve the samples to clients connecting to unix:<path> or [<host>:]<port>.\n");
+	fprintf(stderr, "     Can be combined with -f. Use net_cat to receive them.\n");
+	fprintf(stderr, " -M: Publish the samples in shared memory for readers attaching through this Unix socket.\n");
+	fprintf(stderr, "     Can be combined with -f and -N. Use shm_cat to read them.\n");
+	fprintf(stderr, " -D: Add the capture to the deduplicating store in this directory.\n");
+	fprintf(stderr, "     Can be combined with -f. Use store_cat to get it back.\n");
+	fprintf(stderr, " -I: Name of the capture in the store. Defaults to the date and time, with a -<n> suffix\n");
+	fprintf(stderr, "     if a capture of that name exists.\n");
+	fprintf(stderr, " -C: Compare the samples against this golden capture instead of writing them.\n");
+	fprintf(stderr, "     Stops at the first mismatch. The output file is only written on a mismatch and then\n");
+	fprintf(stderr, "     gets the last %d MB of the capture. Exits with 0 if all of the golden capture matched.\n",
+		COMPARE_HISTORY_SIZE / (1024 * 1024));
+	fprintf(stderr, " -K: Only compare the channels in this mask, e.g. 0x0f.\n");
+	fprintf(stderr, " -A: Start comparing at the first edge on the compared channels of either capture.\n");
+	fprintf(stderr, " -V: Check the samples against the timing rules in this file while recording.\n");
+	fprintf(stderr, "     Violations go to stderr. Exits with 1 if there were any.\n");
+	fprintf(stderr, " -Q: Only keep the samples around activity, <pre>[:<post>] samples before the first\n");
+	fprintf(stderr, "     and after the last transition of a burst. Post defaults to pre. The output file\n");
+	fprintf(stderr, "     is a sparse capture, use squelch_cat to expand it.\n");
+	fprintf(stderr, " -S: Only compute signal statistics and write a report instead of the samples.\n");
+	fprintf(stderr, "     The report goes to the output file if one is given, stdout otherwise.\n");
 	fprintf(stderr, " -r: Select sample rate for the Logic.\n");
 	fprintf(stderr, "     Available sample rates:\n");
 	while (sample_iterator->text != NULL) {
@@ -59,17 +159,63 @@ void full_usage()
 	fprintf(stderr, " -t: Number of transfer buffers.\n");
 	fprintf(stderr, " -o: Transfer timeout.\n");
 	fprintf(stderr, " -u: libusb debug level: 0 to 3, 3 is most verbose. Defaults to '0'.\n");
+	fprintf(stderr, " -R: Number of times to recover from device timeouts and resets. Defaults to '0'.\n");
+	fprintf(stderr, " -g: Write a record for every gap caused by a recovery to this file. The output file\n");
+	fprintf(stderr, "     only has the samples captured, the records tell where samples are missing. The -N\n");
+	fprintf(stderr, "     and -M streams skip the lost samples in their sample offsets, with or without -g.\n");
+	fprintf(stderr, " -d: Turn on debug output.\n");
+	fprintf(stderr, " -c: Pin the thread handling the USB events to this CPU.\n");
+	fprintf(stderr, " -F: Run the thread handling the USB events with SCHED_FIFO at this priority (1-99).\n");
+	fprintf(stderr, " -w: Pin the helper threads to this CPU: the trace writer, the pattern reader, the -N\n");
+	fprintf(stderr, "     network thread, the -M ring thread and the -D hashing workers and pack writer.\n");
+	fprintf(stderr, " -m: Lock all memory with mlockall.\n");
+	fprintf(stderr, " -J: Measure the event loop jitter and print a histogram when done.\n");
+	fprintf(stderr, " -T: Write a binary trace to this file instead of printing debug output.\n");
+	fprintf(stderr, "     Use trace_dump to format it.\n");
 	fprintf(stderr, "\n");
 }
 
+/* Parses "<width>" or "<channel>=<width>[,...]" */
+bool parse_glitch_widths(const char *str, unsigned int *widths)
+{
+	char *endptr;
+	long channel, width;
+
+	if (!strchr(str, '=')) {
+		width = strtol(str, &endptr, 10);
+		if (*endptr != '\0' || width < 0 || width > SLOGIC_GLITCH_MAX_WIDTH) {
+			return false;
+		}
+		for (channel = 0; channel < SLOGIC_N_CHANNELS; channel++) {
+			widths[channel] = width;
+		}
+		return true;
+	}
+
+	while (*str) {
+		channel = strtol(str, &endptr, 10);
+		if (*endptr != '=' || channel < 0 || channel >= SLOGIC_N_CHANNELS) {
+			return false;
+		}
+		width = strtol(endptr + 1, &endptr, 10);
+		if ((*endptr != '\0' && *endptr != ',') || width < 0 || width > SLOGIC_GLITCH_MAX_WIDTH) {
+			return false;
+		}
+		widths[channel] = width;
+		str = *endptr ? endptr + 1 : endptr;
+	}
+	return true;
+}
+
 /* Returns true if everything was OK */
 bool parse_args(int argc, char **argv, struct slogic_handle *handle)
 {
 	int c;
 	int libusb_debug_level = 0;
 	char *endptr;
-	/* TODO: Add a -d flag to turn on internal debugging */
-	while ((c = getopt(argc, argv, "n:f:r:hb:t:o:u:")) != -1) {
+	long mask;
+	long long pre, post;
+	while ((c = getopt(argc, argv, "n:f:r:hb:t:o:u:R:g:dT:SG:p:lXP:c:F:w:mJN:M:D:I:C:K:AV:Q:")) != -1) {
 		switch (c) {
 		case 'n':
 			n_samples = strtol(optarg, &endptr, 10);
@@ -121,6 +267,119 @@ bool parse_args(int argc, char **argv, struct slogic_handle *handle)
 			}
 			libusb_set_debug(handle->context, libusb_debug_level);
 			break;
+		case 'R':
+			handle->max_recoveries = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || optarg[0] == '-') {
+				short_usage("Invalid number of recoveries, must be a positive integer: %s", optarg);
+				return false;
+			}
+			break;
+		case 'g':
+			gap_file_name = optarg;
+			break;
+		case 'd':
+			log_threshold = DEBUG;
+			break;
+		case 'T':
+			trace_file_name = optarg;
+			break;
+		case 'S':
+			stats_mode = true;
+			break;
+		case 'G':
+			if (!parse_glitch_widths(optarg, glitch_widths)) {
+				short_usage("Invalid glitch filter widths: %s", optarg);
+				return false;
+			}
+			glitch_filter_enabled = true;
+			break;
+		case 'p':
+			pattern_file_name = optarg;
+			break;
+		case 'l':
+			pattern_loop = true;
+			break;
+		case 'X':
+			handle->experimental_commands = true;
+			break;
+		case 'P':
+			poll_depth = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || optarg[0] == '-' || poll_depth == 0) {
+				short_usage("Invalid poll depth, must be a positive integer: %s", optarg);
+				return false;
+			}
+			break;
+		case 'c':
+			handle->event_cpu = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || handle->event_cpu < 0) {
+				short_usage("Invalid CPU, must be a positive integer: %s", optarg);
+				return false;
+			}
+			break;
+		case 'F':
+			handle->event_priority = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || handle->event_priority < 1 || handle->event_priority > 99) {
+				short_usage("Invalid priority, must be between 1 and 99: %s", optarg);
+				return false;
+			}
+			break;
+		case 'w':
+			consumer_cpu = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || consumer_cpu < 0) {
+				short_usage("Invalid CPU, must be a positive integer: %s", optarg);
+				return false;
+			}
+			break;
+		case 'm':
+			lock_memory = true;
+			break;
+		case 'N':
+			net_address = optarg;
+			break;
+		case 'M':
+			shm_socket_path = optarg;
+			break;
+		case 'D':
+			store_directory = optarg;
+			break;
+		case 'I':
+			store_capture_name = optarg;
+			break;
+		case 'J':
+			jitter_report = true;
+			handle->jitter = &jitter;
+			break;
+		case 'C':
+			compare_file_name = optarg;
+			break;
+		case 'K':
+			mask = strtol(optarg, &endptr, 0);
+			if (*endptr != '\0' || mask < 1 || mask > 0xff) {
+				short_usage("Invalid channel mask, must be between 0x01 and 0xff: %s", optarg);
+				return false;
+			}
+			compare_mask = mask;
+			break;
+		case 'A':
+			compare_align = true;
+			break;
+		case 'V':
+			timing_rules_file_name = optarg;
+			break;
+		case 'Q':
+			pre = strtoll(optarg, &endptr, 10);
+			post = pre;
+			if (*endptr == ':') {
+				post = strtoll(endptr + 1, &endptr, 10);
+			}
+			if (*endptr != '\0' || pre < 0 || post < 0) {
+				short_usage("Invalid squelch window, must be <pre>[:<post>] samples: %s", optarg);
+				return false;
+			}
+			squelch_enabled = true;
+			squelch_pre = pre;
+			squelch_post = post;
+			break;
 		default:
 		case '?':
 			short_usage("Unknown argument: %c. Use %s -h for usage.", optopt, me);
@@ -128,38 +387,84 @@ bool parse_args(int argc, char **argv, struct slogic_handle *handle)
 		}
 	}
 
-	if (!output_file_name) {
+	if ((net_address || shm_socket_path) && (stats_mode || poll_depth || pattern_file_name)) {
+		short_usage("-N and -M can't be combined with -S, -P or -p.", optarg);
+		return false;
+	}
+
+	if (store_directory && (stats_mode || poll_depth || pattern_file_name || compare_file_name)) {
+		short_usage("-D can't be combined with -S, -P, -p or -C.", optarg);
+		return false;
+	}
+
+	if (store_capture_name && !store_directory) {
+		short_usage("-I requires a store directory.", optarg);
+		return false;
+	}
+
+	if (compare_file_name && (stats_mode || poll_depth || pattern_file_name || net_address || shm_socket_path)) {
+		short_usage("-C can't be combined with -S, -P, -p, -N or -M.", optarg);
+		return false;
+	}
+
+	if (timing_rules_file_name && (poll_depth || pattern_file_name)) {
+		short_usage("-V can't be combined with -P or -p.", optarg);
+		return false;
+	}
+
+	if (squelch_enabled && (stats_mode || poll_depth || pattern_file_name || compare_file_name)) {
+		short_usage("-Q can't be combined with -S, -P, -p or -C.", optarg);
+		return false;
+	}
+
+	if (squelch_enabled && !output_file_name) {
+		short_usage("-Q requires an output file.", optarg);
+		return false;
+	}
+
+	if (pattern_file_name && !handle->experimental_commands) {
+		short_usage("-p is experimental, add -X to use it.", optarg);
+		return false;
+	}
+
+	if (pattern_loop && !pattern_file_name) {
+		short_usage("-l requires a pattern file.", optarg);
+		return false;
+	}
+
+	if (!output_file_name && !stats_mode && !pattern_file_name && !net_address && !shm_socket_path
+	    && !store_directory && !compare_file_name && !timing_rules_file_name) {
 		short_usage("An output file has to be specified.", optarg);
 		return false;
 	}
 
+	if (poll_depth) {
+		if (!n_samples) {
+			n_samples = DEFAULT_POLL_COUNT;
+		}
+		return true;
+	}
+
 	if (!sample_rate) {
 		short_usage("A sample rate has to be specified.", optarg);
 		return false;
 	}
 
-	if (!n_samples) {
-		n_samples = sample_rate->samples_per_second;
+	/* Compare mode defaults to the length of the golden capture, which is only known once it is opened */
+	if (!n_samples && !compare_file_name) {
+		n_samples = DEFAULT_N_SAMPLES;
 	}
 
 	return true;
 }
 
-int count = 0;
-int sum = 0;
-bool on_data_callback(uint8_t * data, size_t size, void *user_data)
+void write_samples(const uint8_t * data, size_t size)
 {
-	bool more = sum < 24 * 1024 * 1024;
 	size_t bytes_written = 0;
-	size_t n;
+	size_t n = 0;
 
-	if (size == 0) {
-		more = 0;
-	}
-	log_printf(&logger, DEBUG, "Got sample: size: %zu, #samples: %d, aggregate size: %d, more: %d\n", size, count,
-		   sum, more);
 	do {
-		log_printf(&logger, DEBUG, "%i %i\n", bytes_written, n);
+		log_trace(&logger, DEBUG, "%zu %zu\n", bytes_written, n);
 		n = fwrite(&data[bytes_written], sizeof(char), size - bytes_written, output_file);
 		if (n <= 0) {
 			log_printf(&logger, WARNING, "Error while writing data to the file %s", output_file_name);
@@ -167,19 +472,522 @@ bool on_data_callback(uint8_t * data, size_t size, void *user_data)
 		}
 		bytes_written += n;
 	} while (bytes_written != size);
+}
 
-	count++;
-	sum += size;
+/* Keeps the last COMPARE_HISTORY_SIZE samples in a ring */
+void keep_history(const uint8_t * data, size_t size)
+{
+	size_t offset, n;
+
+	if (size > COMPARE_HISTORY_SIZE) {
+		compare_history_size += size - COMPARE_HISTORY_SIZE;
+		data += size - COMPARE_HISTORY_SIZE;
+		size = COMPARE_HISTORY_SIZE;
+	}
+	offset = compare_history_size % COMPARE_HISTORY_SIZE;
+	n = size < COMPARE_HISTORY_SIZE - offset ? size : COMPARE_HISTORY_SIZE - offset;
+	memcpy(&compare_history[offset], data, n);
+	memcpy(compare_history, &data[n], size - n);
+	compare_history_size += size;
+}
+
+/* Writes the ring to the output file and returns the index of its first sample */
+uint64_t write_history()
+{
+	uint64_t start = compare_history_size > COMPARE_HISTORY_SIZE ? compare_history_size - COMPARE_HISTORY_SIZE : 0;
+	size_t offset = start % COMPARE_HISTORY_SIZE;
+	size_t size = compare_history_size - start;
+	size_t n = size < COMPARE_HISTORY_SIZE - offset ? size : COMPARE_HISTORY_SIZE - offset;
+
+	write_samples(&compare_history[offset], n);
+	if (n < size) {
+		write_samples(compare_history, size - n);
+	}
+	return start;
+}
+
+void compare_samples(const uint8_t * data, size_t size)
+{
+	if (compare_done) {
+		return;
+	}
+	if (compare_history) {
+		keep_history(data, size);
+	}
+	if (slogic_compare_feed(&compare, data, size) != SLOGIC_COMPARE_MORE) {
+		compare_done = true;
+	}
+}
+
+/*
+ * Prints the result of the comparison to stderr, as the output file can be
+ * stdout, and returns the exit status. The history is only written on a
+ * mismatch.
+ */
+int report_comparison()
+{
+	uint64_t start;
+
+	switch (compare.result) {
+	case SLOGIC_COMPARE_MATCH:
+		fprintf(stderr, "match: %llu samples from sample %llu\n", (unsigned long long)compare.compared,
+			(unsigned long long)compare.live_start);
+		return EXIT_SUCCESS;
+	case SLOGIC_COMPARE_MISMATCH:
+		fprintf(stderr, "mismatch: sample %llu (golden sample %llu) channel %d expected 0x%02x got 0x%02x\n",
+			(unsigned long long)compare.mismatch_sample, (unsigned long long)compare.golden_sample,
+			compare.channel, compare.expected, compare.actual);
+		break;
+	default:
+		fprintf(stderr, "incomplete: %llu of %zu samples compared\n", (unsigned long long)compare.compared,
+			slogic_compare_golden_samples(&compare));
+		return EXIT_FAILURE;
+	}
+
+	if (!compare_history) {
+		return EXIT_FAILURE;
+	}
+	if (output_file_name[0] == '-') {
+		output_file = stdout;
+	} else {
+		output_file = fopen(output_file_name, "w");
+		if (!output_file) {
+			perror("opening output file");
+			return EXIT_FAILURE;
+		}
+	}
+	start = write_history();
+	if (output_file != stdout) {
+		fclose(output_file);
+	}
+	log_printf(&logger, INFO, "Wrote samples %llu to %llu to %s\n", (unsigned long long)start,
+		   (unsigned long long)compare_history_size, output_file_name);
+	return EXIT_FAILURE;
+}
+
+void on_violation(const struct slogic_timing_violation *violation, void *user_data)
+{
+	if (violation->rule->violations > TIMING_MAX_REPORTS) {
+		return;
+	}
+	fprintf(stderr, "violation at sample %llu, clock edge %llu, %llu samples: %s\n",
+		(unsigned long long)violation->position, (unsigned long long)violation->reference,
+		(unsigned long long)violation->samples, violation->rule->text);
+	if (violation->rule->violations == TIMING_MAX_REPORTS) {
+		fprintf(stderr, "further violations are only counted: %s\n", violation->rule->text);
+	}
+}
+
+/* Hands the samples to whatever consumes them in the current mode */
+void deliver_samples(const uint8_t * data, size_t size)
+{
+	if (stats_mode) {
+		slogic_stats_feed(&stats, data, size);
+		return;
+	}
+	if (compare_file_name) {
+		compare_samples(data, size);
+		return;
+	}
+	if (output_file) {
+		if (squelch_enabled) {
+			slogic_squelch_feed(&squelch, data, size);
+		} else {
+			write_samples(data, size);
+		}
+	}
+	if (net_server) {
+		slogic_net_server_send(net_server, n_delivered + n_lost, data, size);
+	}
+	if (shm_producer) {
+		slogic_shm_publish(shm_producer, n_delivered + n_lost, data, size);
+	}
+	if (store) {
+		slogic_store_feed(store, data, size);
+	}
+	n_delivered += size;
+}
+
+int count = 0;
+uint64_t sum = 0;
+bool on_data_callback(uint8_t * data, size_t size, void *user_data)
+{
+	bool more = sum + size < n_samples;
+
+	log_trace(&logger, DEBUG, "Got sample: size: %zu, #samples: %d, aggregate size: %llu, more: %d\n", size,
+		  count, (unsigned long long)sum, more);
 	if (size == 0) {
 		printf("logic level buffer overun\n");
 		exit(EXIT_FAILURE);
 	}
-	return more;
+
+	/* The last transfer carries more than was asked for, everything gets exactly n_samples */
+	if (!more) {
+		size = n_samples - sum;
+	}
+
+	/* The timing rules see the samples before the glitch filter, which would hide short pulses */
+	if (timing_rules_file_name) {
+		slogic_timing_feed(&timing, data, size);
+	}
+
+	if (glitch_filter_enabled) {
+		const uint8_t *filtered;
+		size_t n = slogic_glitch_filter_feed(&glitch_filter, data, size, &filtered);
+		/* The filter holds back samples until it knows whether a pulse is a glitch */
+		if (n) {
+			deliver_samples(filtered, n);
+		}
+	} else {
+		deliver_samples(data, size);
+	}
+
+	count++;
+	sum += size;
+	return more && !compare_done;
+}
+
+/*
+ * The network and shared memory streams mark the gap in-band: the next
+ * samples go out at an offset that skips the samples lost, and the readers
+ * report the jump. The output file holds only captured samples, the gap
+ * file has one line per gap: the sample offset where the gap is in the
+ * output file, the start and end time of the gap, the estimated number of
+ * samples lost and the reason, an enum slogic_recording_state.
+ */
+void on_gap_callback(const struct slogic_gap *gap, void *user_data)
+{
+	n_lost += gap->lost_samples;
+	if (!gap_file) {
+		return;
+	}
+	fprintf(gap_file, "gap sample_offset=%llu start=%ld.%06ld end=%ld.%06ld lost_samples=%llu reason=%d\n",
+		(unsigned long long)gap->sample_offset,
+		(long)gap->start.tv_sec, (long)gap->start.tv_usec,
+		(long)gap->end.tv_sec, (long)gap->end.tv_usec, (unsigned long long)gap->lost_samples, gap->reason);
+	fflush(gap_file);
+}
+
+/* Pins a helper thread to the CPU given with -w, if any */
+void pin_consumer_thread(pthread_t thread, const char *what)
+{
+	if (consumer_cpu >= 0 && slogic_rt_pin_thread(thread, consumer_cpu)) {
+		fprintf(stderr, "pinning %s: %s\n", what, strerror(errno));
+	}
+}
+
+/*
+ * Pattern playback. A reader thread fills one buffer from the pattern file
+ * while the other one is handed to slogic, so a slow disk does not stall the
+ * USB callbacks until both buffers are drained. With -l the whole file is
+ * kept in memory and repeated instead.
+ */
+#define PATTERN_BUFFER_SIZE (1024 * 1024)
+
+struct pattern_reader {
+	FILE *file;
+	uint8_t *buffers[2];
+	size_t fill[2];
+	/* Buffer being consumed by the fill callback and the position in it */
+	int current;
+	size_t position;
+	bool eof;
+	bool stop;
+	/* Number of times the fill callback had to wait for the reader thread */
+	uint64_t stalls;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+struct pattern_reader pattern;
+
+void *pattern_reader_thread(void *arg)
+{
+	struct pattern_reader *reader = arg;
+	int index = 0;
+	size_t n;
+
+	for (;;) {
+		pthread_mutex_lock(&reader->mutex);
+		while (reader->fill[index] != 0 && !reader->stop) {
+			pthread_cond_wait(&reader->cond, &reader->mutex);
+		}
+		if (reader->stop) {
+			pthread_mutex_unlock(&reader->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&reader->mutex);
+
+		n = fread(reader->buffers[index], 1, PATTERN_BUFFER_SIZE, reader->file);
+
+		pthread_mutex_lock(&reader->mutex);
+		if (n == 0) {
+			reader->eof = true;
+		}
+		reader->fill[index] = n;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->mutex);
+
+		if (n == 0) {
+			break;
+		}
+		index = !index;
+	}
+	return NULL;
+}
+
+size_t on_fill_callback(uint8_t * buffer, size_t size, void *user_data)
+{
+	struct pattern_reader *reader = user_data;
+	size_t n;
+
+	if (interrupted) {
+		/* Ends the pattern here, what is queued still goes out */
+		return 0;
+	}
+	pthread_mutex_lock(&reader->mutex);
+	if (reader->fill[reader->current] == 0 && !reader->eof) {
+		reader->stalls++;
+		while (reader->fill[reader->current] == 0 && !reader->eof) {
+			pthread_cond_wait(&reader->cond, &reader->mutex);
+		}
+	}
+	n = reader->fill[reader->current] - reader->position;
+	pthread_mutex_unlock(&reader->mutex);
+
+	if (n == 0) {
+		return 0;
+	}
+	if (n > size) {
+		n = size;
+	}
+	memcpy(buffer, reader->buffers[reader->current] + reader->position, n);
+	reader->position += n;
+
+	if (reader->position == reader->fill[reader->current]) {
+		pthread_mutex_lock(&reader->mutex);
+		reader->fill[reader->current] = 0;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->mutex);
+		reader->current = !reader->current;
+		reader->position = 0;
+	}
+	return n;
+}
+
+size_t on_fill_loop_callback(uint8_t * buffer, size_t size, void *user_data)
+{
+	struct pattern_reader *reader = user_data;
+	size_t filled = 0;
+	size_t n;
+
+	if (interrupted) {
+		return 0;
+	}
+	while (filled < size) {
+		n = reader->fill[0] - reader->position;
+		if (n > size - filled) {
+			n = size - filled;
+		}
+		memcpy(buffer + filled, reader->buffers[0] + reader->position, n);
+		filled += n;
+		reader->position += n;
+		if (reader->position == reader->fill[0]) {
+			reader->position = 0;
+		}
+	}
+	return filled;
+}
+
+/* Return 0 on success */
+int pattern_reader_start(struct pattern_reader *reader, FILE *file, bool loop)
+{
+	long size;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->file = file;
+	pthread_mutex_init(&reader->mutex, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+
+	if (loop) {
+		if (fseek(file, 0, SEEK_END) || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET)) {
+			return -1;
+		}
+		reader->buffers[0] = malloc(size);
+		if (!reader->buffers[0] || fread(reader->buffers[0], 1, size, file) != (size_t)size) {
+			return -1;
+		}
+		reader->fill[0] = size;
+		return 0;
+	}
+
+	reader->buffers[0] = malloc(PATTERN_BUFFER_SIZE);
+	reader->buffers[1] = malloc(PATTERN_BUFFER_SIZE);
+	if (!reader->buffers[0] || !reader->buffers[1]) {
+		return -1;
+	}
+	if (pthread_create(&reader->thread, NULL, pattern_reader_thread, reader)) {
+		return -1;
+	}
+	pin_consumer_thread(reader->thread, "the pattern reader");
+	return 0;
+}
+
+void pattern_reader_stop(struct pattern_reader *reader, bool loop)
+{
+	if (!loop) {
+		pthread_mutex_lock(&reader->mutex);
+		reader->stop = true;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->mutex);
+		pthread_join(reader->thread, NULL);
+	}
+	free(reader->buffers[0]);
+	free(reader->buffers[1]);
+	pthread_mutex_destroy(&reader->mutex);
+	pthread_cond_destroy(&reader->cond);
+}
+
+void on_interrupt(int signum)
+{
+	interrupted = 1;
+}
+
+/*
+ * The first SIGINT or SIGTERM sets interrupted, which the recording, playback
+ * and poll loops check to stop cleanly. A second one kills the program.
+ */
+void catch_interrupts()
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_interrupt;
+	action.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+}
+
+void release_interrupts()
+{
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+}
+
+int play_pattern(struct slogic_handle *handle)
+{
+	struct slogic_playback playback;
+	FILE *file;
+	int ret;
+
+	file = fopen(pattern_file_name, "r");
+	if (!file) {
+		perror("opening pattern file");
+		return -1;
+	}
+	if (pattern_reader_start(&pattern, file, pattern_loop)) {
+		log_printf(&logger, ERR, "Failed to read the pattern file %s\n", pattern_file_name);
+		fclose(file);
+		return -1;
+	}
+
+	slogic_fill_playback(&playback, sample_rate, pattern_loop ? on_fill_loop_callback : on_fill_callback,
+			     &pattern);
+	catch_interrupts();
+	ret = slogic_execute_playback(handle, &playback);
+	release_interrupts();
+	if (interrupted) {
+		log_printf(&logger, INFO, "Interrupted, stopped the playback\n");
+	}
+
+	log_printf(&logger, INFO, "Sent %llu bytes, %llu underruns, %llu file read stalls\n",
+		   (unsigned long long)playback.bytes_sent, (unsigned long long)playback.underruns,
+		   (unsigned long long)pattern.stalls);
+
+	pattern_reader_stop(&pattern, pattern_loop);
+	fclose(file);
+	return ret;
+}
+
+void on_pollfd_added(int fd, short events, void *user_data)
+{
+	pollfds_changed = true;
+}
+
+void on_pollfd_removed(int fd, void *user_data)
+{
+	pollfds_changed = true;
+}
+
+/*
+ * Runs the recording from a poll loop of our own instead of with
+ * slogic_execute_recording, so that ctrl-c can stop it cleanly: the
+ * transfers are drained and the samples so far are handled as if the number
+ * of samples had been reached. A second ctrl-c kills the program.
+ */
+int record(struct slogic_handle *handle, struct slogic_recording *recording)
+{
+	struct pollfd fds[MAX_POLLFDS];
+	struct slogic_rt_state *rt_state;
+	struct timeval tv;
+	int n_fds = 0;
+	int timeout;
+	int ret;
+
+	catch_interrupts();
+	rt_state = slogic_rt_enter(handle);
+	slogic_set_pollfd_notifiers(handle, on_pollfd_added, on_pollfd_removed, NULL);
+	pollfds_changed = true;
+	if (slogic_start_recording(handle, recording)) {
+		slogic_rt_leave(rt_state);
+		release_interrupts();
+		return -1;
+	}
+
+	while (!interrupted) {
+		if (pollfds_changed) {
+			pollfds_changed = false;
+			n_fds = slogic_get_pollfds(handle, fds, MAX_POLLFDS);
+			if (n_fds < 0 || n_fds > MAX_POLLFDS) {
+				log_printf(&logger, ERR, "Can't wait for %d descriptors\n", n_fds);
+				break;
+			}
+		}
+		timeout = MAX_POLL_WAIT_MS;
+		if (slogic_get_next_timeout(handle, &tv) == 1 && tv.tv_sec * 1000 + tv.tv_usec / 1000 < timeout) {
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		}
+		if (poll(fds, n_fds, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		if (slogic_handle_events_nonblocking(handle) <= 0) {
+			break;
+		}
+	}
+	if (interrupted) {
+		log_printf(&logger, INFO, "Interrupted, stopping the recording\n");
+	}
+
+	ret = slogic_stop_recording(handle);
+	slogic_set_pollfd_notifiers(handle, NULL, NULL, NULL);
+	slogic_rt_leave(rt_state);
+	release_interrupts();
+	return ret;
+}
+
+bool on_poll_callback(const struct slogic_poll_sample *sample, void *user_data)
+{
+	fprintf(output_file, "%llu %ld.%06ld 0x%02x\n", (unsigned long long)sample->seq,
+		(long)sample->timestamp.tv_sec, (long)sample->timestamp.tv_usec, sample->value);
+	return !interrupted && sample->seq + 1 < n_samples;
 }
 
 int main(int argc, char **argv)
 {
 	struct slogic_recording recording;
+	int ret;
 
 	struct slogic_handle *handle = slogic_init();
 	if (!handle) {
@@ -191,6 +999,10 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (lock_memory && slogic_rt_lock_memory()) {
+		perror("mlockall");
+	}
+
 	if (slogic_open(handle) != 0) {
 		log_printf(&logger, INFO, "Failed to open the logic analyzer\n");
 		exit(EXIT_FAILURE);
@@ -203,7 +1015,33 @@ int main(int argc, char **argv)
 		return 42;
 	}
 
-	if (output_file_name) {
+	if (pattern_file_name) {
+		ret = play_pattern(handle);
+		slogic_close(handle);
+		exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (compare_file_name) {
+		/* The output file is opened on a mismatch, so that a passing run doesn't touch it */
+		if (slogic_compare_open(&compare, compare_file_name, compare_mask, compare_align)) {
+			exit(EXIT_FAILURE);
+		}
+		if (!n_samples) {
+			/* Leave a second to wait for the first edge */
+			n_samples = slogic_compare_golden_samples(&compare) + sample_rate->samples_per_second;
+		}
+		if (output_file_name) {
+			compare_history = malloc(COMPARE_HISTORY_SIZE);
+			if (!compare_history) {
+				log_printf(&logger, ERR, "Failed to allocate the capture history\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else if (!output_file_name) {
+		/* Only the sinks or checks if that was all that was asked for */
+		output_file = net_address || shm_socket_path || store_directory || timing_rules_file_name ?
+		    NULL : stdout;
+	} else {
 		if (output_file_name[0] == '-') {
 			log_printf(&logger, DEBUG, "Using stdout\n");
 			output_file = stdout;
@@ -217,13 +1055,190 @@ int main(int argc, char **argv)
 		}
 
 	}
+	if (poll_depth) {
+		struct slogic_poll poll;
+
+		slogic_fill_poll(&poll, poll_depth, on_poll_callback, NULL);
+		catch_interrupts();
+		ret = slogic_execute_poll(handle, &poll);
+		release_interrupts();
+		slogic_close(handle);
+		exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (gap_file_name) {
+		gap_file = fopen(gap_file_name, "w");
+		if (!gap_file) {
+			perror("opening gap file");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (trace_file_name && log_trace_start(trace_file_name)) {
+		perror("opening trace file");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t writer;
+	if (log_trace_writer_thread(&writer) == 0) {
+		pin_consumer_thread(writer, "the trace writer");
+	}
+
+	if (net_address) {
+		net_server = slogic_net_server_open(net_address, NET_RING_SIZE);
+		if (!net_server) {
+			exit(EXIT_FAILURE);
+		}
+		pin_consumer_thread(slogic_net_server_thread(net_server), "the network thread");
+	}
+	if (shm_socket_path) {
+		shm_producer = slogic_shm_producer_open(shm_socket_path, SHM_RING_SIZE, SHM_RING_FRAMES);
+		if (!shm_producer) {
+			exit(EXIT_FAILURE);
+		}
+		pin_consumer_thread(slogic_shm_producer_thread(shm_producer), "the ring thread");
+	}
+
+	if (timing_rules_file_name) {
+		slogic_timing_init(&timing, on_violation, NULL);
+		if (slogic_timing_load(&timing, timing_rules_file_name, sample_rate->samples_per_second)) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (squelch_enabled
+	    && slogic_squelch_init(&squelch, output_file, squelch_pre, squelch_post, sample_rate->samples_per_second)) {
+		exit(EXIT_FAILURE);
+	}
+
+	slogic_stats_init(&stats);
+	if (glitch_filter_enabled && slogic_glitch_filter_init(&glitch_filter, glitch_widths)) {
+		log_printf(&logger, ERR, "Failed to set up the glitch filter\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Last, nothing but the recording can fail once the capture has begun */
+	if (store_directory) {
+		char date[32], unique[48];
+		const char *name = store_capture_name;
+		time_t now = time(NULL);
+		pthread_t store_threads[STORE_WORKERS + 1];
+		unsigned int n, i;
+
+		store = slogic_store_open(store_directory, STORE_WORKERS);
+		if (!store) {
+			exit(EXIT_FAILURE);
+		}
+		n = slogic_store_threads(store, store_threads, STORE_WORKERS + 1);
+		for (i = 0; i < n && i < STORE_WORKERS + 1; i++) {
+			pin_consumer_thread(store_threads[i], "a store thread");
+		}
+		if (!name) {
+			/* Don't replace a capture taken in the same second */
+			strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime(&now));
+			name = date;
+			for (n = 2; slogic_store_contains(store, name); n++) {
+				snprintf(unique, sizeof(unique), "%s-%u", date, n);
+				name = unique;
+			}
+		}
+		if (slogic_store_begin(store, name, sample_rate->samples_per_second)) {
+			exit(EXIT_FAILURE);
+		}
+		log_printf(&logger, INFO, "Storing the capture as %s\n", name);
+	}
+
 	slogic_fill_recording(&recording, sample_rate, on_data_callback, NULL);
-	if (slogic_execute_recording(handle, &recording)) {
+	recording.on_gap_callback = on_gap_callback;
+	if (record(handle, &recording)) {
+		log_trace_stop();
 		slogic_close(handle);
+		if (store) {
+			slogic_store_abort(store);
+			slogic_store_close(store);
+		}
 		exit(EXIT_FAILURE);
 	}
 
+	log_trace_stop();
+
 	slogic_close(handle);
 
-	exit(EXIT_SUCCESS);
+	if (glitch_filter_enabled) {
+		const uint8_t *filtered;
+		size_t n = slogic_glitch_filter_flush(&glitch_filter, &filtered);
+		int channel;
+
+		if (n) {
+			deliver_samples(filtered, n);
+		}
+		for (channel = 0; channel < SLOGIC_N_CHANNELS; channel++) {
+			if (glitch_widths[channel] > 1) {
+				log_printf(&logger, INFO, "Channel %d: %llu glitches removed\n", channel,
+					   (unsigned long long)glitch_filter.glitches[channel]);
+			}
+		}
+		slogic_glitch_filter_free(&glitch_filter);
+	}
+
+	if (net_server) {
+		slogic_net_server_close(net_server, NET_CLOSE_TIMEOUT_MS);
+	}
+	if (shm_producer) {
+		slogic_shm_producer_close(shm_producer);
+	}
+
+	ret = EXIT_SUCCESS;
+	if (store) {
+		struct slogic_store_stats store_stats;
+
+		if (slogic_store_end(store, &store_stats)) {
+			ret = EXIT_FAILURE;
+		}
+		log_printf(&logger, INFO, "Stored %llu chunks, %llu of them new: %llu bytes for %llu samples\n",
+			   (unsigned long long)store_stats.chunks, (unsigned long long)store_stats.new_chunks,
+			   (unsigned long long)(store_stats.new_bytes + store_stats.manifest_bytes),
+			   (unsigned long long)store_stats.samples);
+		if (store_stats.stalls) {
+			log_printf(&logger, WARNING, "The recording waited %llu times for the store\n",
+				   (unsigned long long)store_stats.stalls);
+		}
+		slogic_store_close(store);
+	}
+
+	if (jitter_report) {
+		slogic_jitter_report(&jitter, stderr);
+	}
+
+	if (squelch_enabled) {
+		if (slogic_squelch_finish(&squelch)) {
+			ret = EXIT_FAILURE;
+		}
+		log_printf(&logger, INFO, "Kept %llu of %llu samples (%.1f%%) in %llu windows\n",
+			   (unsigned long long)squelch.kept_samples, (unsigned long long)squelch.n_samples,
+			   squelch.n_samples ? 100.0 * squelch.kept_samples / squelch.n_samples : 0.0,
+			   (unsigned long long)squelch.windows);
+	}
+
+	if (timing_rules_file_name) {
+		slogic_timing_report(&timing, stderr);
+		if (timing.violations) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	if (compare_file_name) {
+		if (report_comparison() != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+		}
+		slogic_compare_close(&compare);
+		free(compare_history);
+		exit(ret);
+	}
+
+	if (stats_mode) {
+		slogic_stats_report(&stats, sample_rate->samples_per_second, output_file);
+	}
+
+	exit(ret);
 }
@@ -0,0 +1,813 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * The capture thread copies every frame once into a ring. The server thread
+ * sends from the ring to every client from its own cursor, using
+ * MSG_ZEROCOPY on TCP sockets so the kernel reads the ring directly.
+ *
+ * A client lagging more than half the ring behind skips frames, counted as
+ * dropped, the next time it is at a frame boundary until it is a quarter of
+ * the ring behind. Skipping has to wait for a boundary, a client with part
+ * of a frame sent would get a corrupted stream otherwise, and it is done
+ * well before the ring wraps. Lagging clients are sent copies, and a client
+ * whose zerocopy sends are still pending three quarters of the ring back is
+ * reset, as the kernel would send whatever the ring holds by then.
+ *
+ * Should a client still be in the way when a frame overwrites the oldest
+ * part of the ring, it skips the frames if it can and is disconnected if it
+ * can't. With the ring a lot larger than the socket buffers that only
+ * happens to clients that are stuck.
+ */
+#define _GNU_SOURCE
+#include "net.h"
+#include "log.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define NET_MAX_CLIENTS 16
+#define NET_LISTEN_BACKLOG 4
+/* Upper bound of a single sendmsg, keeps the time a client is marked as sending short */
+#define NET_MAX_SEND (1024 * 1024)
+#define NET_MAX_ZEROCOPY_PENDING 256
+#define NET_CLOSE_POLL_MS 10
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+struct net_client {
+	int fd;
+	char name[NI_MAXHOST + NI_MAXSERV];
+	bool zerocopy;
+
+	/* Set when the client is to be disconnected, with the reason */
+	bool dead;
+	char reason[64];
+
+	/* Next byte to send and the end of the frame it belongs to */
+	uint64_t cursor;
+	uint64_t frame_end;
+	/* True while a sendmsg reading from the ring at cursor is in progress */
+	bool sending;
+
+	/*
+	 * Start of every zerocopy send the kernel has not reported as done,
+	 * oldest first. zerocopy_done_id is the id of the oldest one.
+	 */
+	uint64_t zerocopy_start[NET_MAX_ZEROCOPY_PENDING];
+	unsigned int zerocopy_head;
+	unsigned int zerocopy_count;
+	uint32_t zerocopy_done_id;
+
+	struct slogic_net_client_stats stats;
+};
+
+struct slogic_net_server {
+	int listen_fd;
+	int wake_fd;
+	/* Takes the place of the socket of an aborted client, see abort_client */
+	int null_fd;
+	char *unix_path;
+
+	uint8_t *ring;
+	size_t ring_size;
+
+	/*
+	 * Everything below is protected by the mutex. The clients array is
+	 * only changed by the server thread.
+	 */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* Number of bytes ever written to the ring */
+	uint64_t head;
+	struct net_client *clients[NET_MAX_CLIENTS];
+	unsigned int n_clients;
+	/* True while the server thread is blocked in poll() */
+	bool waiting;
+	/* True while slogic_net_server_send may wait for a client, which must not be freed meanwhile */
+	bool writer_active;
+	bool closing;
+	uint64_t close_deadline_ms;
+
+	pthread_t thread;
+};
+
+static uint64_t now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Splits "unix:<path>" or "[<host>:]<port>". The host may be in brackets for
+ * IPv6. Returns the path for Unix sockets, NULL otherwise.
+ */
+static const char *parse_address(const char *address, char *host, size_t host_size, const char **port)
+{
+	const char *colon;
+	size_t length;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+		return address + 5;
+	}
+
+	colon = strrchr(address, ':');
+	if (!colon) {
+		host[0] = '\0';
+		*port = address;
+		return NULL;
+	}
+	*port = colon + 1;
+	length = colon - address;
+	if (length >= 2 && address[0] == '[' && address[length - 1] == ']') {
+		address++;
+		length -= 2;
+	}
+	if (length >= host_size) {
+		length = host_size - 1;
+	}
+	memcpy(host, address, length);
+	host[length] = '\0';
+	return NULL;
+}
+
+static int open_socket(const char *address, bool server)
+{
+	char host[256];
+	const char *port;
+	const char *path;
+	struct addrinfo hints, *addresses, *ai;
+	int fd = -1;
+	int one = 1;
+	int ret;
+
+	path = parse_address(address, host, sizeof(host), &port);
+	if (path) {
+		struct sockaddr_un sun;
+		struct stat st;
+
+		if (strlen(path) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			return -1;
+		}
+		if (server) {
+			/* Remove a socket left behind by an earlier run */
+			if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+				unlink(path);
+			}
+			ret = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+		} else {
+			ret = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+		}
+		if (ret) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = server ? AI_PASSIVE : 0;
+	ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &addresses);
+	if (ret) {
+		log_printf(&logger, ERR, "%s: %s\n", address, gai_strerror(ret));
+		errno = EINVAL;
+		return -1;
+	}
+	for (ai = addresses; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (server) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			ret = bind(fd, ai->ai_addr, ai->ai_addrlen);
+		} else {
+			ret = connect(fd, ai->ai_addr, ai->ai_addrlen);
+		}
+		if (ret == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	return fd;
+}
+
+static void ring_read(struct slogic_net_server *server, uint64_t position, void *out, size_t size)
+{
+	size_t offset = position % server->ring_size;
+	size_t first = size < server->ring_size - offset ? size : server->ring_size - offset;
+
+	memcpy(out, server->ring + offset, first);
+	memcpy((uint8_t *) out + first, server->ring, size - first);
+}
+
+static void ring_write(struct slogic_net_server *server, uint64_t position, const void *data, size_t size)
+{
+	size_t offset = position % server->ring_size;
+	size_t first = size < server->ring_size - offset ? size : server->ring_size - offset;
+
+	memcpy(server->ring + offset, data, first);
+	memcpy(server->ring, (const uint8_t *)data + first, size - first);
+}
+
+/* Size of the frame starting at position, header included */
+static uint64_t frame_length(struct slogic_net_server *server, uint64_t position)
+{
+	struct slogic_net_frame_header header;
+
+	ring_read(server, position, &header, sizeof(header));
+	return sizeof(header) + le32toh(header.size);
+}
+
+static void disconnect(struct net_client *client, const char *reason)
+{
+	if (!client->dead) {
+		client->dead = true;
+		snprintf(client->reason, sizeof(client->reason), "%s", reason);
+		shutdown(client->fd, SHUT_RDWR);
+	}
+}
+
+/*
+ * Disconnects a client whose queued data may be overwritten, called with the
+ * mutex held and no send in progress. Closing with a zero linger time resets
+ * the connection, which throws the send queue away instead of sending it.
+ * That has to happen now, before the writer reuses the ring, not when the
+ * client is freed. The socket is closed by duplicating /dev/null over it, so
+ * the server thread never sees the descriptor number taken by something else.
+ */
+static void abort_client(struct slogic_net_server *server, struct net_client *client, const char *reason)
+{
+	struct linger linger = { 1, 0 };
+
+	if (client->dead) {
+		return;
+	}
+	client->dead = true;
+	snprintf(client->reason, sizeof(client->reason), "%s", reason);
+	setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	if (dup2(server->null_fd, client->fd) < 0) {
+		log_printf(&logger, ERR, "Failed to reset client %s: %s\n", client->name, strerror(errno));
+	}
+}
+
+/* Drops whole frames from a client at a frame boundary until it is at or past position */
+static void skip_frames(struct slogic_net_server *server, struct net_client *client, uint64_t position)
+{
+	uint64_t length;
+
+	while (client->cursor < position) {
+		length = frame_length(server, client->cursor);
+		client->stats.dropped_frames++;
+		client->stats.dropped_bytes += length - sizeof(struct slogic_net_frame_header);
+		client->cursor += length;
+	}
+	client->frame_end = client->cursor;
+}
+
+/* Called with the mutex held before the ring is overwritten up to needed */
+static void make_room(struct slogic_net_server *server, struct net_client *client, uint64_t needed)
+{
+	while (!client->dead && client->sending && client->cursor < needed) {
+		pthread_cond_wait(&server->cond, &server->mutex);
+	}
+	if (client->dead) {
+		return;
+	}
+	if (client->zerocopy_count && client->zerocopy_start[client->zerocopy_head] < needed) {
+		abort_client(server, client, "overrun with zerocopy sends pending");
+		return;
+	}
+	if (client->cursor >= needed) {
+		return;
+	}
+	if (client->cursor != client->frame_end) {
+		disconnect(client, "overrun in the middle of a frame");
+		return;
+	}
+	skip_frames(server, client, needed);
+}
+
+void slogic_net_server_send(struct slogic_net_server *server, uint64_t sample_offset, const uint8_t * data,
+			    size_t size)
+{
+	struct slogic_net_frame_header header;
+	uint64_t length = sizeof(header) + size;
+	uint64_t head;
+	unsigned int i;
+	uint64_t one = 1;
+
+	if (size == 0) {
+		return;
+	}
+	if (length > server->ring_size) {
+		log_printf(&logger, WARNING, "Frame of %zu bytes does not fit the ring\n", size);
+		return;
+	}
+
+	pthread_mutex_lock(&server->mutex);
+	if (!server->n_clients) {
+		pthread_mutex_unlock(&server->mutex);
+		return;
+	}
+	head = server->head;
+	if (head + length > server->ring_size) {
+		server->writer_active = true;
+		for (i = 0; i < server->n_clients; i++) {
+			make_room(server, server->clients[i], head + length - server->ring_size);
+		}
+		server->writer_active = false;
+	}
+	pthread_mutex_unlock(&server->mutex);
+
+	/* Nobody reads beyond head, so the copy can be done without the lock */
+	header.magic = htole32(SLOGIC_NET_MAGIC);
+	header.size = htole32(size);
+	header.sample_offset = htole64(sample_offset);
+	ring_write(server, head, &header, sizeof(header));
+	ring_write(server, head + sizeof(header), data, size);
+
+	pthread_mutex_lock(&server->mutex);
+	server->head = head + length;
+	if (server->waiting) {
+		server->waiting = false;
+		if (write(server->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+			log_printf(&logger, WARNING, "Failed to wake the network thread\n");
+		}
+	}
+	pthread_mutex_unlock(&server->mutex);
+}
+
+static void accept_client(struct slogic_net_server *server)
+{
+	struct net_client *client;
+	struct sockaddr_storage address;
+	socklen_t address_length = sizeof(address);
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	int one = 1;
+	int fd;
+
+	fd = accept4(server->listen_fd, (struct sockaddr *)&address, &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	if (server->n_clients == NET_MAX_CLIENTS) {
+		log_printf(&logger, WARNING, "Too many clients, rejecting a connection\n");
+		close(fd);
+		return;
+	}
+
+	client = calloc(1, sizeof(struct net_client));
+	assert(client);
+	client->fd = fd;
+	if (address.ss_family == AF_UNIX) {
+		snprintf(client->name, sizeof(client->name), "unix:%d", fd);
+	} else {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		client->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+		if (getnameinfo((struct sockaddr *)&address, address_length, host, sizeof(host), port, sizeof(port),
+				NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+			snprintf(client->name, sizeof(client->name), "%s:%s", host, port);
+		} else {
+			snprintf(client->name, sizeof(client->name), "tcp:%d", fd);
+		}
+	}
+
+	pthread_mutex_lock(&server->mutex);
+	/* New clients start with the next frame */
+	client->cursor = client->frame_end = server->head;
+	server->clients[server->n_clients++] = client;
+	pthread_mutex_unlock(&server->mutex);
+
+	log_printf(&logger, INFO, "Client %s connected%s\n", client->name, client->zerocopy ? " (zerocopy)" : "");
+}
+
+static void free_client(struct net_client *client)
+{
+	log_printf(&logger, INFO, "Client %s: %llu bytes sent, %llu frames (%llu bytes) dropped, "
+		   "%llu zerocopy sends (%llu copied)%s%s\n", client->name,
+		   (unsigned long long)client->stats.sent_bytes, (unsigned long long)client->stats.dropped_frames,
+		   (unsigned long long)client->stats.dropped_bytes, (unsigned long long)client->stats.zerocopy_sends,
+		   (unsigned long long)client->stats.zerocopy_copied, client->dead ? ", disconnected: " : "",
+		   client->reason);
+
+	close(client->fd);
+	free(client);
+}
+
+static void send_to_client(struct slogic_net_server *server, struct net_client *client)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint64_t start, length;
+	size_t offset, first;
+	bool zerocopy;
+	bool lagging;
+	ssize_t n;
+	int error;
+
+	pthread_mutex_lock(&server->mutex);
+	if (client->dead || client->cursor >= server->head) {
+		pthread_mutex_unlock(&server->mutex);
+		return;
+	}
+	lagging = server->head - client->cursor > server->ring_size / 2;
+	if (lagging && client->cursor == client->frame_end) {
+		skip_frames(server, client, server->head - server->ring_size / 4);
+		if (client->cursor >= server->head) {
+			pthread_mutex_unlock(&server->mutex);
+			return;
+		}
+	}
+	start = client->cursor;
+	length = server->head - start;
+	if (length > NET_MAX_SEND) {
+		length = NET_MAX_SEND;
+	}
+	/* Finish the current frame first so that the next round can skip */
+	if (lagging && client->cursor != client->frame_end && length > client->frame_end - start) {
+		length = client->frame_end - start;
+	}
+	zerocopy = client->zerocopy && !lagging && client->zerocopy_count < NET_MAX_ZEROCOPY_PENDING;
+	client->sending = true;
+	pthread_mutex_unlock(&server->mutex);
+
+	offset = start % server->ring_size;
+	first = length < server->ring_size - offset ? length : server->ring_size - offset;
+	iov[0].iov_base = server->ring + offset;
+	iov[0].iov_len = first;
+	iov[1].iov_base = server->ring;
+	iov[1].iov_len = length - first;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+	n = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+	if (n < 0 && errno == ENOBUFS && zerocopy) {
+		/* Out of option memory for the notifications, copy this one */
+		zerocopy = false;
+		n = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	error = errno;
+
+	pthread_mutex_lock(&server->mutex);
+	client->sending = false;
+	if (n > 0) {
+		if (zerocopy) {
+			client->zerocopy_start[(client->zerocopy_head + client->zerocopy_count)
+					       % NET_MAX_ZEROCOPY_PENDING] = start;
+			client->zerocopy_count++;
+			client->stats.zerocopy_sends++;
+		}
+		client->cursor += n;
+		client->stats.sent_bytes += n;
+		while (client->frame_end < client->cursor) {
+			client->frame_end += frame_length(server, client->frame_end);
+		}
+	} else if (n < 0 && error != EAGAIN && error != EWOULDBLOCK && error != ENOBUFS) {
+		disconnect(client, strerror(error));
+	}
+	pthread_cond_broadcast(&server->cond);
+	pthread_mutex_unlock(&server->mutex);
+}
+
+/* Reads the zerocopy completion notifications from the error queue */
+static void complete_zerocopy(struct slogic_net_server *server, struct net_client *client)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *err;
+	uint32_t done;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(client->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			return;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+			      || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			/* Sends ee_info to ee_data are done */
+			done = err->ee_data;
+			pthread_mutex_lock(&server->mutex);
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				client->stats.zerocopy_copied += done - err->ee_info + 1;
+			}
+			while (client->zerocopy_count && (int32_t)(done - client->zerocopy_done_id) >= 0) {
+				client->zerocopy_head = (client->zerocopy_head + 1) % NET_MAX_ZEROCOPY_PENDING;
+				client->zerocopy_count--;
+				client->zerocopy_done_id++;
+			}
+			pthread_cond_broadcast(&server->cond);
+			pthread_mutex_unlock(&server->mutex);
+		}
+	}
+}
+
+/*
+ * Removes the dead clients, or all of them. Only the server thread changes
+ * the clients array.
+ */
+static void reap_clients(struct slogic_net_server *server, bool all)
+{
+	struct net_client *reaped[NET_MAX_CLIENTS];
+	unsigned int n_reaped = 0;
+	unsigned int i;
+
+	pthread_mutex_lock(&server->mutex);
+	for (i = 0; i < server->n_clients && !server->writer_active;) {
+		struct net_client *client = server->clients[i];
+		if (client->dead || all) {
+			if (!client->dead && client->cursor < server->head) {
+				disconnect(client, "capture ended before the client caught up");
+			}
+			reaped[n_reaped++] = client;
+			server->clients[i] = server->clients[--server->n_clients];
+		} else {
+			i++;
+		}
+	}
+	pthread_mutex_unlock(&server->mutex);
+
+	for (i = 0; i < n_reaped; i++) {
+		free_client(reaped[i]);
+	}
+}
+
+/* Clients are not expected to send anything, reading only detects them going away */
+static void read_client(struct slogic_net_server *server, struct net_client *client)
+{
+	char buffer[256];
+	ssize_t n = read(client->fd, buffer, sizeof(buffer));
+	int error = errno;
+
+	pthread_mutex_lock(&server->mutex);
+	if (n == 0) {
+		disconnect(client, "closed by the client");
+	} else if (n < 0 && error != EAGAIN && error != EWOULDBLOCK) {
+		disconnect(client, strerror(error));
+	}
+	pthread_mutex_unlock(&server->mutex);
+}
+
+/* True when every client has been sent everything and the kernel is done with the ring */
+static bool drained(struct slogic_net_server *server)
+{
+	unsigned int i;
+
+	for (i = 0; i < server->n_clients; i++) {
+		struct net_client *client = server->clients[i];
+		if (!client->dead && (client->cursor < server->head || client->zerocopy_count)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void *server_main(void *arg)
+{
+	struct slogic_net_server *server = arg;
+	struct pollfd fds[NET_MAX_CLIENTS + 2];
+	unsigned int n_fds, i;
+	uint64_t value;
+	bool closing;
+
+	for (;;) {
+		/* Clients are only removed here, so the indexes stay valid until the next round */
+		reap_clients(server, false);
+
+		pthread_mutex_lock(&server->mutex);
+		closing = server->closing;
+		if (closing && (drained(server) || now_ms() >= server->close_deadline_ms)) {
+			pthread_mutex_unlock(&server->mutex);
+			break;
+		}
+		fds[0].fd = server->wake_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = closing ? -1 : server->listen_fd;
+		fds[1].events = POLLIN;
+		n_fds = 2;
+		for (i = 0; i < server->n_clients; i++) {
+			struct net_client *client = server->clients[i];
+			/* Pages the kernel still reads from must go before the writer gets there */
+			if (client->zerocopy_count && !client->dead && server->head
+			    - client->zerocopy_start[client->zerocopy_head] > server->ring_size / 4 * 3) {
+				abort_client(server, client, "stuck with zerocopy sends pending");
+			}
+			fds[n_fds].fd = client->fd;
+			fds[n_fds].events = POLLIN | (client->cursor < server->head ? POLLOUT : 0);
+			n_fds++;
+		}
+		server->waiting = true;
+		pthread_mutex_unlock(&server->mutex);
+
+		if (poll(fds, n_fds, closing ? NET_CLOSE_POLL_MS : -1) < 0 && errno != EINTR) {
+			log_printf(&logger, ERR, "poll: %s\n", strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&server->mutex);
+		server->waiting = false;
+		pthread_mutex_unlock(&server->mutex);
+
+		if (fds[0].revents & POLLIN) {
+			if (read(server->wake_fd, &value, sizeof(value)) < 0) {
+				/* Only the wakeup matters */
+			}
+		}
+		for (i = 0; i < n_fds - 2; i++) {
+			struct net_client *client = server->clients[i];
+			short revents = fds[i + 2].revents;
+
+			if (revents & POLLERR) {
+				complete_zerocopy(server, client);
+			}
+			if (revents & (POLLIN | POLLHUP)) {
+				read_client(server, client);
+			}
+			if (revents & POLLOUT) {
+				send_to_client(server, client);
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			accept_client(server);
+		}
+	}
+
+	reap_clients(server, true);
+	return NULL;
+}
+
+struct slogic_net_server *slogic_net_server_open(const char *address, size_t ring_size)
+{
+	struct slogic_net_server *server = calloc(1, sizeof(struct slogic_net_server));
+	char host[256];
+	const char *port;
+	const char *path;
+
+	assert(server);
+	server->ring_size = ring_size;
+	server->ring = malloc(ring_size);
+	server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	server->null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	server->listen_fd = open_socket(address, true);
+	if (!server->ring || server->wake_fd < 0 || server->null_fd < 0 || server->listen_fd < 0
+	    || listen(server->listen_fd, NET_LISTEN_BACKLOG)) {
+		log_printf(&logger, ERR, "Failed to listen on %s: %s\n", address, strerror(errno));
+		goto fail;
+	}
+	path = parse_address(address, host, sizeof(host), &port);
+	if (path) {
+		server->unix_path = strdup(path);
+	}
+
+	pthread_mutex_init(&server->mutex, NULL);
+	pthread_cond_init(&server->cond, NULL);
+	if (pthread_create(&server->thread, NULL, server_main, server)) {
+		log_printf(&logger, ERR, "Failed to create the network thread\n");
+		pthread_mutex_destroy(&server->mutex);
+		pthread_cond_destroy(&server->cond);
+		goto fail;
+	}
+	log_printf(&logger, INFO, "Listening on %s\n", address);
+	return server;
+
+fail:
+	if (server->listen_fd >= 0) {
+		close(server->listen_fd);
+	}
+	if (server->wake_fd >= 0) {
+		close(server->wake_fd);
+	}
+	if (server->null_fd >= 0) {
+		close(server->null_fd);
+	}
+	free(server->unix_path);
+	free(server->ring);
+	free(server);
+	return NULL;
+}
+
+pthread_t slogic_net_server_thread(const struct slogic_net_server *server)
+{
+	return server->thread;
+}
+
+void slogic_net_server_close(struct slogic_net_server *server, unsigned int timeout_ms)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&server->mutex);
+	server->closing = true;
+	server->close_deadline_ms = now_ms() + timeout_ms;
+	pthread_mutex_unlock(&server->mutex);
+	if (write(server->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+		log_printf(&logger, WARNING, "Failed to wake the network thread\n");
+	}
+	pthread_join(server->thread, NULL);
+
+	close(server->listen_fd);
+	close(server->wake_fd);
+	close(server->null_fd);
+	if (server->unix_path) {
+		unlink(server->unix_path);
+		free(server->unix_path);
+	}
+	pthread_mutex_destroy(&server->mutex);
+	pthread_cond_destroy(&server->cond);
+	free(server->ring);
+	free(server);
+}
+
+int slogic_net_connect(const char *address)
+{
+	return open_socket(address, false);
+}
+
+static int read_fully(int fd, void *buffer, size_t size)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		n = read(fd, (uint8_t *) buffer + done, size - done);
+		if (n == 0) {
+			return done ? -1 : 0;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		done += n;
+	}
+	return 1;
+}
+
+int slogic_net_read_frame(int fd, struct slogic_net_frame_header *header, uint8_t * data, size_t max_size)
+{
+	int ret = read_fully(fd, header, sizeof(*header));
+
+	if (ret <= 0) {
+		return ret;
+	}
+	header->magic = le32toh(header->magic);
+	header->size = le32toh(header->size);
+	header->sample_offset = le64toh(header->sample_offset);
+	if (header->magic != SLOGIC_NET_MAGIC || header->size > max_size) {
+		errno = EPROTO;
+		return -1;
+	}
+	return read_fully(fd, data, header->size) == 1 ? 1 : -1;
+}
@@ -0,0 +1,84 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __NET_H__
+#define __NET_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Network sink for live captures. Clients connect over TCP or a Unix socket
+ * and receive the samples as a stream of frames, each a header followed by
+ * size bytes of samples. All fields are little endian.
+ *
+ * A client that can't keep up loses whole frames, never parts of one. It can
+ * tell from sample_offset not continuing where the previous frame ended.
+ * main -N skips offsets the same way for the samples lost while the device
+ * recovered.
+ */
+#define SLOGIC_NET_MAGIC 0x464e4c53	/* "SLNF" */
+
+struct slogic_net_frame_header {
+	uint32_t magic;
+	uint32_t size;
+	/* Index of the first sample of the frame in the capture */
+	uint64_t sample_offset;
+};
+
+struct slogic_net_client_stats {
+	uint64_t sent_bytes;
+	uint64_t dropped_frames;
+	uint64_t dropped_bytes;
+	/* Sends that used MSG_ZEROCOPY and those the kernel ended up copying anyway */
+	uint64_t zerocopy_sends;
+	uint64_t zerocopy_copied;
+};
+
+struct slogic_net_server;
+
+/*
+ * Starts listening on the address, "unix:<path>" or "[<host>:]<port>", and
+ * serving clients from a thread of its own. ring_size is the amount of
+ * samples kept for clients that lag behind. Returns NULL on failure.
+ */
+struct slogic_net_server *slogic_net_server_open(const char *address, size_t ring_size);
+
+/*
+ * Queues a frame for all connected clients. Never blocks on a client, the
+ * samples are copied once into the ring the clients are served from.
+ */
+void slogic_net_server_send(struct slogic_net_server *server, uint64_t sample_offset, const uint8_t * data,
+			    size_t size);
+
+/*
+ * Gives the clients up to timeout_ms to receive what has been queued, then
+ * disconnects them, logs their statistics and frees the server.
+ */
+void slogic_net_server_close(struct slogic_net_server *server, unsigned int timeout_ms);
+
+/* The thread serving the clients, to pin it */
+pthread_t slogic_net_server_thread(const struct slogic_net_server *server);
+
+/* Client side. Returns the connected socket or -1 */
+int slogic_net_connect(const char *address);
+
+/*
+ * Reads the next frame into data, which has to hold max_size bytes. Returns
+ * 1 on success, 0 at the end of the stream and -1 on errors or a bad frame.
+ */
+int slogic_net_read_frame(int fd, struct slogic_net_frame_header *header, uint8_t * data, size_t max_size);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
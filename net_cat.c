@@ -0,0 +1,203 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Receives a capture from main -N and writes the samples to a file or
+ * stdout. Gaps, frames the server dropped because this client was too slow,
+ * are reported on stderr along with the throughput at the end.
+ *
+ * With -B it benchmarks the network sink instead: a thread serves synthetic
+ * samples on the address at the given rate, 24MHz by default, as main -N
+ * would, and they are received and checked over the loopback.
+ */
+#include "net.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+#define BENCH_SAMPLES_PER_SECOND 24000000
+/* Same as main -N */
+#define BENCH_RING_SIZE (64 * 1024 * 1024)
+#define BENCH_CLOSE_TIMEOUT_MS 2000
+#define BENCH_FRAME_SIZE (16 * 1024)
+/* Time for the server thread to accept the connection before the first frame */
+#define BENCH_ACCEPT_DELAY_US 100000
+
+struct producer {
+	struct slogic_net_server *server;
+	unsigned int samples_per_second;
+	unsigned int seconds;
+	pthread_t thread;
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Sample n of the synthetic capture, a counter the receiver can check */
+static inline uint8_t sample(uint64_t n)
+{
+	return n ^ (n >> 8);
+}
+
+/* Sends frames paced at the sample rate, or as fast as possible at 0, then closes the server */
+static void *producer_main(void *arg)
+{
+	struct producer *producer = arg;
+	uint64_t n_samples = (uint64_t)BENCH_SAMPLES_PER_SECOND * producer->seconds;
+	uint8_t data[BENCH_FRAME_SIZE];
+	struct timespec delay;
+	uint64_t offset;
+	double start, due, wait;
+	size_t i, n;
+
+	if (producer->samples_per_second) {
+		n_samples = (uint64_t)producer->samples_per_second * producer->seconds;
+	}
+	usleep(BENCH_ACCEPT_DELAY_US);
+	start = now();
+	for (offset = 0; offset < n_samples; offset += n) {
+		n = n_samples - offset < sizeof(data) ? n_samples - offset : sizeof(data);
+		for (i = 0; i < n; i++) {
+			data[i] = sample(offset + i);
+		}
+		if (producer->samples_per_second) {
+			due = start + (double)offset / producer->samples_per_second;
+			wait = due - now();
+			if (wait > 0) {
+				delay.tv_sec = wait;
+				delay.tv_nsec = (wait - delay.tv_sec) * 1e9;
+				nanosleep(&delay, NULL);
+			}
+		}
+		slogic_net_server_send(producer->server, offset, data, n);
+	}
+	fprintf(stderr, "produced %llu samples in %.3fs\n", (unsigned long long)n_samples, now() - start);
+	slogic_net_server_close(producer->server, BENCH_CLOSE_TIMEOUT_MS);
+	return NULL;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "usage: %s <unix:path | [host:]port> [<output file>]\n", me);
+	fprintf(stderr, "       %s -B [-r <samples per second>] [-s <seconds>] <unix:path | [host:]port>\n", me);
+	fprintf(stderr, " -B: Serve -s seconds of synthetic samples at the -r rate on the address and receive them.\n");
+	fprintf(stderr, "     -r 0 sends as many samples as 24MHz would, as fast as possible.\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_net_frame_header header;
+	struct producer producer;
+	struct timeval start, end;
+	uint64_t expected = 0, received = 0, lost = 0, gaps = 0, corrupt = 0;
+	bool first = true;
+	bool bench = false;
+	uint8_t *data;
+	FILE *out = stdout;
+	double seconds;
+	int fd, ret, c;
+	uint32_t i;
+
+	producer.samples_per_second = BENCH_SAMPLES_PER_SECOND;
+	producer.seconds = 10;
+	while ((c = getopt(argc, argv, "Br:s:")) != -1) {
+		switch (c) {
+		case 'B':
+			bench = true;
+			break;
+		case 'r':
+			producer.samples_per_second = atoi(optarg);
+			break;
+		case 's':
+			producer.seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 && (bench || argc - optind != 2)) {
+		usage(argv[0]);
+	}
+
+	if (bench) {
+		producer.server = slogic_net_server_open(argv[optind], BENCH_RING_SIZE);
+		if (!producer.server) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	fd = slogic_net_connect(argv[optind]);
+	if (fd < 0) {
+		perror("connecting");
+		exit(EXIT_FAILURE);
+	}
+	if (bench) {
+		out = NULL;
+		if (pthread_create(&producer.thread, NULL, producer_main, &producer)) {
+			exit(EXIT_FAILURE);
+		}
+	} else if (argc - optind == 2 && strcmp(argv[optind + 1], "-")) {
+		out = fopen(argv[optind + 1], "w");
+		if (!out) {
+			perror("opening output file");
+			exit(EXIT_FAILURE);
+		}
+	}
+	data = malloc(MAX_FRAME_SIZE);
+	if (!data) {
+		exit(EXIT_FAILURE);
+	}
+
+	gettimeofday(&start, NULL);
+	while ((ret = slogic_net_read_frame(fd, &header, data, MAX_FRAME_SIZE)) == 1) {
+		if (!first && header.sample_offset != expected) {
+			fprintf(stderr, "gap at sample %llu, %llu samples lost\n", (unsigned long long)expected,
+				(unsigned long long)(header.sample_offset - expected));
+			lost += header.sample_offset - expected;
+			gaps++;
+		}
+		first = false;
+		expected = header.sample_offset + header.size;
+		received += header.size;
+		if (bench) {
+			for (i = 0; i < header.size; i++) {
+				corrupt += data[i] != sample(header.sample_offset + i);
+			}
+			continue;
+		}
+		if (fwrite(data, 1, header.size, out) != header.size) {
+			perror("writing samples");
+			exit(EXIT_FAILURE);
+		}
+	}
+	gettimeofday(&end, NULL);
+	if (ret < 0) {
+		perror("receiving");
+	}
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	fprintf(stderr, "%llu samples received in %.3fs (%.1f MB/s), %llu gaps, %llu samples lost\n",
+		(unsigned long long)received, seconds, seconds > 0 ? received / seconds / 1000000 : 0.0,
+		(unsigned long long)gaps, (unsigned long long)lost);
+
+	if (bench) {
+		pthread_join(producer.thread, NULL);
+		if (corrupt) {
+			fprintf(stderr, "%llu samples corrupted\n", (unsigned long long)corrupt);
+			ret = -1;
+		}
+	} else if (out != stdout) {
+		fclose(out);
+	}
+	free(data);
+	exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
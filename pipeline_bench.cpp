@@ -0,0 +1,156 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Cost of running the stages of a recording as a slogic::pipeline, composed
+ * at compile time, against the same stages chained through function
+ * pointers the way a C program would register callbacks. Synthetic chunks
+ * are fed straight to both, without a device, for a range of chunk sizes:
+ * with small chunks the per-chunk calls dominate, with big ones the work
+ * on the samples does.
+ *
+ * The stages are a trigger on channel 0, a limit and a stage that adds up
+ * the samples so that the work can't be optimized away. Both variants have
+ * to arrive at the same sum.
+ */
+#include "slogic.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+
+#define DEFAULT_MEGABYTES 256
+#define PASSES 5
+
+/* Adds up the samples it is passed */
+class sum {
+public:
+	bool operator()(slogic::chunk &data) {
+		for (uint8_t sample : data) {
+			total_ += sample;
+		}
+		return true;
+	}
+
+	uint64_t total() const {
+		return total_;
+	}
+
+private:
+	uint64_t total_ = 0;
+};
+
+/* The same stages behind function pointers, called in a loop */
+typedef bool (*stage_callback)(void *stage, slogic::chunk &data);
+
+template <typename Stage>
+static bool call_stage(void *stage, slogic::chunk &data)
+{
+	return (*static_cast<Stage *>(stage))(data);
+}
+
+struct callback_chain {
+	stage_callback callbacks[3];
+	void *stages[3];
+};
+
+/* Keeps the compiler from resolving the pointers at compile time */
+static bool __attribute__((noinline)) run_chain(callback_chain *chain, slogic::chunk data)
+{
+	for (int i = 0; i < 3; i++) {
+		if (!chain->callbacks[i](chain->stages[i], data)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Same for the pipeline, the library calls it through the trampoline */
+template <typename Pipeline>
+static bool __attribute__((noinline)) run_pipeline(Pipeline *pipeline, slogic::chunk data)
+{
+	return (*pipeline)(data);
+}
+
+static double now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Channel 0 toggles every 16 samples, the others count */
+static void generate(std::vector<uint8_t> &data)
+{
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = (i & 0xfe) | ((i >> 4) & 1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t chunk_sizes[] = { 64, 512, 4096, 16384 };
+	uint64_t megabytes = DEFAULT_MEGABYTES;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:")) != -1) {
+		switch (c) {
+		case 'm':
+			megabytes = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m <megabytes per run>]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* The limit is never reached, every run goes through all of the data */
+	uint64_t n_samples = megabytes * 1024 * 1024;
+	std::vector<uint8_t> data(1024 * 1024);
+	generate(data);
+
+	printf("%llu MB per run, best of %d\n", (unsigned long long)megabytes, PASSES);
+	printf("%8s %16s %16s %16s %16s\n", "chunk", "pipeline MB/s", "ns per chunk", "callbacks MB/s",
+	       "ns per chunk");
+	for (size_t chunk_size : chunk_sizes) {
+		uint64_t n_chunks = n_samples / chunk_size;
+		double best_pipeline = 0, best_callbacks = 0;
+		uint64_t pipeline_total = 0, callbacks_total = 0;
+
+		for (int pass = 0; pass < PASSES; pass++) {
+			slogic::pipeline<slogic::trigger, slogic::limit, sum> pipeline{
+				slogic::trigger{0x01}, slogic::limit{n_samples + 1}, sum{}};
+			double start = now();
+			for (uint64_t i = 0; i < n_chunks; i++) {
+				size_t offset = (i * chunk_size) % data.size();
+				run_pipeline(&pipeline, slogic::chunk(&data[offset], chunk_size));
+			}
+			double elapsed = now() - start;
+			best_pipeline = pass == 0 || elapsed < best_pipeline ? elapsed : best_pipeline;
+			pipeline_total = pipeline.stage<2>().total();
+
+			slogic::trigger trigger{0x01};
+			slogic::limit limit{n_samples + 1};
+			sum total;
+			callback_chain chain = {
+				{ call_stage<slogic::trigger>, call_stage<slogic::limit>, call_stage<sum> },
+				{ &trigger, &limit, &total } };
+			start = now();
+			for (uint64_t i = 0; i < n_chunks; i++) {
+				size_t offset = (i * chunk_size) % data.size();
+				run_chain(&chain, slogic::chunk(&data[offset], chunk_size));
+			}
+			elapsed = now() - start;
+			best_callbacks = pass == 0 || elapsed < best_callbacks ? elapsed : best_callbacks;
+			callbacks_total = total.total();
+		}
+
+		if (pipeline_total != callbacks_total) {
+			fprintf(stderr, "The pipeline and the callbacks disagree: %llu != %llu\n",
+				(unsigned long long)pipeline_total, (unsigned long long)callbacks_total);
+			exit(EXIT_FAILURE);
+		}
+		printf("%8zu %16.0f %16.1f %16.0f %16.1f\n", chunk_size, n_samples / best_pipeline / 1000000,
+		       best_pipeline * 1e9 / n_chunks, n_samples / best_callbacks / 1000000,
+		       best_callbacks * 1e9 / n_chunks);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Read rate of the polled mode against the simulated device, see simusb.h,
+ * for a range of depths. Every transfer takes the given bus latency, so one
+ * read in flight is bound by the round trip and more of them overlap it.
+ * Halfway through each run the callback writes the register, and the run
+ * reports how many responses after that still read the old value, which is
+ * how far a write from the callback lags behind at that depth.
+ */
+#include "slogic.h"
+#include "simusb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define DEFAULT_N_READS 20000
+#define MAX_DEPTH 64
+
+struct bench {
+	struct slogic_poll poll;
+	uint64_t n_reads;
+	uint8_t old_value;
+	/* Response the write was queued from and the first one with the new value */
+	uint64_t written_at;
+	uint64_t seen_at;
+	bool written;
+	bool seen;
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool on_poll(const struct slogic_poll_sample *sample, void *user_data)
+{
+	struct bench *bench = user_data;
+
+	if (bench->written && !bench->seen && sample->value != bench->old_value) {
+		bench->seen = true;
+		bench->seen_at = sample->seq;
+	}
+	if (!bench->written && sample->seq >= bench->n_reads / 2) {
+		bench->old_value = sample->value;
+		bench->written_at = sample->seq;
+		bench->written = slogic_poll_writebyte(&bench->poll, ~sample->value) == 0;
+	}
+	return sample->seq + 1 < bench->n_reads;
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_handle *handle;
+	struct bench bench;
+	unsigned int latency = 125;
+	unsigned int depth;
+	uint64_t n_reads = DEFAULT_N_READS;
+	double start, elapsed;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "n:l:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_reads = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			latency = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n <reads per depth>] [-l <bus latency in us>]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (n_reads < 2) {
+		fprintf(stderr, "At least 2 reads are needed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	simusb_set_latency(latency);
+	handle = slogic_init();
+	if (!handle || slogic_open(handle)) {
+		exit(EXIT_FAILURE);
+	}
+	/* For slogic_poll_writebyte, the simulated device takes the guessed command */
+	handle->experimental_commands = true;
+
+	printf("%u reads per depth, %uus bus latency\n", (unsigned int)n_reads, latency);
+	printf("%6s %12s %24s\n", "depth", "reads/s", "old values after a write");
+	for (depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+		bench = (struct bench) {
+		.n_reads = n_reads};
+		slogic_fill_poll(&bench.poll, depth, on_poll, &bench);
+
+		start = now();
+		ret = slogic_execute_poll(handle, &bench.poll);
+		elapsed = now() - start;
+		if (ret || bench.poll.n_samples != n_reads) {
+			fprintf(stderr, "Poll failed at depth %u after %llu reads\n", depth,
+				(unsigned long long)bench.poll.n_samples);
+			exit(EXIT_FAILURE);
+		}
+		if (bench.seen) {
+			printf("%6u %12.0f %24llu\n", depth, n_reads / elapsed,
+			       (unsigned long long)(bench.seen_at - bench.written_at - 1));
+		} else {
+			printf("%6u %12.0f %24s\n", depth, n_reads / elapsed, "never seen");
+		}
+	}
+
+	slogic_close(handle);
+	return EXIT_SUCCESS;
+}
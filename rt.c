@@ -0,0 +1,159 @@
+// vim: sw=8:ts=8:noexpandtab
+#define _GNU_SOURCE
+#include "rt.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+int slogic_rt_pin_thread(pthread_t thread, int cpu)
+{
+	cpu_set_t cpus;
+	int ret;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+int slogic_rt_set_fifo(pthread_t thread, int priority)
+{
+	struct sched_param param;
+	int ret;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	ret = pthread_setschedparam(thread, SCHED_FIFO, &param);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+int slogic_rt_lock_memory()
+{
+	return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+struct slogic_rt_state {
+	bool pinned;
+	cpu_set_t cpus;
+	bool scheduled;
+	int policy;
+	struct sched_param param;
+};
+
+struct slogic_rt_state *slogic_rt_enter(struct slogic_handle *handle)
+{
+	struct slogic_rt_state *state;
+	pthread_t self = pthread_self();
+
+	if (handle->event_cpu < 0 && handle->event_priority <= 0) {
+		return NULL;
+	}
+
+	state = calloc(1, sizeof(struct slogic_rt_state));
+	assert(state);
+
+	if (handle->event_cpu >= 0) {
+		if (pthread_getaffinity_np(self, sizeof(state->cpus), &state->cpus) == 0
+		    && slogic_rt_pin_thread(self, handle->event_cpu) == 0) {
+			state->pinned = true;
+		} else {
+			log_printf(&logger, WARNING, "Could not pin the event thread to CPU %d: %s\n",
+				   handle->event_cpu, strerror(errno));
+		}
+	}
+
+	if (handle->event_priority > 0) {
+		if (pthread_getschedparam(self, &state->policy, &state->param) == 0
+		    && slogic_rt_set_fifo(self, handle->event_priority) == 0) {
+			state->scheduled = true;
+		} else {
+			log_printf(&logger, WARNING, "Could not set SCHED_FIFO priority %d: %s\n",
+				   handle->event_priority, strerror(errno));
+		}
+	}
+
+	return state;
+}
+
+void slogic_rt_leave(struct slogic_rt_state *state)
+{
+	pthread_t self = pthread_self();
+
+	if (!state) {
+		return;
+	}
+	if (state->scheduled) {
+		pthread_setschedparam(self, state->policy, &state->param);
+	}
+	if (state->pinned) {
+		pthread_setaffinity_np(self, sizeof(state->cpus), &state->cpus);
+	}
+	free(state);
+}
+
+uint64_t slogic_rt_now_usec()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void slogic_jitter_add(struct slogic_jitter *jitter, uint64_t late_usec)
+{
+	unsigned int bucket = late_usec ? 64 - __builtin_clzll(late_usec) : 0;
+
+	if (bucket >= SLOGIC_JITTER_BUCKETS) {
+		bucket = SLOGIC_JITTER_BUCKETS - 1;
+	}
+	jitter->buckets[bucket]++;
+	jitter->n++;
+	if (late_usec > jitter->max_usec) {
+		jitter->max_usec = late_usec;
+	}
+}
+
+void slogic_jitter_report(const struct slogic_jitter *jitter, FILE *out)
+{
+	unsigned int bucket;
+
+	fprintf(out, "Event loop jitter over %llu transfers, max %lluus\n", (unsigned long long)jitter->n,
+		(unsigned long long)jitter->max_usec);
+	for (bucket = 0; bucket < SLOGIC_JITTER_BUCKETS; bucket++) {
+		if (!jitter->buckets[bucket]) {
+			continue;
+		}
+		if (bucket == 0) {
+			fprintf(out, "  on time         ");
+		} else if (bucket == SLOGIC_JITTER_BUCKETS - 1) {
+			fprintf(out, "  >= %9lluus  ", 1ULL << (bucket - 1));
+		} else {
+			fprintf(out, "  < %10lluus  ", 1ULL << bucket);
+		}
+		fprintf(out, "%12llu %6.2f%%\n", (unsigned long long)jitter->buckets[bucket],
+			100.0 * jitter->buckets[bucket] / jitter->n);
+	}
+}
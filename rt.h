@@ -0,0 +1,53 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __RT_H__
+#define __RT_H__
+
+#include "slogic.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Scheduling helpers for the threads that have to keep up with the device.
+ * All return 0 on success and -1 with errno set otherwise. Real-time
+ * priorities and mlockall usually need CAP_SYS_NICE and CAP_IPC_LOCK, or
+ * matching rlimits.
+ */
+
+/* Restricts the thread to a single CPU */
+int slogic_rt_pin_thread(pthread_t thread, int cpu);
+
+/* Switches the thread to SCHED_FIFO with the given priority, 1 to 99 */
+int slogic_rt_set_fifo(pthread_t thread, int priority);
+
+/* Locks all current and future pages of the process into memory */
+int slogic_rt_lock_memory();
+
+struct slogic_rt_state;
+
+/*
+ * Applies the handle's event_cpu and event_priority to the calling thread.
+ * Returns what is needed to undo it, NULL if nothing was changed.
+ */
+struct slogic_rt_state *slogic_rt_enter(struct slogic_handle *handle);
+void slogic_rt_leave(struct slogic_rt_state *state);
+
+/* Current time of a monotonic clock in microseconds */
+uint64_t slogic_rt_now_usec();
+
+void slogic_jitter_add(struct slogic_jitter *jitter, uint64_t late_usec);
+void slogic_jitter_report(const struct slogic_jitter *jitter, FILE *out);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -0,0 +1,618 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Layout of the memfd: a header, an index of n_frames chunk descriptors and
+ * the data ring. Chunk n is described by frames[n % n_frames] and its data
+ * lives at data[position % data_size], possibly wrapping around.
+ *
+ * The producer only ever writes the header's producer fields, the index and
+ * the data, so readers can't slow it down. Before writing a chunk it raises
+ * "reserved" to the end of the new data, everything before reserved -
+ * data_size may be overwritten from then on, and it invalidates the index
+ * entry it is about to reuse. A reader copies a chunk out and then checks,
+ * seqlock style, that the index entry is unchanged and that the data is
+ * still above reserved - data_size. If not it lagged a ring behind and skips
+ * to the chunks in the newer half of the ring.
+ *
+ * Readers sleep on a futex in the shared header that is bumped for every
+ * chunk, the producer only makes the wake syscall when someone waits.
+ */
+#define _GNU_SOURCE
+#include "shm.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x4d484c53	/* "SLHM" */
+#define SHM_VERSION 1
+#define SHM_INVALID_SEQ UINT64_MAX
+#define SHM_LISTEN_BACKLOG 4
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+struct shm_frame {
+	uint64_t seq;
+	uint64_t position;
+	uint64_t sample_offset;
+	uint64_t size;
+};
+
+/* Written by the reader owning it, for the producer's statistics */
+struct shm_reader_slot {
+	int32_t pid;
+	uint64_t seq;
+	uint64_t dropped;
+} __attribute__((aligned(64)));
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t data_size;
+	uint64_t n_frames;
+	uint64_t frames_offset;
+	uint64_t data_offset;
+
+	/* Written by the producer */
+	uint64_t head_seq __attribute__((aligned(64)));
+	uint64_t reserved;
+	uint32_t closed;
+	uint32_t futex;
+
+	/* Written by the readers */
+	uint32_t waiters __attribute__((aligned(64)));
+	struct shm_reader_slot readers[SLOGIC_SHM_MAX_READERS];
+};
+
+struct slogic_shm_producer {
+	int memfd;
+	int listen_fd;
+	char *socket_path;
+	pthread_t thread;
+
+	void *map;
+	size_t map_size;
+	struct shm_header *header;
+	struct shm_frame *frames;
+	uint8_t *data;
+	/* Private copies, the readers can write to the mapping */
+	uint64_t data_size;
+	uint64_t n_frames;
+
+	uint64_t seq;
+	uint64_t head;
+};
+
+struct slogic_shm_reader {
+	void *map;
+	size_t map_size;
+	struct shm_header *header;
+	struct shm_frame *frames;
+	uint8_t *data;
+
+	uint64_t seq;
+	uint64_t dropped;
+	/* Skipped since the last chunk returned */
+	uint64_t pending_dropped;
+	struct shm_reader_slot *slot;
+};
+
+static int futex(uint32_t *address, int op, uint32_t value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, address, op, value, timeout, NULL, 0);
+}
+
+static int unix_socket(const char *path, struct sockaddr_un *address)
+{
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	strcpy(address->sun_path, path);
+	return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+/* True if a producer still listens on the socket */
+static bool socket_in_use(const char *path)
+{
+	struct sockaddr_un address;
+	int fd = unix_socket(path, &address);
+	bool in_use;
+
+	if (fd < 0) {
+		return false;
+	}
+	in_use = connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+	close(fd);
+	return in_use;
+}
+
+/* Hands the memfd to every reader that connects */
+static void *producer_main(void *arg)
+{
+	struct slogic_shm_producer *producer = arg;
+	char control[CMSG_SPACE(sizeof(int))];
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+
+	for (;;) {
+		fd = accept4(producer->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			/* The listening socket was shut down */
+			break;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		memset(control, 0, sizeof(control));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &producer->memfd, sizeof(int));
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+			log_printf(&logger, WARNING, "Failed to pass the ring to a reader: %s\n", strerror(errno));
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static void map_layout(void *map, struct shm_frame **frames, uint8_t ** data)
+{
+	struct shm_header *header = map;
+
+	*frames = (struct shm_frame *)((uint8_t *) map + header->frames_offset);
+	*data = (uint8_t *) map + header->data_offset;
+}
+
+struct slogic_shm_producer *slogic_shm_producer_open(const char *socket_path, size_t data_size,
+						     unsigned int n_frames)
+{
+	struct slogic_shm_producer *producer = calloc(1, sizeof(struct slogic_shm_producer));
+	struct sockaddr_un address;
+	struct shm_header *header;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t frames_offset, data_offset;
+	struct stat st;
+	unsigned int i;
+
+	assert(producer);
+	producer->memfd = -1;
+	producer->listen_fd = -1;
+
+	frames_offset = (sizeof(struct shm_header) + 63) & ~(size_t) 63;
+	data_offset = (frames_offset + n_frames * sizeof(struct shm_frame) + page_size - 1) & ~(page_size - 1);
+	producer->map_size = data_offset + data_size;
+
+	producer->memfd = memfd_create("slogic", MFD_CLOEXEC);
+	if (producer->memfd < 0 || ftruncate(producer->memfd, producer->map_size)) {
+		log_printf(&logger, ERR, "Failed to create the ring: %s\n", strerror(errno));
+		goto fail;
+	}
+	producer->map = mmap(NULL, producer->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, producer->memfd, 0);
+	if (producer->map == MAP_FAILED) {
+		producer->map = NULL;
+		log_printf(&logger, ERR, "Failed to map the ring: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	header = producer->header = producer->map;
+	header->version = SHM_VERSION;
+	header->data_size = data_size;
+	header->n_frames = n_frames;
+	header->frames_offset = frames_offset;
+	header->data_offset = data_offset;
+	map_layout(producer->map, &producer->frames, &producer->data);
+	producer->data_size = data_size;
+	producer->n_frames = n_frames;
+	for (i = 0; i < n_frames; i++) {
+		producer->frames[i].seq = SHM_INVALID_SEQ;
+	}
+	/* Readers check the magic last */
+	__atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	producer->listen_fd = unix_socket(socket_path, &address);
+	if (producer->listen_fd < 0) {
+		log_printf(&logger, ERR, "%s: %s\n", socket_path, strerror(errno));
+		goto fail;
+	}
+	if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (socket_in_use(socket_path)) {
+			log_printf(&logger, ERR, "%s is in use by another producer\n", socket_path);
+			goto fail;
+		}
+		/* Left behind by an earlier run */
+		unlink(socket_path);
+	}
+	if (bind(producer->listen_fd, (struct sockaddr *)&address, sizeof(address))
+	    || listen(producer->listen_fd, SHM_LISTEN_BACKLOG)) {
+		log_printf(&logger, ERR, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+		goto fail;
+	}
+	producer->socket_path = strdup(socket_path);
+
+	if (pthread_create(&producer->thread, NULL, producer_main, producer)) {
+		log_printf(&logger, ERR, "Failed to create the ring thread\n");
+		unlink(socket_path);
+		goto fail;
+	}
+	log_printf(&logger, INFO, "Publishing on %s\n", socket_path);
+	return producer;
+
+fail:
+	if (producer->listen_fd >= 0) {
+		close(producer->listen_fd);
+	}
+	if (producer->map) {
+		munmap(producer->map, producer->map_size);
+	}
+	if (producer->memfd >= 0) {
+		close(producer->memfd);
+	}
+	free(producer->socket_path);
+	free(producer);
+	return NULL;
+}
+
+void slogic_shm_publish(struct slogic_shm_producer *producer, uint64_t sample_offset, const uint8_t * data,
+			size_t size)
+{
+	struct shm_header *header = producer->header;
+	struct shm_frame *frame = &producer->frames[producer->seq % producer->n_frames];
+	size_t offset = producer->head % producer->data_size;
+	size_t first = size < producer->data_size - offset ? size : producer->data_size - offset;
+
+	if (size == 0) {
+		return;
+	}
+	if (size > producer->data_size) {
+		log_printf(&logger, WARNING, "Chunk of %zu bytes does not fit the ring\n", size);
+		return;
+	}
+
+	/* Make the overwritten chunks invalid before touching their data */
+	__atomic_store_n(&frame->seq, SHM_INVALID_SEQ, __ATOMIC_RELAXED);
+	__atomic_store_n(&header->reserved, producer->head + size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	memcpy(producer->data + offset, data, first);
+	memcpy(producer->data, data + first, size - first);
+
+	__atomic_store_n(&frame->position, producer->head, __ATOMIC_RELAXED);
+	__atomic_store_n(&frame->sample_offset, sample_offset, __ATOMIC_RELAXED);
+	__atomic_store_n(&frame->size, size, __ATOMIC_RELAXED);
+	__atomic_store_n(&frame->seq, producer->seq, __ATOMIC_RELEASE);
+
+	producer->seq++;
+	producer->head += size;
+	__atomic_store_n(&header->head_seq, producer->seq, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST)) {
+		futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+	}
+}
+
+pthread_t slogic_shm_producer_thread(const struct slogic_shm_producer *producer)
+{
+	return producer->thread;
+}
+
+void slogic_shm_producer_close(struct slogic_shm_producer *producer)
+{
+	struct shm_header *header = producer->header;
+	unsigned int i;
+
+	__atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+	futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+
+	shutdown(producer->listen_fd, SHUT_RDWR);
+	pthread_join(producer->thread, NULL);
+	close(producer->listen_fd);
+	unlink(producer->socket_path);
+
+	for (i = 0; i < SLOGIC_SHM_MAX_READERS; i++) {
+		struct shm_reader_slot *slot = &header->readers[i];
+		int32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+		if (pid) {
+			log_printf(&logger, INFO, "Reader %d: %llu chunks behind, %llu chunks dropped\n", pid,
+				   (unsigned long long)(producer->seq - __atomic_load_n(&slot->seq, __ATOMIC_RELAXED)),
+				   (unsigned long long)__atomic_load_n(&slot->dropped, __ATOMIC_RELAXED));
+		}
+	}
+
+	munmap(producer->map, producer->map_size);
+	close(producer->memfd);
+	free(producer->socket_path);
+	free(producer);
+}
+
+static int receive_fd(int socket)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* Takes a free slot, or one of a reader that has died */
+static struct shm_reader_slot *claim_slot(struct shm_header *header)
+{
+	int32_t self = getpid();
+	int32_t pid;
+	unsigned int i;
+
+	for (i = 0; i < SLOGIC_SHM_MAX_READERS; i++) {
+		struct shm_reader_slot *slot = &header->readers[i];
+		pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+		if (pid && (kill(pid, 0) == 0 || errno != ESRCH)) {
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&slot->pid, &pid, self, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+struct slogic_shm_reader *slogic_shm_reader_open(const char *socket_path)
+{
+	struct slogic_shm_reader *reader;
+	struct sockaddr_un address;
+	struct stat st;
+	int sock, fd;
+	void *map;
+
+	sock = unix_socket(socket_path, &address);
+	if (sock < 0) {
+		return NULL;
+	}
+	if (connect(sock, (struct sockaddr *)&address, sizeof(address))) {
+		close(sock);
+		return NULL;
+	}
+	fd = receive_fd(sock);
+	close(sock);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct shm_header)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	reader = calloc(1, sizeof(struct slogic_shm_reader));
+	assert(reader);
+	reader->map = map;
+	reader->map_size = st.st_size;
+	reader->header = map;
+	if (__atomic_load_n(&reader->header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+	    || reader->header->version != SHM_VERSION) {
+		log_printf(&logger, ERR, "%s: not a compatible ring\n", socket_path);
+		slogic_shm_reader_close(reader);
+		errno = EPROTO;
+		return NULL;
+	}
+	map_layout(map, &reader->frames, &reader->data);
+
+	/* Start with the next chunk */
+	reader->seq = __atomic_load_n(&reader->header->head_seq, __ATOMIC_ACQUIRE);
+	reader->slot = claim_slot(reader->header);
+	if (reader->slot) {
+		__atomic_store_n(&reader->slot->seq, reader->seq, __ATOMIC_RELAXED);
+		__atomic_store_n(&reader->slot->dropped, 0, __ATOMIC_RELAXED);
+	}
+	return reader;
+}
+
+/*
+ * Skips to the oldest chunk in the newer half of the ring. This is only a
+ * guess made while the producer keeps writing, slogic_shm_read validates the
+ * chunk as usual.
+ */
+static void resync(struct slogic_shm_reader *reader, uint64_t head_seq)
+{
+	struct shm_header *header = reader->header;
+	uint64_t reserved = __atomic_load_n(&header->reserved, __ATOMIC_ACQUIRE);
+	uint64_t seq = head_seq;
+	uint64_t skipped;
+
+	while (seq > reader->seq + 1 && head_seq - seq < header->n_frames / 2) {
+		struct shm_frame *frame = &reader->frames[(seq - 1) % header->n_frames];
+		if (__atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE) != seq - 1
+		    || __atomic_load_n(&frame->position, __ATOMIC_RELAXED) + header->data_size / 2 < reserved) {
+			break;
+		}
+		seq--;
+	}
+	if (seq <= reader->seq) {
+		seq = reader->seq + 1;
+	}
+
+	skipped = seq - reader->seq;
+	reader->dropped += skipped;
+	reader->pending_dropped += skipped;
+	reader->seq = seq;
+	if (reader->slot) {
+		__atomic_store_n(&reader->slot->dropped, reader->dropped, __ATOMIC_RELAXED);
+	}
+}
+
+/* Returns 1 with the chunk copied, 0 if it was overwritten and -2 if it does not fit max_size */
+static int copy_chunk(struct slogic_shm_reader *reader, struct slogic_shm_chunk *chunk, uint8_t * buffer,
+		      size_t max_size)
+{
+	struct shm_header *header = reader->header;
+	struct shm_frame *frame = &reader->frames[reader->seq % header->n_frames];
+	uint64_t position, sample_offset, size;
+	size_t offset, first;
+
+	if (__atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE) != reader->seq) {
+		return 0;
+	}
+	position = __atomic_load_n(&frame->position, __ATOMIC_RELAXED);
+	sample_offset = __atomic_load_n(&frame->sample_offset, __ATOMIC_RELAXED);
+	size = __atomic_load_n(&frame->size, __ATOMIC_RELAXED);
+	if (size > header->data_size) {
+		/* Torn read of an entry being rewritten */
+		return 0;
+	}
+	if (size > max_size) {
+		return -2;
+	}
+
+	offset = position % header->data_size;
+	first = size < header->data_size - offset ? size : header->data_size - offset;
+	memcpy(buffer, reader->data + offset, first);
+	memcpy(buffer + first, reader->data, size - first);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&frame->seq, __ATOMIC_RELAXED) != reader->seq
+	    || position + header->data_size < __atomic_load_n(&header->reserved, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	chunk->sample_offset = sample_offset;
+	chunk->size = size;
+	chunk->dropped = reader->pending_dropped;
+	return 1;
+}
+
+int slogic_shm_read(struct slogic_shm_reader *reader, struct slogic_shm_chunk *chunk, uint8_t * buffer,
+		    size_t max_size, int timeout_ms)
+{
+	struct shm_header *header = reader->header;
+	struct timespec deadline, now, timeout;
+	uint64_t head_seq;
+	uint32_t futex_value;
+	int ret;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	for (;;) {
+		futex_value = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+		head_seq = __atomic_load_n(&header->head_seq, __ATOMIC_ACQUIRE);
+
+		if (reader->seq < head_seq) {
+			if (head_seq - reader->seq > header->n_frames) {
+				resync(reader, head_seq);
+				continue;
+			}
+			ret = copy_chunk(reader, chunk, buffer, max_size);
+			if (ret < 0) {
+				/* Left in line for a bigger buffer */
+				return ret;
+			}
+			if (ret == 0) {
+				resync(reader, head_seq);
+				continue;
+			}
+			reader->pending_dropped = 0;
+			reader->seq++;
+			if (reader->slot) {
+				__atomic_store_n(&reader->slot->seq, reader->seq, __ATOMIC_RELAXED);
+			}
+			return 1;
+		}
+
+		if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+			return -1;
+		}
+		if (timeout_ms == 0) {
+			return 0;
+		}
+		if (timeout_ms > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+			timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (timeout.tv_nsec < 0) {
+				timeout.tv_sec--;
+				timeout.tv_nsec += 1000000000L;
+			}
+			if (timeout.tv_sec < 0) {
+				return 0;
+			}
+		}
+
+		__atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&header->head_seq, __ATOMIC_SEQ_CST) == head_seq) {
+			futex(&header->futex, FUTEX_WAIT, futex_value, timeout_ms > 0 ? &timeout : NULL);
+		}
+		__atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+uint64_t slogic_shm_reader_dropped(const struct slogic_shm_reader *reader)
+{
+	return reader->dropped;
+}
+
+void slogic_shm_reader_close(struct slogic_shm_reader *reader)
+{
+	if (reader->slot) {
+		__atomic_store_n(&reader->slot->pid, 0, __ATOMIC_RELAXED);
+	}
+	munmap(reader->map, reader->map_size);
+	free(reader);
+}
@@ -0,0 +1,81 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Shared memory fan-out of a live capture. The producer publishes chunks
+ * into a ring in a memfd, any number of reader processes map it and read at
+ * their own pace. The producer never waits for a reader: a reader that falls
+ * a ring behind notices that its data was overwritten and skips ahead.
+ *
+ * Readers get the memfd from a Unix socket the producer listens on.
+ *
+ * Chunk sample offsets need not be contiguous, main -M skips the samples
+ * lost while the device recovered.
+ */
+#define SLOGIC_SHM_MAX_READERS 16
+
+struct slogic_shm_producer;
+struct slogic_shm_reader;
+
+/*
+ * Creates a ring of data_size bytes and up to n_frames chunks, and serves
+ * it on the Unix socket socket_path. A socket left there by an earlier run
+ * is replaced, one another producer still listens on is not. Returns NULL
+ * on failure.
+ */
+struct slogic_shm_producer *slogic_shm_producer_open(const char *socket_path, size_t data_size,
+						     unsigned int n_frames);
+
+/* Publishes a chunk, never blocks */
+void slogic_shm_publish(struct slogic_shm_producer *producer, uint64_t sample_offset, const uint8_t * data,
+			size_t size);
+
+/* Marks the end of the stream, logs the readers' state and frees the producer */
+void slogic_shm_producer_close(struct slogic_shm_producer *producer);
+
+/* The thread handing out the ring to the readers, to pin it */
+pthread_t slogic_shm_producer_thread(const struct slogic_shm_producer *producer);
+
+struct slogic_shm_chunk {
+	uint64_t sample_offset;
+	size_t size;
+	/* Number of chunks skipped right before this one because the reader lagged behind */
+	uint64_t dropped;
+};
+
+/* Connects to a producer and maps its ring. Returns NULL on failure */
+struct slogic_shm_reader *slogic_shm_reader_open(const char *socket_path);
+
+/*
+ * Copies the next chunk into buffer, which has to hold max_size bytes.
+ * Waits up to timeout_ms for one, -1 waits forever. Returns 1 with a chunk,
+ * 0 on timeout, -1 at the end of the stream and -2 if the chunk is bigger
+ * than max_size, in which case it stays next and can be read again with a
+ * bigger buffer.
+ */
+int slogic_shm_read(struct slogic_shm_reader *reader, struct slogic_shm_chunk *chunk, uint8_t * buffer,
+		    size_t max_size, int timeout_ms);
+
+/* Total number of chunks this reader has skipped */
+uint64_t slogic_shm_reader_dropped(const struct slogic_shm_reader *reader);
+
+void slogic_shm_reader_close(struct slogic_shm_reader *reader);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -0,0 +1,279 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Attaches to a capture published with main -M and writes the samples to a
+ * file or stdout. With -B nothing is written and the CPU time used per
+ * megabyte is reported, which is the overhead of one reader.
+ *
+ * With -P it benchmarks the producer side instead: synthetic samples are
+ * published on the socket at the given rate, 24MHz by default, in the
+ * chunks and the ring main -M uses, with -n reader threads attached that
+ * check what they get. The CPU time of the publishing thread per megabyte
+ * and the longest publish are reported, which is what the capture pays.
+ * More readers, in- or out of process, can attach with -B.
+ */
+#include "shm.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+#define BENCH_SAMPLES_PER_SECOND 24000000
+/* Same as main -M */
+#define BENCH_RING_SIZE (64 * 1024 * 1024)
+#define BENCH_RING_FRAMES 16384
+#define BENCH_CHUNK_SIZE (16 * 1024)
+#define BENCH_MAX_READERS 8
+
+struct bench_reader {
+	struct slogic_shm_reader *reader;
+	uint64_t received;
+	uint64_t corrupt;
+	pthread_t thread;
+};
+
+static double seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return seconds(tv);
+}
+
+static double thread_cpu()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sample n of the synthetic capture, a counter the readers can check */
+static inline uint8_t sample(uint64_t n)
+{
+	return n ^ (n >> 8);
+}
+
+static void *bench_reader_main(void *arg)
+{
+	struct bench_reader *bench = arg;
+	struct slogic_shm_chunk chunk;
+	uint8_t *data = malloc(BENCH_CHUNK_SIZE);
+	size_t i;
+
+	if (!data) {
+		return NULL;
+	}
+	while (slogic_shm_read(bench->reader, &chunk, data, BENCH_CHUNK_SIZE, -1) == 1) {
+		for (i = 0; i < chunk.size; i++) {
+			bench->corrupt += data[i] != sample(chunk.sample_offset + i);
+		}
+		bench->received += chunk.size;
+	}
+	free(data);
+	return NULL;
+}
+
+/* Publishes paced at the sample rate, or as fast as possible at 0 */
+static int produce(const char *socket_path, unsigned int samples_per_second, unsigned int n_seconds,
+		   unsigned int n_readers)
+{
+	struct slogic_shm_producer *producer;
+	struct bench_reader readers[BENCH_MAX_READERS];
+	uint64_t n_samples = (uint64_t)(samples_per_second ? samples_per_second : BENCH_SAMPLES_PER_SECOND)
+	    * n_seconds;
+	uint8_t data[BENCH_CHUNK_SIZE];
+	struct timespec delay;
+	uint64_t offset, corrupt = 0;
+	double start, elapsed, due, wait, cpu = 0, before, took, longest = 0;
+	unsigned int i;
+	size_t j, n;
+
+	producer = slogic_shm_producer_open(socket_path, BENCH_RING_SIZE, BENCH_RING_FRAMES);
+	if (!producer) {
+		return -1;
+	}
+	for (i = 0; i < n_readers; i++) {
+		memset(&readers[i], 0, sizeof(readers[i]));
+		readers[i].reader = slogic_shm_reader_open(socket_path);
+		if (!readers[i].reader || pthread_create(&readers[i].thread, NULL, bench_reader_main, &readers[i])) {
+			perror("attaching a reader");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start = now();
+	for (offset = 0; offset < n_samples; offset += n) {
+		n = n_samples - offset < sizeof(data) ? n_samples - offset : sizeof(data);
+		for (j = 0; j < n; j++) {
+			data[j] = sample(offset + j);
+		}
+		if (samples_per_second) {
+			due = start + (double)offset / samples_per_second;
+			wait = due - now();
+			if (wait > 0) {
+				delay.tv_sec = wait;
+				delay.tv_nsec = (wait - delay.tv_sec) * 1e9;
+				nanosleep(&delay, NULL);
+			}
+		}
+		before = thread_cpu();
+		slogic_shm_publish(producer, offset, data, n);
+		took = thread_cpu() - before;
+		cpu += took;
+		if (took > longest) {
+			longest = took;
+		}
+	}
+	elapsed = now() - start;
+	slogic_shm_producer_close(producer);
+
+	fprintf(stderr, "%llu samples published in %.3fs (%.1f MB/s)\n", (unsigned long long)n_samples, elapsed,
+		elapsed > 0 ? n_samples / elapsed / 1000000 : 0.0);
+	fprintf(stderr, "publishing: %.3fs CPU, %.2fms per MB, longest %.1fus\n", cpu,
+		n_samples ? cpu * 1000 / (n_samples / 1000000.0) : 0.0, longest * 1e6);
+	for (i = 0; i < n_readers; i++) {
+		pthread_join(readers[i].thread, NULL);
+		fprintf(stderr, "reader %u: %llu samples received, %llu chunks dropped\n", i,
+			(unsigned long long)readers[i].received,
+			(unsigned long long)slogic_shm_reader_dropped(readers[i].reader));
+		corrupt += readers[i].corrupt;
+		slogic_shm_reader_close(readers[i].reader);
+	}
+	if (corrupt) {
+		fprintf(stderr, "%llu samples corrupted\n", (unsigned long long)corrupt);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "usage: %s [-B] <socket path> [<output file>]\n", me);
+	fprintf(stderr, "       %s -P [-r <samples per second>] [-s <seconds>] [-n <readers>] <socket path>\n", me);
+	fprintf(stderr, " -B: Report the CPU time of reading instead of writing the samples.\n");
+	fprintf(stderr, " -P: Publish -s seconds of synthetic samples at the -r rate to -n reader threads.\n");
+	fprintf(stderr, "     -r 0 publishes as many samples as 24MHz would, as fast as possible.\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_shm_reader *reader;
+	struct slogic_shm_chunk chunk;
+	struct timeval start, end;
+	struct rusage rusage;
+	uint64_t received = 0, gaps = 0, lost = 0, expected = 0;
+	bool first = true;
+	bool benchmark = false;
+	bool produce_bench = false;
+	unsigned int samples_per_second = BENCH_SAMPLES_PER_SECOND;
+	unsigned int n_seconds = 10;
+	unsigned int n_readers = 1;
+	uint8_t *data;
+	FILE *out = stdout;
+	double elapsed, cpu;
+	int ret, c;
+
+	while ((c = getopt(argc, argv, "BPr:s:n:")) != -1) {
+		switch (c) {
+		case 'B':
+			benchmark = true;
+			break;
+		case 'P':
+			produce_bench = true;
+			break;
+		case 'r':
+			samples_per_second = atoi(optarg);
+			break;
+		case 's':
+			n_seconds = atoi(optarg);
+			break;
+		case 'n':
+			n_readers = atoi(optarg);
+			if (n_readers > BENCH_MAX_READERS) {
+				n_readers = BENCH_MAX_READERS;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 && (produce_bench || argc - optind != 2)) {
+		usage(argv[0]);
+	}
+
+	if (produce_bench) {
+		exit(produce(argv[optind], samples_per_second, n_seconds, n_readers) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	reader = slogic_shm_reader_open(argv[optind]);
+	if (!reader) {
+		perror("attaching to the capture");
+		exit(EXIT_FAILURE);
+	}
+	if (!benchmark && argc - optind == 2 && strcmp(argv[optind + 1], "-")) {
+		out = fopen(argv[optind + 1], "w");
+		if (!out) {
+			perror("opening output file");
+			exit(EXIT_FAILURE);
+		}
+	}
+	data = malloc(MAX_CHUNK_SIZE);
+	if (!data) {
+		exit(EXIT_FAILURE);
+	}
+
+	gettimeofday(&start, NULL);
+	while ((ret = slogic_shm_read(reader, &chunk, data, MAX_CHUNK_SIZE, -1)) == 1) {
+		if (chunk.dropped) {
+			fprintf(stderr, "%llu chunks dropped before sample %llu\n", (unsigned long long)chunk.dropped,
+				(unsigned long long)chunk.sample_offset);
+			gaps++;
+		} else if (!first && chunk.sample_offset != expected) {
+			/* Lost before the producer got them, in a recovery of the device */
+			fprintf(stderr, "gap at sample %llu, %llu samples lost\n", (unsigned long long)expected,
+				(unsigned long long)(chunk.sample_offset - expected));
+			lost += chunk.sample_offset - expected;
+		}
+		first = false;
+		expected = chunk.sample_offset + chunk.size;
+		received += chunk.size;
+		if (!benchmark && fwrite(data, 1, chunk.size, out) != chunk.size) {
+			perror("writing samples");
+			exit(EXIT_FAILURE);
+		}
+	}
+	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &rusage);
+	if (ret == -2) {
+		fprintf(stderr, "chunk bigger than %d bytes\n", MAX_CHUNK_SIZE);
+	}
+
+	elapsed = seconds(end) - seconds(start);
+	cpu = seconds(rusage.ru_utime) + seconds(rusage.ru_stime);
+	fprintf(stderr, "%llu samples received in %.3fs (%.1f MB/s), %llu gaps, %llu chunks dropped, "
+		"%llu samples lost by the capture\n", (unsigned long long)received, elapsed,
+		elapsed > 0 ? received / elapsed / 1000000 : 0.0, (unsigned long long)gaps,
+		(unsigned long long)slogic_shm_reader_dropped(reader), (unsigned long long)lost);
+	if (benchmark) {
+		fprintf(stderr, "%.3fs CPU, %.2fms per MB\n", cpu,
+			received ? cpu * 1000 / (received / 1000000.0) : 0.0);
+	}
+
+	slogic_shm_reader_close(reader);
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(data);
+	exit(ret == -2 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,691 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * The simulated Logic, see simusb.h. Every pending transfer has a time it
+ * completes at, worked out from the state of the device whenever events are
+ * handled, so that a command changes what the transfers behind it do. A
+ * timerfd armed for the earliest one is the only descriptor.
+ */
+#include "simusb.h"
+
+#include <libusb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_VENDOR_ID 0x0925
+#define SIM_PRODUCT_ID 0x3881
+#define SIM_MAX_PENDING 1024
+#define SIM_BASE_RATE 48000000ULL
+#define SIM_NEVER UINT64_MAX
+/* Transfers on one endpoint follow each other at least this far apart, about a 512 byte packet at high speed */
+#define SIM_PACKET_USEC 9
+
+/* Writing 0 to the CPUCS register of the FX2 starts the uploaded firmware */
+#define FIRMWARE_REQUEST 0xa0
+#define CPUCS_ADDRESS 0xe600
+
+/* The commands of slogic.c */
+#define COMMAND_START_SAMPLING 0x01
+#define COMMAND_START_PLAYBACK 0x02
+#define COMMAND_READ_BYTE 0x05
+#define COMMAND_WRITE_BYTE 0x06
+
+#define MAX_RESPONSES 256
+
+struct libusb_context {
+	int timer_fd;
+};
+
+struct libusb_device {
+	int unused;
+};
+
+struct libusb_device_handle {
+	/* Handles of an earlier enumeration are dead */
+	unsigned int generation;
+};
+
+struct sim_transfer {
+	struct libusb_transfer *transfer;
+	unsigned int generation;
+	uint64_t submitted;
+	uint64_t deadline;
+	bool cancelled;
+};
+
+static struct libusb_context sim_context = {.timer_fd = -1 };
+static struct libusb_device sim_device;
+
+static struct {
+	bool plugged;
+	bool firmware;
+	unsigned int generation;
+	unsigned int latency;
+
+	bool streaming;
+	bool stalled;
+	uint64_t stream_start;
+	uint64_t stream_position;
+	uint64_t rate;
+
+	bool playing;
+	/* Time the device has played everything it was given */
+	uint64_t play_free;
+	uint64_t play_position;
+	uint64_t underruns;
+	uint64_t mismatches;
+
+	/* Time the previous transfer on each endpoint completed */
+	uint64_t pipe_free[2][16];
+
+	uint8_t reg;
+	/* Read byte commands not answered on EP1 IN yet, when they came in and what they read */
+	uint64_t responses[MAX_RESPONSES];
+	uint8_t response_values[MAX_RESPONSES];
+	unsigned int response_head;
+	unsigned int n_responses;
+
+	struct sim_transfer pending[SIM_MAX_PENDING];
+	unsigned int n_pending;
+
+	struct simusb_event events[SIMUSB_MAX_EVENTS];
+	unsigned int n_events;
+} sim = {
+	.plugged = true,
+	.firmware = true,
+	.latency = 125,
+};
+
+static uint64_t now_usec()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void add_event(enum simusb_event_type type, unsigned int value, uint64_t usec)
+{
+	if (sim.n_events < SIMUSB_MAX_EVENTS) {
+		sim.events[sim.n_events].type = type;
+		sim.events[sim.n_events].value = value;
+		sim.events[sim.n_events].usec = usec;
+		sim.n_events++;
+	}
+}
+
+static bool alive(unsigned int generation)
+{
+	return sim.plugged && generation == sim.generation;
+}
+
+static uint64_t *pipe_free(unsigned char endpoint)
+{
+	return &sim.pipe_free[(endpoint & LIBUSB_ENDPOINT_IN) ? 1 : 0][endpoint & 0x0f];
+}
+
+static uint64_t max_u64(uint64_t a, uint64_t b)
+{
+	return a > b ? a : b;
+}
+
+/* Samples the device has sampled by usec */
+static uint64_t sampled_by(uint64_t usec)
+{
+	return usec > sim.stream_start ? (usec - sim.stream_start) * sim.rate / 1000000 : 0;
+}
+
+/* The first pending transfer on an endpoint is the only one the device works on */
+static bool is_head(unsigned int index)
+{
+	unsigned char endpoint = sim.pending[index].transfer->endpoint;
+	unsigned int i;
+
+	for (i = 0; i < index; i++) {
+		if (sim.pending[i].transfer->endpoint == endpoint && !sim.pending[i].cancelled) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* When a pending transfer completes, how and with how many bytes, given what the device does now */
+static uint64_t completion(unsigned int index, uint64_t now, enum libusb_transfer_status *status, int *length)
+{
+	struct sim_transfer *pending = &sim.pending[index];
+	struct libusb_transfer *transfer = pending->transfer;
+	uint64_t start = max_u64(pending->submitted + sim.latency, *pipe_free(transfer->endpoint) + SIM_PACKET_USEC);
+	uint64_t at = SIM_NEVER;
+	uint64_t available;
+
+	*status = LIBUSB_TRANSFER_COMPLETED;
+	*length = transfer->length;
+	if (pending->cancelled) {
+		*status = LIBUSB_TRANSFER_CANCELLED;
+		*length = 0;
+		return now;
+	}
+	if (!alive(pending->generation)) {
+		*status = LIBUSB_TRANSFER_NO_DEVICE;
+		*length = 0;
+		return now;
+	}
+
+	if (is_head(index)) {
+		switch (transfer->endpoint) {
+		case 0x01:
+			at = start;
+			break;
+		case 0x81:
+			if (sim.n_responses) {
+				at = max_u64(start, sim.responses[sim.response_head]);
+			}
+			break;
+		case 0x82:
+			if (sim.streaming && !sim.stalled) {
+				at = max_u64(start, sim.stream_start
+					     + (sim.stream_position + transfer->length) * 1000000 / sim.rate);
+			}
+			break;
+		case 0x06:
+			if (sim.playing) {
+				at = max_u64(pending->submitted, sim.play_free)
+				    + transfer->length * 1000000ULL / sim.rate;
+			}
+			break;
+		}
+	}
+	if (at <= pending->deadline) {
+		return at;
+	}
+
+	*status = LIBUSB_TRANSFER_TIMED_OUT;
+	*length = 0;
+	if (transfer->endpoint == 0x82 && sim.streaming && !sim.stalled && is_head(index)) {
+		/* Whatever was sampled by then */
+		available = sampled_by(pending->deadline) - sim.stream_position;
+		*length = available < (uint64_t)transfer->length ? available : (uint64_t)transfer->length;
+	}
+	return pending->deadline;
+}
+
+static void handle_command(const unsigned char *command, int length, uint64_t at)
+{
+	if (length < 1) {
+		return;
+	}
+	add_event(SIMUSB_COMMAND, command[0], at);
+	switch (command[0]) {
+	case COMMAND_START_SAMPLING:
+		if (length >= 2) {
+			sim.rate = SIM_BASE_RATE / (command[1] + 1);
+			sim.streaming = true;
+			sim.stream_start = at;
+			sim.stream_position = 0;
+		}
+		break;
+	case COMMAND_START_PLAYBACK:
+		if (length >= 2) {
+			sim.rate = SIM_BASE_RATE / (command[1] + 1);
+			sim.playing = true;
+			sim.play_free = at;
+			sim.play_position = 0;
+		}
+		break;
+	case COMMAND_READ_BYTE:
+		if (sim.n_responses < MAX_RESPONSES) {
+			sim.responses[(sim.response_head + sim.n_responses) % MAX_RESPONSES] = at;
+			sim.response_values[(sim.response_head + sim.n_responses) % MAX_RESPONSES] = sim.reg;
+			sim.n_responses++;
+		}
+		break;
+	case COMMAND_WRITE_BYTE:
+		if (length >= 2) {
+			sim.reg = command[1];
+		}
+		break;
+	}
+}
+
+/* What the device does with a transfer completing at the given time */
+static void complete(struct libusb_transfer *transfer, uint64_t at)
+{
+	uint64_t i;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
+		return;
+	}
+	*pipe_free(transfer->endpoint) = at;
+	switch (transfer->endpoint) {
+	case 0x01:
+		handle_command(transfer->buffer, transfer->actual_length, at);
+		break;
+	case 0x81:
+		if (transfer->actual_length) {
+			transfer->buffer[0] = sim.response_values[sim.response_head];
+			sim.response_head = (sim.response_head + 1) % MAX_RESPONSES;
+			sim.n_responses--;
+		}
+		break;
+	case 0x82:
+		for (i = 0; i < (uint64_t)transfer->actual_length; i++) {
+			transfer->buffer[i] = simusb_sample(sim.stream_position + i);
+		}
+		sim.stream_position += transfer->actual_length;
+		break;
+	case 0x06:
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+			break;
+		}
+		add_event(SIMUSB_PLAYBACK_DATA, transfer->actual_length, at);
+		if (at - transfer->length * 1000000ULL / sim.rate > sim.play_free) {
+			/* Came in after the device ran dry */
+			sim.underruns++;
+		}
+		for (i = 0; i < (uint64_t)transfer->actual_length; i++) {
+			sim.mismatches += transfer->buffer[i] != simusb_sample(sim.play_position + i);
+		}
+		sim.play_position += transfer->actual_length;
+		sim.play_free = at;
+		break;
+	}
+}
+
+/* Index of the pending transfer that completes first, -1 if there is none */
+static int next_completion(uint64_t now, uint64_t *at)
+{
+	enum libusb_transfer_status status;
+	uint64_t t;
+	int length;
+	int first = -1;
+	unsigned int i;
+
+	*at = SIM_NEVER;
+	for (i = 0; i < sim.n_pending; i++) {
+		t = completion(i, now, &status, &length);
+		if (t < *at) {
+			*at = t;
+			first = i;
+		}
+	}
+	return first;
+}
+
+static void arm_timer()
+{
+	struct itimerspec timer;
+	uint64_t at;
+
+	if (sim_context.timer_fd < 0) {
+		return;
+	}
+	memset(&timer, 0, sizeof(timer));
+	if (next_completion(now_usec(), &at) >= 0) {
+		/* An it_value of 0 would disarm it */
+		at = at ? at : 1;
+		timer.it_value.tv_sec = at / 1000000;
+		timer.it_value.tv_nsec = (at % 1000000) * 1000;
+	}
+	timerfd_settime(sim_context.timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/* Completes everything that is due and runs the callbacks */
+static void process(void)
+{
+	struct libusb_transfer *transfer;
+	enum libusb_transfer_status status;
+	uint64_t expirations, now, at;
+	int index, length;
+
+	if (read(sim_context.timer_fd, &expirations, sizeof(expirations)) < 0) {
+		/* Nothing expired, the timer is non-blocking */
+	}
+	for (;;) {
+		now = now_usec();
+		index = next_completion(now, &at);
+		if (index < 0 || at > now) {
+			break;
+		}
+		transfer = sim.pending[index].transfer;
+		completion(index, now, &status, &length);
+		memmove(&sim.pending[index], &sim.pending[index + 1],
+			(sim.n_pending - index - 1) * sizeof(struct sim_transfer));
+		sim.n_pending--;
+
+		transfer->status = status;
+		transfer->actual_length = length;
+		complete(transfer, at);
+		transfer->callback(transfer);
+	}
+	arm_timer();
+}
+
+void simusb_set_latency(unsigned int usec)
+{
+	sim.latency = usec;
+}
+
+void simusb_stall()
+{
+	sim.stalled = true;
+	arm_timer();
+}
+
+void simusb_unplug()
+{
+	sim.plugged = false;
+	sim.streaming = false;
+	sim.playing = false;
+	arm_timer();
+}
+
+void simusb_plug()
+{
+	sim.plugged = true;
+	sim.firmware = false;
+	sim.stalled = false;
+	sim.generation++;
+	arm_timer();
+}
+
+unsigned int simusb_events(const struct simusb_event **events)
+{
+	*events = sim.events;
+	return sim.n_events;
+}
+
+uint64_t simusb_playback_underruns()
+{
+	return sim.underruns;
+}
+
+uint64_t simusb_playback_mismatches()
+{
+	return sim.mismatches;
+}
+
+uint8_t simusb_register()
+{
+	return sim.reg;
+}
+
+void simusb_set_register(uint8_t value)
+{
+	sim.reg = value;
+}
+
+/*
+ * libusb
+ */
+
+int libusb_init(libusb_context ** context)
+{
+	if (sim_context.timer_fd < 0) {
+		sim_context.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (sim_context.timer_fd < 0) {
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+	*context = &sim_context;
+	return 0;
+}
+
+void libusb_exit(libusb_context * context)
+{
+}
+
+ssize_t libusb_get_device_list(libusb_context * context, libusb_device *** list)
+{
+	*list = calloc(2, sizeof(libusb_device *));
+	if (!*list) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	if (!sim.plugged) {
+		return 0;
+	}
+	(*list)[0] = &sim_device;
+	return 1;
+}
+
+void libusb_free_device_list(libusb_device ** list, int unref_devices)
+{
+	free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device * device, struct libusb_device_descriptor *descriptor)
+{
+	memset(descriptor, 0, sizeof(*descriptor));
+	descriptor->idVendor = SIM_VENDOR_ID;
+	descriptor->idProduct = SIM_PRODUCT_ID;
+	descriptor->bNumConfigurations = 1;
+	return 0;
+}
+
+int libusb_get_active_config_descriptor(libusb_device * device, struct libusb_config_descriptor **config)
+{
+	*config = calloc(1, sizeof(struct libusb_config_descriptor));
+	if (!*config) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	(*config)->bConfigurationValue = 1;
+	return 0;
+}
+
+int libusb_get_config_descriptor(libusb_device * device, uint8_t index, struct libusb_config_descriptor **config)
+{
+	return libusb_get_active_config_descriptor(device, config);
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+	free(config);
+}
+
+int libusb_open(libusb_device * device, libusb_device_handle ** handle)
+{
+	if (!sim.plugged) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	*handle = malloc(sizeof(libusb_device_handle));
+	if (!*handle) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	(*handle)->generation = sim.generation;
+	return 0;
+}
+
+void libusb_close(libusb_device_handle * handle)
+{
+	free(handle);
+}
+
+int libusb_kernel_driver_active(libusb_device_handle * handle, int interface)
+{
+	return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle * handle, int interface)
+{
+	return 0;
+}
+
+int libusb_set_configuration(libusb_device_handle * handle, int configuration)
+{
+	return alive(handle->generation) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_claim_interface(libusb_device_handle * handle, int interface)
+{
+	return alive(handle->generation) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle * handle, int interface, int alternate_setting)
+{
+	return alive(handle->generation) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_reset_device(libusb_device_handle * handle)
+{
+	if (!alive(handle->generation)) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	add_event(SIMUSB_RESET, 0, now_usec());
+	sim.streaming = false;
+	sim.stalled = false;
+	sim.playing = false;
+	sim.n_responses = 0;
+	arm_timer();
+	return 0;
+}
+
+int libusb_control_transfer(libusb_device_handle * handle, uint8_t request_type, uint8_t request, uint16_t value,
+			    uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	if (!alive(handle->generation)) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (request == FIRMWARE_REQUEST && value == CPUCS_ADDRESS && length >= 1 && data[0] == 0) {
+		/* The firmware runs and the device re-enumerates with it */
+		add_event(SIMUSB_FIRMWARE, 0, now_usec());
+		sim.firmware = true;
+		sim.generation++;
+		arm_timer();
+	}
+	return length;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct sim_transfer *pending;
+	uint64_t now = now_usec();
+
+	if (!alive(transfer->dev_handle->generation)) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (!sim.firmware) {
+		/* Only the control endpoint is there without the firmware */
+		return LIBUSB_ERROR_PIPE;
+	}
+	if (sim.n_pending == SIM_MAX_PENDING) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	pending = &sim.pending[sim.n_pending++];
+	pending->transfer = transfer;
+	pending->generation = transfer->dev_handle->generation;
+	pending->submitted = now;
+	pending->deadline = transfer->timeout ? now + transfer->timeout * 1000ULL : SIM_NEVER;
+	pending->cancelled = false;
+	if (transfer->endpoint == 0x06) {
+		add_event(SIMUSB_PLAYBACK_QUEUED, transfer->length, now);
+	}
+	arm_timer();
+	return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < sim.n_pending; i++) {
+		if (sim.pending[i].transfer == transfer) {
+			sim.pending[i].cancelled = true;
+			arm_timer();
+			return 0;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_handle_events_timeout(libusb_context * context, struct timeval *tv)
+{
+	struct pollfd fd = {.fd = sim_context.timer_fd,.events = POLLIN };
+	uint64_t now = now_usec();
+	uint64_t limit = now + tv->tv_sec * 1000000ULL + tv->tv_usec;
+	uint64_t at;
+
+	if (next_completion(now, &at) < 0 || at > now) {
+		at = at < limit ? at : limit;
+		poll(&fd, 1, (at - now + 999) / 1000);
+	}
+	process();
+	return 0;
+}
+
+static void on_sync_transfer(struct libusb_transfer *transfer)
+{
+	*(bool *)transfer->user_data = true;
+}
+
+int libusb_bulk_transfer(libusb_device_handle * handle, unsigned char endpoint, unsigned char *data, int length,
+			 int *transferred, unsigned int timeout)
+{
+	struct libusb_transfer transfer;
+	struct timeval tv = { 1, 0 };
+	bool done = false;
+	int ret;
+
+	memset(&transfer, 0, sizeof(transfer));
+	libusb_fill_bulk_transfer(&transfer, handle, endpoint, data, length, on_sync_transfer, &done, timeout);
+	ret = libusb_submit_transfer(&transfer);
+	if (ret) {
+		return ret;
+	}
+	while (!done) {
+		libusb_handle_events_timeout(&sim_context, &tv);
+	}
+	*transferred = transfer.actual_length;
+	switch (transfer.status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+int libusb_get_next_timeout(libusb_context * context, struct timeval *tv)
+{
+	/* The timeouts are simulated, the timer descriptor wakes up for them */
+	return 0;
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context * context)
+{
+	static struct libusb_pollfd timer;
+	const struct libusb_pollfd **pollfds = calloc(2, sizeof(struct libusb_pollfd *));
+
+	if (!pollfds) {
+		return NULL;
+	}
+	timer.fd = sim_context.timer_fd;
+	timer.events = POLLIN;
+	pollfds[0] = &timer;
+	return pollfds;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+	free(pollfds);
+}
+
+void libusb_set_pollfd_notifiers(libusb_context * context, libusb_pollfd_added_cb added,
+				 libusb_pollfd_removed_cb removed, void *user_data)
+{
+	/* The timer descriptor is the only one and never changes */
+}
@@ -0,0 +1,86 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __SIMUSB_H__
+#define __SIMUSB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * A simulated Logic behind the part of the libusb API that libslogic uses,
+ * for the tests and benchmarks that run without a device: they link
+ * simusb.o instead of libusb-1.0. There is one device and one context, and
+ * everything happens from the libusb calls of a single thread.
+ *
+ * The device starts plugged in with the firmware running and handles the
+ * EP1 OUT commands of slogic.c: start sampling streams simusb_sample(n) on
+ * EP2 IN at the sample rate, start playback takes EP6 OUT at the sample
+ * rate, read byte answers the register on EP1 IN and write byte sets it.
+ * The sample rate is 48MHz / (sample delay + 1), which the table in
+ * slogic.c follows. Every transfer takes the bus latency, which transfers
+ * queued on the same endpoint overlap, and a transfer the device can't
+ * complete in time times out like on the real bus. The
+ * simulation only has to be as exact as the tests that use it.
+ */
+
+/* Value of sample n after start sampling, a counter that shows lost or reordered data */
+static inline uint8_t simusb_sample(uint64_t n)
+{
+	return n ^ (n >> 8);
+}
+
+/* What the device saw, in the order it saw it */
+enum simusb_event_type {
+	/* A command on EP1 OUT, the value is the command byte */
+	SIMUSB_COMMAND,
+	/* A transfer queued for EP6 OUT, the value is its size */
+	SIMUSB_PLAYBACK_QUEUED,
+	/* A transfer taken from EP6 OUT, the value is its size */
+	SIMUSB_PLAYBACK_DATA,
+	SIMUSB_RESET,
+	/* The firmware was uploaded and the device re-enumerated */
+	SIMUSB_FIRMWARE,
+};
+
+struct simusb_event {
+	enum simusb_event_type type;
+	unsigned int value;
+	uint64_t usec;
+};
+
+/* Time from submitting a transfer to the earliest it can complete, 125us by default */
+void simusb_set_latency(unsigned int usec);
+
+/* EP2 IN stops delivering and its transfers time out, until the device is reset */
+void simusb_stall();
+
+/* Transfers fail with NO_DEVICE and the device can't be found */
+void simusb_unplug();
+
+/* Plugs the device back in, re-enumerated and without the firmware */
+void simusb_plug();
+
+/* The events so far, returns how many there are. Only the first SIMUSB_MAX_EVENTS are kept */
+#define SIMUSB_MAX_EVENTS 65536
+unsigned int simusb_events(const struct simusb_event **events);
+
+/* EP6 OUT transfers the device had to wait for after it played all it had */
+uint64_t simusb_playback_underruns();
+
+/* Bytes played that weren't simusb_sample(n) for the n-th byte of the playback */
+uint64_t simusb_playback_mismatches();
+
+uint8_t simusb_register();
+void simusb_set_register(uint8_t value);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -1,6 +1,7 @@
 // vim: sw=8:ts=8:noexpandtab
 #include "firmware/firmware.h"
 #include "slogic.h"
+#include "rt.h"
 #include "usbutil.h"
 #include "log.h"
 
@@ -14,6 +15,20 @@
 #define DEFAULT_N_TRANSFER_BUFFERS 4
 #define DEFAULT_TRANSFER_BUFFER_SIZE (4 * 1024)
 #define DEFAULT_TRANSFER_TIMEOUT 1000
+#define DEFAULT_MAX_RECOVERIES 0
+
+/* Number of timed out transfers in a row before the device is considered stalled */
+#define MAX_CONSECUTIVE_TIMEOUTS 1000
+/* How many times the device is looked up again (once a second) when recovering */
+#define RECOVERY_ATTEMPTS 10
+#define RECOVERY_RETRY_USEC 1000000
+/* Number of 100ms rounds to wait for cancelled transfers */
+#define CANCEL_ROUNDS 50
+#define CANCEL_TIMEOUT_USEC (CANCEL_ROUNDS * 100000ULL)
+/* Stale data is read with a short timeout until the FIFO is empty */
+#define FLUSH_TIMEOUT 10
+#define FLUSH_MAX_READS 64
+#define START_COMMAND_TIMEOUT 100
 
 /*
  * define EP1 OUT , EP1 IN, EP2 IN and EP6 OUT
@@ -23,6 +38,22 @@
 #define STREAMING_DATA_IN_ENDPOINT 0x82
 #define STREAMING_DATA_OUT_ENDPOINT 0x06
 
+/*
+ * Commands sent on EP1 OUT. Only read byte is in the usbmon trace in
+ * docs/usb_trace_info.txt, start sampling is what the code has always
+ * sent. Start playback is a guess that mirrors start sampling with the
+ * sample delay as its argument, it is only sent with experimental_commands.
+ */
+#define COMMAND_START_SAMPLING 0x01
+#define COMMAND_START_PLAYBACK 0x02
+#define COMMAND_READ_BYTE 0x05
+/* A guess as well, taking the byte to write as its argument, also only sent with experimental_commands */
+#define COMMAND_WRITE_BYTE 0x06
+
+/* Polled mode */
+#define POLL_TIMEOUT 100
+#define POLL_MAX_PENDING_WRITES 64
+
 /* Bus 006 Device 006: ID 0925:3881 Lakeview Research */
 #define USB_VENDOR_ID 0x0925
 #define USB_PRODUCT_ID 0x3881
@@ -49,6 +80,11 @@ struct slogic_sample_rate sample_rates[] = {
 	{0, NULL, 0},
 };
 
+unsigned int slogic_api_version()
+{
+	return (SLOGIC_API_VERSION_MAJOR << 16) | SLOGIC_API_VERSION_MINOR;
+}
+
 struct slogic_sample_rate *slogic_get_sample_rates()
 {
 	return sample_rates;
@@ -66,7 +102,8 @@ struct slogic_sample_rate *slogic_parse_sample_rate(const char *str)
 	return NULL;
 }
 
-void slogic_upload_firmware(struct slogic_handle *handle)
+/* The device re-enumerates with the new firmware about a second later */
+static void upload_firmware(struct slogic_handle *handle)
 {
 	int counter;
 	unsigned int *current;
@@ -85,6 +122,11 @@ void slogic_upload_firmware(struct slogic_handle *handle)
 		data_start += current[2];
 		current += cmd_size;
 	}
+}
+
+void slogic_upload_firmware(struct slogic_handle *handle)
+{
+	upload_firmware(handle);
 	sleep(1);
 }
 
@@ -92,7 +134,7 @@ void slogic_upload_firmware(struct slogic_handle *handle)
 bool slogic_is_firmware_uploaded(struct slogic_handle *handle)
 {
 	/* just try to perform a normal read, if this fails we assume the firmware is not uploaded */
-	unsigned char out_byte = 0x05;
+	unsigned char out_byte = COMMAND_READ_BYTE;
 	int transferred;
 	int ret = libusb_bulk_transfer(handle->device_handle, COMMAND_OUT_ENDPOINT, &out_byte, 1, &transferred, 100);
 	return ret == 0;	/* probably the firmware is uploaded */
@@ -111,6 +153,15 @@ struct slogic_handle *slogic_init()
 	handle->transfer_buffer_size = DEFAULT_TRANSFER_BUFFER_SIZE;
 	handle->n_transfer_buffers = DEFAULT_N_TRANSFER_BUFFERS;
 	handle->transfer_timeout = DEFAULT_TRANSFER_TIMEOUT;
+	handle->max_recoveries = DEFAULT_MAX_RECOVERIES;
+	handle->fault_injector = NULL;
+	handle->fault_injector_data = NULL;
+	handle->event_cpu = -1;
+	handle->event_priority = 0;
+	handle->experimental_commands = false;
+	handle->jitter = NULL;
+	handle->active_recording = NULL;
+	handle->device_handle = NULL;
 	libusb_init(&handle->context);
 
 	return handle;
@@ -126,9 +177,20 @@ int slogic_open(struct slogic_handle *handle)
 	return 0;
 }
 
+int slogic_reopen(struct slogic_handle *handle)
+{
+	if (handle->device_handle) {
+		libusb_close(handle->device_handle);
+		handle->device_handle = NULL;
+	}
+	return slogic_open(handle);
+}
+
 void slogic_close(struct slogic_handle *handle)
 {
-	libusb_close(handle->device_handle);
+	if (handle->device_handle) {
+		libusb_close(handle->device_handle);
+	}
 	libusb_exit(handle->context);
 	free(handle);
 }
@@ -136,7 +198,7 @@ void slogic_close(struct slogic_handle *handle)
 int slogic_readbyte(struct slogic_handle *handle, unsigned char *out)
 {
 	int ret;
-	unsigned char command = 0x05;
+	unsigned char command = COMMAND_READ_BYTE;
 	int transferred;
 
 	ret = libusb_bulk_transfer(handle->device_handle, COMMAND_OUT_ENDPOINT, &command, 1, &transferred, 100);
@@ -153,13 +215,42 @@ int slogic_readbyte(struct slogic_handle *handle, unsigned char *out)
 	return 0;
 }
 
+int slogic_writebyte(struct slogic_handle *handle, unsigned char value)
+{
+	int ret;
+	unsigned char command[2] = { COMMAND_WRITE_BYTE, value };
+	int transferred;
+
+	if (!handle->experimental_commands) {
+		log_printf(&logger, ERR, "Write byte needs experimental_commands, the command is not traced\n");
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	ret = libusb_bulk_transfer(handle->device_handle, COMMAND_OUT_ENDPOINT, command, 2, &transferred, 100);
+	if (ret) {
+		log_printf(&logger, ERR, "libusb_bulk_transfer (out): %s\n", usbutil_error_to_string(ret));
+		return ret;
+	}
+	return 0;
+}
+
 static int tcounter = 0;
 
+/* Where a recovery is, see advance_recovery */
+enum recovery_step {
+	RECOVERY_IDLE,
+	/* Waiting for the callbacks of the cancelled transfers */
+	RECOVERY_CANCEL,
+	/* Looking up the device again and uploading the firmware */
+	RECOVERY_OPEN,
+};
+
 /* TODO: Rename to slogic_transfer to be consistent - trygvis */
 struct slogic_transfer {
 	struct slogic_internal_recording *internal_recording;
 	struct libusb_transfer *transfer;
 	int seq;
+	/* True while libusb owns the transfer */
+	bool in_flight;
 };
 
 struct slogic_internal_recording {
@@ -167,7 +258,7 @@ struct slogic_internal_recording {
 	struct slogic_recording *recording;
 
 	/* Number of samples collected so far */
-	int sample_count;
+	uint64_t sample_count;
 
 	struct slogic_handle *shandle;
 	/* Number of USB transfers */
@@ -178,6 +269,39 @@ struct slogic_internal_recording {
 	unsigned int n_transfer_buffers;
 
 	bool done;
+
+	/*
+	 * The start command is sent as soon as the transfers are queued, the
+	 * recording is RUNNING once the device has acknowledged it.
+	 */
+	struct libusb_transfer *start_transfer;
+	unsigned char start_command[2];
+	bool start_in_flight;
+	struct timeval started;
+	bool got_first_sample;
+
+	/*
+	 * Recovery. The transfer callback only flags that the device needs
+	 * attention, the actual recovery is driven from the event handling
+	 * as it has to pump libusb events while cancelling the transfers.
+	 */
+	bool recover;
+	enum slogic_recording_state recover_reason;
+	unsigned int recoveries;
+	enum recovery_step recovery_step;
+	unsigned int recovery_attempt;
+	bool recovery_reopen;
+	/* Monotonic time the current step gives up or tries again at */
+	uint64_t recovery_deadline_usec;
+	struct timeval last_data;
+	/*
+	 * Jitter schedule: the monotonic time sample 0 should have been handled
+	 * at, 0 after (re)starting, and the samples handled since.
+	 */
+	uint64_t jitter_base_usec;
+	uint64_t jitter_samples;
+	bool gap_pending;
+	struct slogic_gap gap;
 };
 
 static struct slogic_internal_recording *allocate_internal_recording(struct slogic_handle *handle,
@@ -187,6 +311,7 @@ static struct slogic_internal_recording *allocate_internal_recording(struct slog
 	assert(internal_recording);
 
 	internal_recording->recording = recording;
+	internal_recording->sample_count = 0;
 	internal_recording->transfer_counter = 0;
 	internal_recording->timeout_counter = 0;
 
@@ -197,23 +322,180 @@ static struct slogic_internal_recording *allocate_internal_recording(struct slog
 
 	internal_recording->done = false;
 
+	internal_recording->start_transfer = libusb_alloc_transfer(0 /* we use bulk */ );
+	assert(internal_recording->start_transfer);
+	internal_recording->start_in_flight = false;
+	internal_recording->got_first_sample = false;
+
+	internal_recording->recover = false;
+	internal_recording->recover_reason = UNKNOWN;
+	internal_recording->recoveries = 0;
+	internal_recording->recovery_step = RECOVERY_IDLE;
+	internal_recording->recovery_deadline_usec = 0;
+	internal_recording->gap_pending = false;
+	internal_recording->jitter_base_usec = 0;
+	internal_recording->jitter_samples = 0;
+	gettimeofday(&internal_recording->last_data, NULL);
+
 	return internal_recording;
 }
 
 static void free_internal_recording(struct slogic_internal_recording *internal_recording)
 {
+	libusb_free_transfer(internal_recording->start_transfer);
 	free(internal_recording->transfers);
 	free(internal_recording);
 }
 
+static int submit_transfer(struct slogic_transfer *slogic_transfer)
+{
+	int ret;
+
+	slogic_transfer->seq = tcounter++;
+	ret = libusb_submit_transfer(slogic_transfer->transfer);
+	slogic_transfer->in_flight = ret == 0;
+	return ret;
+}
+
+/*
+ * Report a pending gap to the user. This is done when the first data after a
+ * recovery shows up so that the end time is as close as possible to the time
+ * the device actually started sampling again.
+ */
+static void flush_gap(struct slogic_internal_recording *internal_recording)
+{
+	struct slogic_recording *recording = internal_recording->recording;
+	struct slogic_gap *gap = &internal_recording->gap;
+	uint64_t usec;
+
+	if (!internal_recording->gap_pending) {
+		return;
+	}
+	internal_recording->gap_pending = false;
+
+	gettimeofday(&gap->end, NULL);
+	usec = (gap->end.tv_sec - gap->start.tv_sec) * 1000000ULL + gap->end.tv_usec - gap->start.tv_usec;
+	gap->lost_samples = usec * recording->sample_rate->samples_per_second / 1000000ULL;
+
+	log_printf(&logger, WARNING, "Gap at sample %llu, about %llu samples lost\n",
+		   (unsigned long long)gap->sample_offset, (unsigned long long)gap->lost_samples);
+
+	if (recording->on_gap_callback) {
+		recording->on_gap_callback(gap, recording->user_data);
+	}
+}
+
+static enum slogic_recording_state transfer_status_to_recording_state(enum libusb_transfer_status status)
+{
+	switch (status) {
+	default:
+		/* Make the compiler shut up */
+	case LIBUSB_TRANSFER_COMPLETED:
+		/*
+		 * This shouldn't happen in slogic.
+		 * From libusb docs:
+		 * For bulk/interrupt endpoints: halt condition detected (endpoint stalled).
+		 * For control endpoints: control request not supported.
+		 */
+	case LIBUSB_TRANSFER_STALL:
+		/* We don't cancel transfers without setting should_run = 0 so this should not happen */
+	case LIBUSB_TRANSFER_CANCELLED:
+	case LIBUSB_TRANSFER_ERROR:
+		return UNKNOWN;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return TIMEOUT;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return DEVICE_GONE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return OVERFLOW;
+	}
+}
+
+/*
+ * Either flag the recording for recovery or end it, depending on the status
+ * and the number of recoveries left.
+ */
+static void fail_recording(struct slogic_internal_recording *internal_recording, enum libusb_transfer_status status)
+{
+	enum slogic_recording_state state = transfer_status_to_recording_state(status);
+
+	if (internal_recording->recoveries < internal_recording->shandle->max_recoveries &&
+	    (status == LIBUSB_TRANSFER_TIMED_OUT || status == LIBUSB_TRANSFER_NO_DEVICE
+	     || status == LIBUSB_TRANSFER_ERROR)) {
+		log_printf(&logger, WARNING, "Transfer failed: %s, trying to recover\n",
+			   usbutil_transfer_status_to_string(status));
+		internal_recording->recover = true;
+		internal_recording->recover_reason = state;
+		return;
+	}
+
+	internal_recording->done = true;
+
+	log_printf(&logger, ERR, "Transfer failed: %s\n", usbutil_transfer_status_to_string(status));
+
+	internal_recording->recording->recording_state = state;
+}
+
+/* A transfer could not be resubmitted from its callback */
+static void resubmit_failed(struct slogic_internal_recording *internal_recording, int ret)
+{
+	if (ret == LIBUSB_ERROR_NO_DEVICE) {
+		/* Unplugged since the transfer completed, the same as the transfer failing with it */
+		fail_recording(internal_recording, LIBUSB_TRANSFER_NO_DEVICE);
+		return;
+	}
+	log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
+	internal_recording->recording->recording_state = UNKNOWN;
+	internal_recording->done = true;
+}
+
 void slogic_read_samples_callback_start_log(struct libusb_transfer *transfer)
 {
-	struct slogic_recording *recording = transfer->user_data;
+	struct slogic_internal_recording *internal_recording = transfer->user_data;
+
+	internal_recording->start_in_flight = false;
+	if (internal_recording->done || internal_recording->recover) {
+		return;
+	}
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		log_printf(&logger, ERR, "Failed to send the start command\n");
+		fail_recording(internal_recording, transfer->status);
+		return;
+	}
+
 	log_printf(&logger, DEBUG, "start log\n");
-	recording->recording_state = RUNNING;
-	libusb_free_transfer(transfer);
-	/* free data? */
-};
+	internal_recording->recording->recording_state = RUNNING;
+	flush_gap(internal_recording);
+}
+
+/*
+ * The transfer ending with sample n should be handled n / samples_per_second
+ * after sample 0. Anything above that is time the device spent filling its
+ * FIFO while we were not listening. Measuring against the schedule instead
+ * of the previous transfer counts a late transfer once, not once more for
+ * the transfer after it. The schedule starts at the first transfer and
+ * moves earlier whenever a transfer is handled ahead of it, which means the
+ * first one was late. Those transfers count as on time.
+ */
+static void measure_jitter(struct slogic_internal_recording *internal_recording, int n_samples)
+{
+	uint64_t now = slogic_rt_now_usec();
+	unsigned int samples_per_second = internal_recording->recording->sample_rate->samples_per_second;
+	uint64_t due, expected;
+	bool first = !internal_recording->jitter_base_usec;
+
+	internal_recording->jitter_samples += n_samples;
+	due = internal_recording->jitter_samples * 1000000 / samples_per_second;
+	expected = internal_recording->jitter_base_usec + due;
+	if (first || now < expected) {
+		internal_recording->jitter_base_usec = now - due;
+		expected = now;
+	}
+	if (!first) {
+		slogic_jitter_add(internal_recording->shandle->jitter, now - expected);
+	}
+}
 
 /*
  * Is some kind of synchronization required here? libusb is not supposed to
@@ -223,14 +505,19 @@ void slogic_read_samples_callback_start_log(struct libusb_transfer *transfer)
 void slogic_read_samples_callback(struct libusb_transfer *transfer)
 {
 	struct slogic_transfer *slogic_transfer = transfer->user_data;
+	assert(slogic_transfer);
 	struct slogic_internal_recording *internal_recording = slogic_transfer->internal_recording;
 	struct slogic_recording *recording = internal_recording->recording;
-	assert(slogic_transfer);
+	struct slogic_handle *handle = internal_recording->shandle;
+	enum libusb_transfer_status status = transfer->status;
 
-	if (internal_recording->done) {
+	slogic_transfer->in_flight = false;
+
+	if (internal_recording->done || internal_recording->recover) {
 		/*
 		 * This will happen if there was more incoming transfers when the
-		 * callback wanted to stop recording. The outer method will handle
+		 * callback wanted to stop recording or when the transfers are
+		 * cancelled to recover the device. The outer method will handle
 		 * the cleanup so just return here.
 		 */
 		return;
@@ -238,12 +525,42 @@ void slogic_read_samples_callback(struct libusb_transfer *transfer)
 
 	slogic_transfer->internal_recording->transfer_counter++;
 
+	if (handle->fault_injector) {
+		status = handle->fault_injector(internal_recording->transfer_counter, status,
+						handle->fault_injector_data);
+		if (status != transfer->status) {
+			/* Whatever the device sent is considered lost */
+			transfer->actual_length = 0;
+		}
+	}
+
 	/*
 	 * Handle the success as a special case, the failure logic is basically: abort.
 	 * Note that this does not indicate that the entire amount of requested data was transferred.
+	 * A transfer that timed out while running may still carry data.
 	 */
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED || recording->recording_state == RUNNING) {
+	if (status == LIBUSB_TRANSFER_COMPLETED ||
+	    (recording->recording_state == RUNNING && status == LIBUSB_TRANSFER_TIMED_OUT
+	     && transfer->actual_length > 0)) {
+		flush_gap(internal_recording);
+
+		if (!internal_recording->got_first_sample && transfer->actual_length > 0) {
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			recording->startup_usec = (now.tv_sec - internal_recording->started.tv_sec) * 1000000 +
+			    now.tv_usec - internal_recording->started.tv_usec;
+			internal_recording->got_first_sample = true;
+			log_printf(&logger, INFO, "First sample after %u.%03ums\n",
+				   recording->startup_usec / 1000, recording->startup_usec % 1000);
+		}
+
+		if (handle->jitter && transfer->actual_length > 0) {
+			measure_jitter(internal_recording, transfer->actual_length);
+		}
+
 		internal_recording->sample_count += transfer->actual_length;
+		internal_recording->timeout_counter = 0;
+		gettimeofday(&internal_recording->last_data, NULL);
 
 		bool more =
 		    recording->on_data_callback(transfer->buffer, transfer->actual_length, recording->user_data);
@@ -256,88 +573,289 @@ void slogic_read_samples_callback(struct libusb_transfer *transfer)
 		}
 
 		int old_seq = slogic_transfer->seq;
-		slogic_transfer->seq = tcounter++;
-		int ret = libusb_submit_transfer(slogic_transfer->transfer);
+		int ret = submit_transfer(slogic_transfer);
 		if (ret) {
-			log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
-			internal_recording->recording->recording_state = UNKNOWN;
-			internal_recording->done = true;
+			resubmit_failed(internal_recording, ret);
 			return;
 		}
 
-		log_printf(&logger, DEBUG, "Rescheduled transfer %d as %d\n", old_seq, slogic_transfer->seq);
+		log_trace(&logger, DEBUG, "Rescheduled transfer %d as %d\n", old_seq, slogic_transfer->seq);
 		return;
 	}
 
-	if (internal_recording->transfer_counter == 200) {
-		struct libusb_transfer *transfer;
-		unsigned char command[] = { 0x01, recording->sample_rate->sample_delay };
-		transfer = libusb_alloc_transfer(0 /* we use bulk */ );
-		assert(transfer);
-		libusb_fill_bulk_transfer(transfer,
-					  internal_recording->shandle->device_handle, 0x01,
-					  command, 2, slogic_read_samples_callback_start_log, recording, 40);
-		libusb_submit_transfer(transfer);
-	}
-	if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+	if (status == LIBUSB_TRANSFER_TIMED_OUT) {
 		if (recording->recording_state == RUNNING) {
 			slogic_transfer->internal_recording->timeout_counter++;
 		}
-		if (internal_recording->timeout_counter < 1000) {
-			slogic_transfer->seq = tcounter++;
-			int ret = libusb_submit_transfer(slogic_transfer->transfer);
+		if (internal_recording->timeout_counter < MAX_CONSECUTIVE_TIMEOUTS) {
+			int ret = submit_transfer(slogic_transfer);
 			if (ret) {
-				log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
-				internal_recording->recording->recording_state = UNKNOWN;
-				internal_recording->done = true;
+				resubmit_failed(internal_recording, ret);
 			}
 			return;
 		}
 	}
 
-	internal_recording->done = true;
+	fail_recording(internal_recording, status);
+}
 
-	log_printf(&logger, ERR, "Transfer failed: %s\n", usbutil_transfer_status_to_string(transfer->status));
+/* Cancels the transfers owned by libusb, their callbacks run later */
+static void cancel_in_flight(struct slogic_internal_recording *internal_recording)
+{
+	unsigned int counter;
 
-	switch (transfer->status) {
-	default:
-		/* Make the compiler shut up */
-	case LIBUSB_TRANSFER_COMPLETED:
-		/*
-		 * This shouldn't happen in slogic.
-		 * From libusb docs:
-		 * For bulk/interrupt endpoints: halt condition detected (endpoint stalled).
-		 * For control endpoints: control request not supported.
-		 */
-	case LIBUSB_TRANSFER_STALL:
-		/* We don't cancel transfers without setting should_run = 0 so this should not happen */
-	case LIBUSB_TRANSFER_CANCELLED:
-	case LIBUSB_TRANSFER_ERROR:
-		recording->recording_state = UNKNOWN;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		recording->recording_state = TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		recording->recording_state = DEVICE_GONE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		recording->recording_state = OVERFLOW;
+	for (counter = 0; counter < internal_recording->n_transfer_buffers; counter++) {
+		if (internal_recording->transfers[counter].in_flight) {
+			libusb_cancel_transfer(internal_recording->transfers[counter].transfer);
+		}
+	}
+	if (internal_recording->start_in_flight) {
+		libusb_cancel_transfer(internal_recording->start_transfer);
+	}
+}
+
+static unsigned int count_in_flight(struct slogic_internal_recording *internal_recording)
+{
+	unsigned int in_flight = internal_recording->start_in_flight ? 1 : 0;
+	unsigned int counter;
+
+	for (counter = 0; counter < internal_recording->n_transfer_buffers; counter++) {
+		if (internal_recording->transfers[counter].in_flight) {
+			in_flight++;
+		}
+	}
+	return in_flight;
+}
+
+/*
+ * Cancel all transfers owned by libusb and wait until their callbacks have
+ * been run. Gives up after a while if the device does not respond at all,
+ * libusb still owns the transfers then and they must not be freed. Returns 0
+ * once none are in flight.
+ */
+static int cancel_transfers(struct slogic_internal_recording *internal_recording)
+{
+	struct timeval timeout = { 0, 100000 };
+	int round;
+
+	cancel_in_flight(internal_recording);
+	for (round = 0; round < CANCEL_ROUNDS; round++) {
+		if (!count_in_flight(internal_recording)) {
+			return 0;
+		}
+		if (libusb_handle_events_timeout(internal_recording->shandle->context, &timeout)) {
+			break;
+		}
+	}
+	if (!count_in_flight(internal_recording)) {
+		return 0;
+	}
+	log_printf(&logger, ERR, "Gave up waiting for cancelled transfers\n");
+	return -1;
+}
+
+/*
+ * Read whatever the device has left in its FIFO from an earlier run so that
+ * it doesn't show up as the first samples of this recording.
+ */
+static void flush_fifo(struct slogic_handle *handle)
+{
+	unsigned char *buffer = malloc(handle->transfer_buffer_size);
+	size_t flushed = 0;
+	int transferred;
+	int counter;
+	int ret;
+
+	assert(buffer);
+	for (counter = 0; counter < FLUSH_MAX_READS; counter++) {
+		transferred = 0;
+		ret = libusb_bulk_transfer(handle->device_handle, STREAMING_DATA_IN_ENDPOINT, buffer,
+					   handle->transfer_buffer_size, &transferred, FLUSH_TIMEOUT);
+		flushed += transferred;
+		if (ret || transferred == 0) {
+			break;
+		}
+	}
+	free(buffer);
+
+	log_printf(&logger, DEBUG, "Flushed %zu stale bytes\n", flushed);
+}
+
+/*
+ * Start sampling: empty the FIFO, queue all the transfers and tell the device
+ * to start right away. Used both for the initial start and after a recovery.
+ */
+static int start_sampling(struct slogic_internal_recording *internal_recording)
+{
+	struct slogic_handle *handle = internal_recording->shandle;
+	struct slogic_recording *recording = internal_recording->recording;
+	unsigned int counter;
+	int ret;
+
+	internal_recording->transfer_counter = 0;
+	internal_recording->timeout_counter = 0;
+	internal_recording->jitter_base_usec = 0;
+	internal_recording->jitter_samples = 0;
+	recording->recording_state = WARMING_UP;
+
+	flush_fifo(handle);
+
+	for (counter = 0; counter < internal_recording->n_transfer_buffers; counter++) {
+		internal_recording->transfers[counter].transfer->dev_handle = handle->device_handle;
+		ret = submit_transfer(&internal_recording->transfers[counter]);
+		if (ret) {
+			log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
+			return ret;
+		}
+	}
+
+	internal_recording->start_command[0] = COMMAND_START_SAMPLING;
+	internal_recording->start_command[1] = recording->sample_rate->sample_delay;
+	libusb_fill_bulk_transfer(internal_recording->start_transfer, handle->device_handle,
+				  COMMAND_OUT_ENDPOINT, internal_recording->start_command, 2,
+				  slogic_read_samples_callback_start_log, internal_recording, START_COMMAND_TIMEOUT);
+	ret = libusb_submit_transfer(internal_recording->start_transfer);
+	if (ret) {
+		log_printf(&logger, ERR, "libusb_submit_transfer (start): %s\n", usbutil_error_to_string(ret));
+		return ret;
+	}
+	internal_recording->start_in_flight = true;
+
+	return 0;
+}
+
+/*
+ * The recovery state machine:
+ *
+ *  cancel transfers -> reset device -> (re)open -> upload firmware -> restart
+ *
+ * A reset of a device that has been unplugged or that re-enumerated with a
+ * new address fails, in that case the device has to be looked up again.
+ * Uploading the firmware makes the device re-enumerate as well. The restart
+ * uses the same sample rate and the normal warm up logic.
+ *
+ * It is advanced from the event handling and never sleeps: every call takes
+ * the steps that are due and leaves the deadline of the next one, which
+ * slogic_get_next_timeout reports. The cancelled transfers are waited for
+ * up to CANCEL_TIMEOUT_USEC and the device is looked up once a second. The
+ * reset itself is synchronous, libusb has no other. Returns 0 while
+ * recovering or once restarted and -1 when giving up.
+ */
+static int advance_recovery(struct slogic_internal_recording *internal_recording)
+{
+	struct slogic_handle *handle = internal_recording->shandle;
+	struct slogic_recording *recording = internal_recording->recording;
+	uint64_t now = slogic_rt_now_usec();
+	int ret;
+
+	switch (internal_recording->recovery_step) {
+	case RECOVERY_IDLE:
+		internal_recording->recoveries++;
+		recording->recording_state = RECOVERING;
+		log_printf(&logger, WARNING, "Recovering the device, attempt %u of %u\n",
+			   internal_recording->recoveries, handle->max_recoveries);
+
+		if (!internal_recording->gap_pending) {
+			internal_recording->gap.sample_offset = internal_recording->sample_count;
+			internal_recording->gap.start = internal_recording->last_data;
+			internal_recording->gap.reason = internal_recording->recover_reason;
+			internal_recording->gap_pending = true;
+		}
+
+		cancel_in_flight(internal_recording);
+		internal_recording->recovery_step = RECOVERY_CANCEL;
+		internal_recording->recovery_deadline_usec = now + CANCEL_TIMEOUT_USEC;
+		/* Fall through */
+	case RECOVERY_CANCEL:
+		if (count_in_flight(internal_recording)) {
+			if (now < internal_recording->recovery_deadline_usec) {
+				return 0;
+			}
+			/* The transfers are still libusb's, slogic_stop_recording leaves them alone */
+			log_printf(&logger, ERR, "Gave up waiting for cancelled transfers\n");
+			return -1;
+		}
+
+		ret = handle->device_handle ? libusb_reset_device(handle->device_handle) : LIBUSB_ERROR_NO_DEVICE;
+		if (ret) {
+			log_printf(&logger, INFO, "libusb_reset_device: %s\n", usbutil_error_to_string(ret));
+		}
+		internal_recording->recovery_reopen = ret != 0;
+		internal_recording->recovery_attempt = 0;
+		internal_recording->recovery_step = RECOVERY_OPEN;
+		internal_recording->recovery_deadline_usec = now;
+		/* Fall through */
+	case RECOVERY_OPEN:
+		if (now < internal_recording->recovery_deadline_usec) {
+			return 0;
+		}
+		if (internal_recording->recovery_attempt++ == RECOVERY_ATTEMPTS) {
+			log_printf(&logger, ERR, "Unable to recover the device\n");
+			return -1;
+		}
+		internal_recording->recovery_deadline_usec = now + RECOVERY_RETRY_USEC;
+		if (internal_recording->recovery_reopen) {
+			if (slogic_reopen(handle)) {
+				return 0;
+			}
+			internal_recording->recovery_reopen = false;
+		}
+		if (!slogic_is_firmware_uploaded(handle)) {
+			log_printf(&logger, INFO, "Uploading the firmware\n");
+			upload_firmware(handle);
+			internal_recording->recovery_reopen = true;
+			return 0;
+		}
 		break;
 	}
+
+	internal_recording->recovery_step = RECOVERY_IDLE;
+	internal_recording->recover = false;
+
+	return start_sampling(internal_recording) ? -1 : 0;
 }
 
-int slogic_execute_recording(struct slogic_handle *handle, struct slogic_recording *recording)
+/* True while a recovery is in progress, with the time until its next step */
+static bool recovery_pending(const struct slogic_internal_recording *internal_recording, uint64_t *usec)
 {
-	/* TODO: validate recording */
-	int retval = 0;
+	uint64_t now;
+
+	if (!internal_recording || internal_recording->done || !internal_recording->recover) {
+		return false;
+	}
+	now = slogic_rt_now_usec();
+	*usec = internal_recording->recovery_deadline_usec > now ? internal_recording->recovery_deadline_usec - now : 0;
+	return true;
+}
 
+/*
+ * Frees the transfers of a recording, the first n have been allocated. None
+ * of them may be in flight.
+ */
+static void free_transfers(struct slogic_internal_recording *internal_recording, unsigned int n)
+{
+	unsigned int counter;
+
+	for (counter = 0; counter < n; counter++) {
+		free(internal_recording->transfers[counter].transfer->buffer);
+		libusb_free_transfer(internal_recording->transfers[counter].transfer);
+		internal_recording->transfers[counter].transfer = NULL;
+	}
+}
+
+int slogic_start_recording(struct slogic_handle *handle, struct slogic_recording *recording)
+{
+	/* TODO: validate recording */
+	struct slogic_internal_recording *internal_recording;
 	struct libusb_transfer *transfer;
 	unsigned char *buffer;
-	int counter;
-	int ret;
+	unsigned int counter;
 
-	struct slogic_internal_recording *internal_recording = allocate_internal_recording(handle, recording);
+	if (handle->active_recording) {
+		log_printf(&logger, ERR, "A recording is already running\n");
+		return -1;
+	}
+	internal_recording = allocate_internal_recording(handle, recording);
 
 	/*
 	 * TODO: We probably want to tune the transfer buffer size to a sane
@@ -361,9 +879,11 @@ int slogic_execute_recording(struct slogic_handle *handle, struct slogic_recordi
 		transfer = libusb_alloc_transfer(0);
 		if (transfer == NULL) {
 			log_printf(&logger, ERR, "libusb_alloc_transfer failed\n");
+			free(buffer);
+			free_transfers(internal_recording, counter);
+			free_internal_recording(internal_recording);
 			recording->recording_state = UNKNOWN;
-			retval = 1;
-			return retval;
+			return -1;
 		}
 		libusb_fill_bulk_transfer(transfer, handle->device_handle,
 					  STREAMING_DATA_IN_ENDPOINT, buffer,
@@ -372,58 +892,155 @@ int slogic_execute_recording(struct slogic_handle *handle, struct slogic_recordi
 					  &internal_recording->transfers[counter], handle->transfer_timeout);
 		internal_recording->transfers[counter].internal_recording = internal_recording;
 		internal_recording->transfers[counter].transfer = transfer;
+		internal_recording->transfers[counter].in_flight = false;
 	}
 
-	recording->recording_state = WARMING_UP;
 	internal_recording->done = false;
+	recording->startup_usec = 0;
 
-	/* Submit all transfers */
-	for (counter = 0; counter < internal_recording->n_transfer_buffers; counter++) {
-		internal_recording->transfers[counter].seq = tcounter++;
-		ret = libusb_submit_transfer(internal_recording->transfers[counter].transfer);
-		if (ret) {
-			log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
-			recording->recording_state = UNKNOWN;
-			retval = 1;
-			return retval;
-		}
+	if (gettimeofday(&internal_recording->started, NULL)) {
+		/* Only with a bad pointer, the start-up and elapsed times would be off */
+		log_printf(&logger, ERR, "Failed to get the start time\n");
+		timerclear(&internal_recording->started);
 	}
+	handle->active_recording = internal_recording;
 
 	log_printf(&logger, DEBUG, "sample_delay=%d\n", recording->sample_rate->sample_delay);
 
-	struct timeval start;
-	assert(gettimeofday(&start, NULL) == 0);
+	if (start_sampling(internal_recording)) {
+		internal_recording->done = true;
+		slogic_stop_recording(handle);
+		recording->recording_state = UNKNOWN;
+		return -1;
+	}
+	return 0;
+}
 
-	struct timeval timeout = { 1, 0 };
-	while (!internal_recording->done) {
-		ret = libusb_handle_events_timeout(handle->context, &timeout);
-		if (ret) {
-			log_printf(&logger, ERR, "libusb_handle_events: %s\n", usbutil_error_to_string(ret));
-			break;
+/* Handles the events of the running recording. Returns 1 while it runs, 0 once it is done and -1 on errors */
+static int handle_recording_events(struct slogic_handle *handle, struct timeval *timeout)
+{
+	struct slogic_internal_recording *internal_recording = handle->active_recording;
+	int ret;
+
+	if (!internal_recording) {
+		return -1;
+	}
+	if (internal_recording->done) {
+		return 0;
+	}
+
+	ret = libusb_handle_events_timeout(handle->context, timeout);
+	if (ret) {
+		log_printf(&logger, ERR, "libusb_handle_events: %s\n", usbutil_error_to_string(ret));
+		internal_recording->recording->recording_state = UNKNOWN;
+		internal_recording->done = true;
+		return -1;
+	}
+	if (internal_recording->recover && advance_recovery(internal_recording)) {
+		internal_recording->recording->recording_state = internal_recording->recover_reason;
+		internal_recording->done = true;
+	}
+	return internal_recording->done ? 0 : 1;
+}
+
+int slogic_handle_events_nonblocking(struct slogic_handle *handle)
+{
+	struct timeval timeout = { 0, 0 };
+
+	return handle_recording_events(handle, &timeout);
+}
+
+int slogic_get_pollfds(struct slogic_handle *handle, struct pollfd *fds, int max_fds)
+{
+	const struct libusb_pollfd **pollfds = libusb_get_pollfds(handle->context);
+	int n;
+
+	if (!pollfds) {
+		log_printf(&logger, ERR, "libusb_get_pollfds failed\n");
+		return -1;
+	}
+	for (n = 0; pollfds[n]; n++) {
+		if (n < max_fds) {
+			fds[n].fd = pollfds[n]->fd;
+			fds[n].events = pollfds[n]->events;
+			fds[n].revents = 0;
 		}
 	}
+	libusb_free_pollfds(pollfds);
+	return n;
+}
+
+void slogic_set_pollfd_notifiers(struct slogic_handle *handle, slogic_pollfd_added_callback added,
+				 slogic_pollfd_removed_callback removed, void *user_data)
+{
+	libusb_set_pollfd_notifiers(handle->context, added, removed, user_data);
+}
+
+int slogic_get_next_timeout(struct slogic_handle *handle, struct timeval *timeout)
+{
+	int ret = libusb_get_next_timeout(handle->context, timeout);
+	uint64_t usec;
 
+	if (ret < 0 || !recovery_pending(handle->active_recording, &usec)) {
+		return ret;
+	}
+	if (ret == 0 || usec < (uint64_t)timeout->tv_sec * 1000000 + timeout->tv_usec) {
+		timeout->tv_sec = usec / 1000000;
+		timeout->tv_usec = usec % 1000000;
+	}
+	return 1;
+}
+
+int slogic_stop_recording(struct slogic_handle *handle)
+{
+	struct slogic_internal_recording *internal_recording = handle->active_recording;
+	struct slogic_recording *recording;
 	struct timeval end;
-	assert(gettimeofday(&end, NULL) == 0);
+	int retval = 0;
 
-	for (counter = 0; counter < internal_recording->n_transfer_buffers; counter++) {
-		libusb_cancel_transfer(internal_recording->transfers[counter].transfer);
-		libusb_free_transfer(internal_recording->transfers[counter].transfer);
-		internal_recording->transfers[counter].transfer = NULL;
+	if (!internal_recording) {
+		return -1;
 	}
+	recording = internal_recording->recording;
 
-	if (internal_recording->recording->recording_state != COMPLETED_SUCCESSFULLY) {
-		log_printf(&logger, ERR, "FAIL! recording_state=%d\n", internal_recording->recording->recording_state);
+	if (!internal_recording->done) {
+		/* Stopping a running recording is the same as the data callback returning false */
+		log_printf(&logger, DEBUG, "Recording stopped\n");
+		recording->recording_state = COMPLETED_SUCCESSFULLY;
+		internal_recording->done = true;
+	}
+
+	if (gettimeofday(&end, NULL)) {
+		log_printf(&logger, ERR, "Failed to get the end time\n");
+		end = internal_recording->started;
+	}
+
+	/* The callbacks don't resubmit anything once done is set, wait for the transfers in flight */
+	handle->active_recording = NULL;
+	if (cancel_transfers(internal_recording)) {
+		/*
+		 * Their callbacks can still run and only look at the internal
+		 * recording while done is set, so leak it with the transfers.
+		 */
+		log_printf(&logger, ERR, "Leaking the transfers still owned by libusb\n");
+		return -1;
+	}
+	free_transfers(internal_recording, internal_recording->n_transfer_buffers);
+
+	if (recording->recording_state != COMPLETED_SUCCESSFULLY) {
+		log_printf(&logger, ERR, "FAIL! recording_state=%d\n", recording->recording_state);
 		retval = 1;
 	} else {
 		log_printf(&logger, DEBUG, "SUCCESS!\n");
 	}
 
-	log_printf(&logger, DEBUG, "Total number of samples read: %i\n", internal_recording->sample_count);
+	log_printf(&logger, DEBUG, "Total number of samples read: %llu\n",
+		   (unsigned long long)internal_recording->sample_count);
 	log_printf(&logger, DEBUG, "Total number of transfers: %i\n", internal_recording->transfer_counter);
+	log_printf(&logger, DEBUG, "Total number of recoveries: %u\n", internal_recording->recoveries);
 
-	int sec = end.tv_sec - start.tv_sec;
-	int usec = (end.tv_usec - start.tv_usec) / 1000;
+	int sec = end.tv_sec - internal_recording->started.tv_sec;
+	int usec = (end.tv_usec - internal_recording->started.tv_usec) / 1000;
 	if (usec < 0) {
 		sec--;
 		usec = 1 - usec;
@@ -433,3 +1050,534 @@ int slogic_execute_recording(struct slogic_handle *handle, struct slogic_recordi
 	free_internal_recording(internal_recording);
 	return retval;
 }
+
+int slogic_execute_recording(struct slogic_handle *handle, struct slogic_recording *recording)
+{
+	struct slogic_rt_state *rt_state = slogic_rt_enter(handle);
+	struct timeval timeout;
+	uint64_t usec;
+	int retval;
+
+	if (slogic_start_recording(handle, recording)) {
+		slogic_rt_leave(rt_state);
+		return 1;
+	}
+
+	do {
+		/* Wake up for the next step of a recovery as well */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (recovery_pending(handle->active_recording, &usec) && usec < 1000000) {
+			timeout.tv_sec = 0;
+			timeout.tv_usec = usec;
+		}
+	} while (handle_recording_events(handle, &timeout) > 0);
+
+	retval = slogic_stop_recording(handle);
+	slogic_rt_leave(rt_state);
+	return retval;
+}
+
+/*
+ * Playback
+ */
+
+struct slogic_internal_playback {
+	struct slogic_playback *playback;
+	struct slogic_handle *shandle;
+
+	struct libusb_transfer **transfers;
+	unsigned int n_transfers;
+	/* Number of transfers owned by libusb, including the start command */
+	unsigned int in_flight;
+	unsigned int transfer_counter;
+	/* Submitted before the start command completed */
+	uint64_t bytes_queued;
+	/* When the device will have played everything submitted, once running */
+	uint64_t runs_dry_usec;
+
+	struct libusb_transfer *start_transfer;
+	unsigned char start_command[2];
+
+	bool end_of_pattern;
+	bool done;
+};
+
+static void fail_playback(struct slogic_internal_playback *internal_playback, enum libusb_transfer_status status)
+{
+	log_printf(&logger, ERR, "Playback transfer failed: %s\n", usbutil_transfer_status_to_string(status));
+	internal_playback->playback->playback_state = transfer_status_to_recording_state(status);
+	internal_playback->done = true;
+}
+
+/* Fills the transfer with the next part of the pattern and submits it. Returns false at the end of the pattern */
+static bool submit_playback_transfer(struct slogic_internal_playback *internal_playback,
+				     struct libusb_transfer *transfer)
+{
+	struct slogic_playback *playback = internal_playback->playback;
+	uint64_t now;
+	size_t n;
+	int ret;
+
+	n = playback->on_fill_callback(transfer->buffer, internal_playback->shandle->transfer_buffer_size,
+				       playback->user_data);
+	if (n == 0) {
+		internal_playback->end_of_pattern = true;
+		return false;
+	}
+
+	transfer->length = n;
+	ret = libusb_submit_transfer(transfer);
+	if (ret) {
+		log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
+		playback->playback_state = UNKNOWN;
+		internal_playback->done = true;
+		return false;
+	}
+	internal_playback->in_flight++;
+
+	if (playback->playback_state != RUNNING) {
+		internal_playback->bytes_queued += n;
+		return true;
+	}
+	/*
+	 * The device plays at the sample rate whatever the transfers complete,
+	 * so it ran out if this refill comes after everything submitted so far
+	 * should have been played.
+	 */
+	now = slogic_rt_now_usec();
+	if (now > internal_playback->runs_dry_usec) {
+		playback->underruns++;
+		log_trace(&logger, DEBUG, "Playback underrun after %llu bytes, %lluus late\n",
+			  (unsigned long long)playback->bytes_sent,
+			  (unsigned long long)(now - internal_playback->runs_dry_usec));
+		internal_playback->runs_dry_usec = now;
+	}
+	internal_playback->runs_dry_usec += n * 1000000ULL / playback->sample_rate->samples_per_second;
+	return true;
+}
+
+static void slogic_playback_start_callback(struct libusb_transfer *transfer)
+{
+	struct slogic_internal_playback *internal_playback = transfer->user_data;
+
+	internal_playback->in_flight--;
+	if (internal_playback->done) {
+		return;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fail_playback(internal_playback, transfer->status);
+		return;
+	}
+	log_printf(&logger, DEBUG, "Playback started\n");
+	internal_playback->playback->playback_state = RUNNING;
+	internal_playback->runs_dry_usec = slogic_rt_now_usec() + internal_playback->bytes_queued * 1000000ULL
+	    / internal_playback->playback->sample_rate->samples_per_second;
+}
+
+static void slogic_playback_callback(struct libusb_transfer *transfer)
+{
+	struct slogic_internal_playback *internal_playback = transfer->user_data;
+	struct slogic_playback *playback = internal_playback->playback;
+	struct slogic_handle *handle = internal_playback->shandle;
+	enum libusb_transfer_status status = transfer->status;
+
+	internal_playback->in_flight--;
+	if (internal_playback->done) {
+		return;
+	}
+
+	internal_playback->transfer_counter++;
+	if (handle->fault_injector) {
+		status = handle->fault_injector(internal_playback->transfer_counter, status,
+						handle->fault_injector_data);
+	}
+
+	if (status != LIBUSB_TRANSFER_COMPLETED) {
+		fail_playback(internal_playback, status);
+		return;
+	}
+
+	playback->bytes_sent += transfer->actual_length;
+
+	if (internal_playback->end_of_pattern) {
+		if (!internal_playback->in_flight) {
+			playback->playback_state = COMPLETED_SUCCESSFULLY;
+			internal_playback->done = true;
+		}
+		return;
+	}
+
+	if (!submit_playback_transfer(internal_playback, transfer) && !internal_playback->in_flight
+	    && !internal_playback->done) {
+		playback->playback_state = COMPLETED_SUCCESSFULLY;
+		internal_playback->done = true;
+	}
+}
+
+int slogic_execute_playback(struct slogic_handle *handle, struct slogic_playback *playback)
+{
+	struct slogic_internal_playback *internal_playback;
+	struct slogic_rt_state *rt_state;
+	struct timeval timeout = { 0, 100000 };
+	unsigned int counter;
+	int round;
+	int ret;
+
+	if (!handle->experimental_commands) {
+		log_printf(&logger, ERR, "Playback needs experimental_commands, start playback is not traced\n");
+		return -1;
+	}
+
+	internal_playback = malloc(sizeof(struct slogic_internal_playback));
+	assert(internal_playback);
+	internal_playback->playback = playback;
+	internal_playback->shandle = handle;
+	internal_playback->n_transfers = handle->n_transfer_buffers;
+	internal_playback->in_flight = 0;
+	internal_playback->transfer_counter = 0;
+	internal_playback->bytes_queued = 0;
+	internal_playback->runs_dry_usec = 0;
+	internal_playback->end_of_pattern = false;
+	internal_playback->done = false;
+
+	playback->playback_state = WARMING_UP;
+	playback->underruns = 0;
+	playback->bytes_sent = 0;
+
+	internal_playback->transfers = malloc(sizeof(struct libusb_transfer *) * internal_playback->n_transfers);
+	assert(internal_playback->transfers);
+	for (counter = 0; counter < internal_playback->n_transfers; counter++) {
+		unsigned char *buffer = malloc(handle->transfer_buffer_size);
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		assert(buffer && transfer);
+		libusb_fill_bulk_transfer(transfer, handle->device_handle, STREAMING_DATA_OUT_ENDPOINT, buffer, 0,
+					  slogic_playback_callback, internal_playback, handle->transfer_timeout);
+		internal_playback->transfers[counter] = transfer;
+	}
+	internal_playback->start_transfer = libusb_alloc_transfer(0);
+	assert(internal_playback->start_transfer);
+
+	rt_state = slogic_rt_enter(handle);
+
+	/* Queue the pattern before starting so the device has data right away */
+	for (counter = 0; counter < internal_playback->n_transfers && !internal_playback->done; counter++) {
+		if (!submit_playback_transfer(internal_playback, internal_playback->transfers[counter])) {
+			break;
+		}
+	}
+
+	if (!internal_playback->in_flight && !internal_playback->done) {
+		log_printf(&logger, WARNING, "Empty pattern\n");
+		playback->playback_state = COMPLETED_SUCCESSFULLY;
+		internal_playback->done = true;
+	}
+
+	if (!internal_playback->done) {
+		internal_playback->start_command[0] = COMMAND_START_PLAYBACK;
+		internal_playback->start_command[1] = playback->sample_rate->sample_delay;
+		libusb_fill_bulk_transfer(internal_playback->start_transfer, handle->device_handle,
+					  COMMAND_OUT_ENDPOINT, internal_playback->start_command, 2,
+					  slogic_playback_start_callback, internal_playback, START_COMMAND_TIMEOUT);
+		ret = libusb_submit_transfer(internal_playback->start_transfer);
+		if (ret) {
+			log_printf(&logger, ERR, "libusb_submit_transfer (start): %s\n", usbutil_error_to_string(ret));
+			playback->playback_state = UNKNOWN;
+			internal_playback->done = true;
+		} else {
+			internal_playback->in_flight++;
+		}
+	}
+
+	while (!internal_playback->done) {
+		ret = libusb_handle_events_timeout(handle->context, &timeout);
+		if (ret) {
+			log_printf(&logger, ERR, "libusb_handle_events: %s\n", usbutil_error_to_string(ret));
+			playback->playback_state = UNKNOWN;
+			break;
+		}
+	}
+
+	/* Cancel and wait for whatever is left before freeing the transfers */
+	internal_playback->done = true;
+	if (internal_playback->in_flight) {
+		libusb_cancel_transfer(internal_playback->start_transfer);
+		for (counter = 0; counter < internal_playback->n_transfers; counter++) {
+			libusb_cancel_transfer(internal_playback->transfers[counter]);
+		}
+		for (round = 0; round < CANCEL_ROUNDS && internal_playback->in_flight; round++) {
+			if (libusb_handle_events_timeout(handle->context, &timeout)) {
+				break;
+			}
+		}
+	}
+	slogic_rt_leave(rt_state);
+
+	log_printf(&logger, DEBUG, "Playback: %llu bytes sent, %llu underruns\n",
+		   (unsigned long long)playback->bytes_sent, (unsigned long long)playback->underruns);
+
+	if (internal_playback->in_flight) {
+		/* As in slogic_stop_recording, the callbacks only look at the internal playback once done is set */
+		log_printf(&logger, ERR, "Gave up waiting for cancelled transfers, leaking the ones owned by libusb\n");
+		return 1;
+	}
+	for (counter = 0; counter < internal_playback->n_transfers; counter++) {
+		free(internal_playback->transfers[counter]->buffer);
+		libusb_free_transfer(internal_playback->transfers[counter]);
+	}
+	libusb_free_transfer(internal_playback->start_transfer);
+	free(internal_playback->transfers);
+	free(internal_playback);
+
+	return playback->playback_state == COMPLETED_SUCCESSFULLY ? 0 : 1;
+}
+
+/*
+ * Polled mode
+ *
+ * Every slot is a read byte command on EP1 OUT paired with a one byte read on
+ * EP1 IN. The device answers the commands in order and libusb completes the
+ * IN transfers in the order they were submitted, so the n-th completed IN
+ * transfer carries the response to the n-th command whichever slot it
+ * belongs to. A slot is resubmitted as soon as its response is delivered.
+ */
+
+struct slogic_poll_slot {
+	struct slogic_internal_poll *internal_poll;
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	unsigned char command;
+	unsigned char response;
+};
+
+struct slogic_internal_poll {
+	struct slogic_poll *poll;
+	struct slogic_handle *shandle;
+
+	struct slogic_poll_slot *slots;
+	/* Number of transfers owned by libusb */
+	unsigned int in_flight;
+	unsigned int transfer_counter;
+
+	struct libusb_transfer *write_transfer;
+	unsigned char write_command[2];
+	bool write_in_flight;
+	unsigned char pending_writes[POLL_MAX_PENDING_WRITES];
+	unsigned int pending_head;
+	unsigned int n_pending;
+
+	bool done;
+};
+
+static void fail_poll(struct slogic_internal_poll *internal_poll, enum libusb_transfer_status status)
+{
+	log_printf(&logger, ERR, "Poll transfer failed: %s\n", usbutil_transfer_status_to_string(status));
+	internal_poll->poll->poll_state = transfer_status_to_recording_state(status);
+	internal_poll->done = true;
+}
+
+static bool submit_poll_transfer(struct slogic_internal_poll *internal_poll, struct libusb_transfer *transfer)
+{
+	int ret = libusb_submit_transfer(transfer);
+	if (ret) {
+		log_printf(&logger, ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
+		internal_poll->poll->poll_state = UNKNOWN;
+		internal_poll->done = true;
+		return false;
+	}
+	internal_poll->in_flight++;
+	return true;
+}
+
+static bool submit_poll_slot(struct slogic_poll_slot *slot)
+{
+	return submit_poll_transfer(slot->internal_poll, slot->out)
+	    && submit_poll_transfer(slot->internal_poll, slot->in);
+}
+
+static void submit_next_write(struct slogic_internal_poll *internal_poll)
+{
+	if (internal_poll->write_in_flight || !internal_poll->n_pending || internal_poll->done) {
+		return;
+	}
+	internal_poll->write_command[1] = internal_poll->pending_writes[internal_poll->pending_head];
+	internal_poll->pending_head = (internal_poll->pending_head + 1) % POLL_MAX_PENDING_WRITES;
+	internal_poll->n_pending--;
+	internal_poll->write_in_flight = submit_poll_transfer(internal_poll, internal_poll->write_transfer);
+}
+
+static void slogic_poll_out_callback(struct libusb_transfer *transfer)
+{
+	struct slogic_poll_slot *slot = transfer->user_data;
+	struct slogic_internal_poll *internal_poll = slot->internal_poll;
+
+	internal_poll->in_flight--;
+	if (!internal_poll->done && transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fail_poll(internal_poll, transfer->status);
+	}
+}
+
+static void slogic_poll_in_callback(struct libusb_transfer *transfer)
+{
+	struct slogic_poll_slot *slot = transfer->user_data;
+	struct slogic_internal_poll *internal_poll = slot->internal_poll;
+	struct slogic_poll *poll = internal_poll->poll;
+	struct slogic_handle *handle = internal_poll->shandle;
+	enum libusb_transfer_status status = transfer->status;
+	struct slogic_poll_sample sample;
+
+	internal_poll->in_flight--;
+	if (internal_poll->done) {
+		return;
+	}
+
+	internal_poll->transfer_counter++;
+	if (handle->fault_injector) {
+		status = handle->fault_injector(internal_poll->transfer_counter, status, handle->fault_injector_data);
+	}
+	if (status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != 1) {
+		fail_poll(internal_poll, status);
+		return;
+	}
+
+	gettimeofday(&sample.timestamp, NULL);
+	sample.seq = poll->n_samples++;
+	sample.value = slot->response;
+	if (!poll->on_poll_callback(&sample, poll->user_data)) {
+		poll->poll_state = COMPLETED_SUCCESSFULLY;
+		internal_poll->done = true;
+		return;
+	}
+
+	/*
+	 * A write queued by the callback goes out before this slot's next read
+	 * command, but behind the read commands the other slots have in flight.
+	 */
+	submit_next_write(internal_poll);
+	submit_poll_slot(slot);
+}
+
+static void slogic_poll_write_callback(struct libusb_transfer *transfer)
+{
+	struct slogic_internal_poll *internal_poll = transfer->user_data;
+
+	internal_poll->in_flight--;
+	internal_poll->write_in_flight = false;
+	if (internal_poll->done) {
+		return;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fail_poll(internal_poll, transfer->status);
+		return;
+	}
+	submit_next_write(internal_poll);
+}
+
+int slogic_poll_writebyte(struct slogic_poll *poll, unsigned char value)
+{
+	struct slogic_internal_poll *internal_poll = poll->internal;
+
+	if (!internal_poll || !internal_poll->shandle->experimental_commands
+	    || internal_poll->n_pending == POLL_MAX_PENDING_WRITES) {
+		return -1;
+	}
+	internal_poll->pending_writes[(internal_poll->pending_head + internal_poll->n_pending)
+				      % POLL_MAX_PENDING_WRITES] = value;
+	internal_poll->n_pending++;
+	return 0;
+}
+
+int slogic_execute_poll(struct slogic_handle *handle, struct slogic_poll *poll)
+{
+	struct slogic_internal_poll *internal_poll;
+	struct slogic_rt_state *rt_state;
+	struct timeval timeout = { 0, 100000 };
+	struct timeval start, end;
+	unsigned int counter;
+	double seconds;
+	int round;
+	int ret;
+
+	assert(poll->depth > 0);
+
+	internal_poll = calloc(1, sizeof(struct slogic_internal_poll));
+	assert(internal_poll);
+	internal_poll->poll = poll;
+	internal_poll->shandle = handle;
+	poll->internal = internal_poll;
+	poll->poll_state = RUNNING;
+	poll->n_samples = 0;
+
+	internal_poll->slots = malloc(sizeof(struct slogic_poll_slot) * poll->depth);
+	assert(internal_poll->slots);
+	for (counter = 0; counter < poll->depth; counter++) {
+		struct slogic_poll_slot *slot = &internal_poll->slots[counter];
+		slot->internal_poll = internal_poll;
+		slot->command = COMMAND_READ_BYTE;
+		slot->out = libusb_alloc_transfer(0);
+		slot->in = libusb_alloc_transfer(0);
+		assert(slot->out && slot->in);
+		libusb_fill_bulk_transfer(slot->out, handle->device_handle, COMMAND_OUT_ENDPOINT, &slot->command, 1,
+					  slogic_poll_out_callback, slot, POLL_TIMEOUT);
+		libusb_fill_bulk_transfer(slot->in, handle->device_handle, COMMAND_IN_ENDPOINT, &slot->response, 1,
+					  slogic_poll_in_callback, slot, POLL_TIMEOUT);
+	}
+	internal_poll->write_command[0] = COMMAND_WRITE_BYTE;
+	internal_poll->write_transfer = libusb_alloc_transfer(0);
+	assert(internal_poll->write_transfer);
+	libusb_fill_bulk_transfer(internal_poll->write_transfer, handle->device_handle, COMMAND_OUT_ENDPOINT,
+				  internal_poll->write_command, 2, slogic_poll_write_callback, internal_poll,
+				  POLL_TIMEOUT);
+
+	rt_state = slogic_rt_enter(handle);
+	gettimeofday(&start, NULL);
+	for (counter = 0; counter < poll->depth && !internal_poll->done; counter++) {
+		submit_poll_slot(&internal_poll->slots[counter]);
+	}
+
+	while (!internal_poll->done) {
+		ret = libusb_handle_events_timeout(handle->context, &timeout);
+		if (ret) {
+			log_printf(&logger, ERR, "libusb_handle_events: %s\n", usbutil_error_to_string(ret));
+			poll->poll_state = UNKNOWN;
+			break;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	/* Cancel and wait for whatever is left before freeing the transfers */
+	internal_poll->done = true;
+	if (internal_poll->in_flight) {
+		libusb_cancel_transfer(internal_poll->write_transfer);
+		for (counter = 0; counter < poll->depth; counter++) {
+			libusb_cancel_transfer(internal_poll->slots[counter].out);
+			libusb_cancel_transfer(internal_poll->slots[counter].in);
+		}
+		for (round = 0; round < CANCEL_ROUNDS && internal_poll->in_flight; round++) {
+			if (libusb_handle_events_timeout(handle->context, &timeout)) {
+				break;
+			}
+		}
+	}
+	slogic_rt_leave(rt_state);
+	poll->internal = NULL;
+
+	if (internal_poll->in_flight) {
+		/* As in slogic_stop_recording, the callbacks only look at the internal poll once done is set */
+		log_printf(&logger, ERR, "Gave up waiting for cancelled transfers, leaking the ones owned by libusb\n");
+		return 1;
+	}
+	for (counter = 0; counter < poll->depth; counter++) {
+		libusb_free_transfer(internal_poll->slots[counter].out);
+		libusb_free_transfer(internal_poll->slots[counter].in);
+	}
+	libusb_free_transfer(internal_poll->write_transfer);
+	free(internal_poll->slots);
+	free(internal_poll);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	log_printf(&logger, DEBUG, "Polled %llu bytes in %.3fs, %.0f reads/s\n",
+		   (unsigned long long)poll->n_samples, seconds, seconds > 0 ? poll->n_samples / seconds : 0.0);
+
+	return poll->poll_state == COMPLETED_SUCCESSFULLY ? 0 : 1;
+}
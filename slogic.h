@@ -3,8 +3,26 @@
 #define __SLOGIC_H__
 
 #include <libusb.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Version of the API in this header. The major version matches the soname of
+ * libslogic.so and changes whenever the API or ABI changes incompatibly.
+ */
+#define SLOGIC_API_VERSION_MAJOR 1
+#define SLOGIC_API_VERSION_MINOR 3
+
+/* Returns the API version of the library as (major << 16) | minor */
+unsigned int slogic_api_version();
 
 struct slogic_sample_rate {
 	const uint8_t sample_delay;	/* sample rates are translated into sampling delays */
@@ -19,6 +37,7 @@ enum slogic_recording_state {
 	DEVICE_GONE = 2,
 	TIMEOUT = 3,
 	OVERFLOW = 4,
+	RECOVERING = 5,
 	UNKNOWN = 100,
 };
 
@@ -27,6 +46,31 @@ enum slogic_recording_state {
 struct slogic_sample_rate *slogic_get_sample_rates();
 struct slogic_sample_rate *slogic_parse_sample_rate(const char *str);
 
+/*
+ * Called for every completed transfer before slogic looks at its status. The
+ * returned status replaces the real one, which makes it possible to simulate
+ * a misbehaving device (timeouts, disconnects) without touching the hardware.
+ */
+typedef enum libusb_transfer_status (*slogic_fault_injector) (unsigned int transfer_counter,
+							       enum libusb_transfer_status status,
+							       void *user_data);
+
+/*
+ * Histogram of how late the event loop handled incoming transfers compared
+ * to when the device should have filled them at the sample rate. Bucket 0
+ * counts the transfers handled on time, bucket n those that were late by
+ * [2^(n-1), 2^n) microseconds and the last one everything above that.
+ */
+#define SLOGIC_JITTER_BUCKETS 24
+
+struct slogic_jitter {
+	uint64_t buckets[SLOGIC_JITTER_BUCKETS];
+	uint64_t n;
+	uint64_t max_usec;
+};
+
+struct slogic_internal_recording;
+
 /*
  * Contract between the main program and the utility library
  */
@@ -38,10 +82,39 @@ struct slogic_handle {
 	size_t transfer_buffer_size;
 	int n_transfer_buffers;
 	unsigned int transfer_timeout;
+	/*
+	 * Number of times a recording will try to recover from a stalled or
+	 * re-enumerated device before giving up. 0 disables recovery.
+	 */
+	unsigned int max_recoveries;
+	slogic_fault_injector fault_injector;
+	void *fault_injector_data;
+	/*
+	 * Scheduling of the thread running the event loop while a recording,
+	 * playback or poll executes. The previous settings are restored
+	 * afterwards. -1 and 0 leave the thread alone.
+	 */
+	int event_cpu;
+	int event_priority;
+	/*
+	 * Allows the EP1 commands that haven't been traced from the original
+	 * software yet and are guessed. Off by default, slogic_execute_playback,
+	 * slogic_writebyte and slogic_poll_writebyte fail without it.
+	 */
+	bool experimental_commands;
+	/* Filled by slogic_execute_recording if set */
+	struct slogic_jitter *jitter;
+	/* Private, the recording started with slogic_start_recording */
+	struct slogic_internal_recording *active_recording;
 };
 
 struct slogic_handle *slogic_init();
 int slogic_open(struct slogic_handle *handle);
+/*
+ * Closes the device and looks it up again, for when it re-enumerated, like
+ * after slogic_upload_firmware. Returns 0 on success.
+ */
+int slogic_reopen(struct slogic_handle *handle);
 
 void slogic_close(struct slogic_handle *handle);
 
@@ -49,15 +122,94 @@ bool slogic_is_firmware_uploaded(struct slogic_handle *handle);
 void slogic_upload_firmware(struct slogic_handle *handle);
 
 int slogic_readbyte(struct slogic_handle *handle, unsigned char *out);
+/* Needs experimental_commands, returns LIBUSB_ERROR_NOT_SUPPORTED otherwise */
+int slogic_writebyte(struct slogic_handle *handle, unsigned char value);
+
+/*
+ * Polled mode: keeps a number of read byte commands in flight and delivers
+ * every response with the time it arrived, so the poll rate is bound by the
+ * bus instead of by the round trip of slogic_readbyte().
+ */
+struct slogic_poll_sample {
+	/* Number of the response, starting at 0 */
+	uint64_t seq;
+	struct timeval timestamp;
+	unsigned char value;
+};
+
+/* Return false to stop polling */
+typedef bool(*slogic_on_poll_callback) (const struct slogic_poll_sample * sample, void *user_data);
+
+struct slogic_internal_poll;
+
+struct slogic_poll {
+	/* Number of read commands in flight */
+	unsigned int depth;
+	slogic_on_poll_callback on_poll_callback;
+	/* Updated by slogic when returning from the poll */
+	enum slogic_recording_state poll_state;
+	uint64_t n_samples;
+	void *user_data;
+	/* Private */
+	struct slogic_internal_poll *internal;
+};
+
+static inline void slogic_fill_poll(struct slogic_poll *poll, unsigned int depth,
+				    slogic_on_poll_callback on_poll_callback, void *user_data)
+{
+	poll->depth = depth;
+	poll->on_poll_callback = on_poll_callback;
+	poll->user_data = user_data;
+	poll->internal = NULL;
+}
+
+/* return 0 on success */
+int slogic_execute_poll(struct slogic_handle *handle, struct slogic_poll *poll);
+
+/*
+ * Queues a write byte command on a running poll, for use from the poll
+ * callback. Writes are sent in order, each behind the read commands already
+ * in flight: with a depth of n, the next n - 1 responses or more can still
+ * show the value from before the write. Returns -1 if the queue is full or
+ * experimental_commands is off.
+ */
+int slogic_poll_writebyte(struct slogic_poll *poll, unsigned char value);
 
 typedef bool(*slogic_on_data_callback) (uint8_t * data, size_t size, void *user_data);
 
+/*
+ * Describes a hole in the sample stream caused by a recovery. The samples
+ * delivered after the gap continue at sample_offset, the samples the device
+ * produced between start and end are lost.
+ */
+struct slogic_gap {
+	/* Number of samples delivered before the gap */
+	uint64_t sample_offset;
+	/* Time of the last delivered transfer before the device stalled */
+	struct timeval start;
+	/* Time the sampling was restarted */
+	struct timeval end;
+	/* (end - start) * samples per second */
+	uint64_t lost_samples;
+	/* What triggered the recovery: TIMEOUT, DEVICE_GONE or UNKNOWN */
+	enum slogic_recording_state reason;
+};
+
+typedef void (*slogic_on_gap_callback) (const struct slogic_gap * gap, void *user_data);
+
 struct slogic_recording {
 	struct slogic_sample_rate *sample_rate;
 	slogic_on_data_callback on_data_callback;
+	/* Optional, called after the recording has recovered from a device failure */
+	slogic_on_gap_callback on_gap_callback;
 	/* Updated by slogic when returning from the recording */
 	enum slogic_recording_state recording_state;
 	void *user_data;
+	/*
+	 * Fields added later go here, after the ones the struct started with.
+	 * Time from the start of the recording to the first delivered sample.
+	 */
+	unsigned int startup_usec;
 };
 
 /*
@@ -69,10 +221,107 @@ static inline void slogic_fill_recording(struct slogic_recording *recording,
 {
 	recording->sample_rate = sample_rate;
 	recording->on_data_callback = on_data_callback;
+	recording->on_gap_callback = NULL;
 	recording->user_data = user_data;
 }
 
 /* return 0 on success */
 int slogic_execute_recording(struct slogic_handle *handle, struct slogic_recording *recording);
 
+/*
+ * Non-blocking recording, for applications with an event loop of their own.
+ * slogic_execute_recording is the same as
+ *
+ *   slogic_start_recording(handle, recording);
+ *   while (slogic_handle_events_nonblocking(handle) > 0)
+ *           poll(<the descriptors from slogic_get_pollfds>, ...);
+ *   slogic_stop_recording(handle);
+ *
+ * The callbacks of the recording are run from slogic_handle_events_nonblocking.
+ * A recovery from a device failure blocks until the device is back.
+ */
+
+/* Queues the transfers and starts sampling. On failure there is nothing to stop. Returns 0 on success */
+int slogic_start_recording(struct slogic_handle *handle, struct slogic_recording *recording);
+
+/*
+ * Fills fds with the descriptors to wait on, at most max_fds of them.
+ * Returns the number of descriptors, which can be more than max_fds, or -1.
+ */
+int slogic_get_pollfds(struct slogic_handle *handle, struct pollfd *fds, int max_fds);
+
+/* Called when descriptors are added or removed, so that they don't have to be fetched all the time */
+typedef void (*slogic_pollfd_added_callback) (int fd, short events, void *user_data);
+typedef void (*slogic_pollfd_removed_callback) (int fd, void *user_data);
+
+void slogic_set_pollfd_notifiers(struct slogic_handle *handle, slogic_pollfd_added_callback added,
+				 slogic_pollfd_removed_callback removed, void *user_data);
+
+/*
+ * Returns 1 and the time until slogic_handle_events_nonblocking has to be
+ * called even if none of the descriptors are ready, 0 if there is no such
+ * deadline and a negative value on errors. While a recovery waits for the
+ * device this is the time until its next step.
+ */
+int slogic_get_next_timeout(struct slogic_handle *handle, struct timeval *timeout);
+
+/*
+ * Handles the events that are ready and returns without waiting. A recovery
+ * is advanced a step at a time, only resetting the device blocks. Returns 1
+ * while the recording runs, 0 once it is done and -1 on errors. Either way
+ * slogic_stop_recording has to be called.
+ */
+int slogic_handle_events_nonblocking(struct slogic_handle *handle);
+
+/*
+ * Ends the recording, stopping it first if it is still running, which is the
+ * same as the data callback returning false. Cancels the transfers and waits
+ * for the ones in flight before freeing them. Returns 0 if the recording
+ * completed successfully and -1 if the cancelled transfers did not come
+ * back, they are left to libusb then and not freed.
+ */
+int slogic_stop_recording(struct slogic_handle *handle);
+
+/*
+ * Fills buffer with the next part of the pattern to output, at most size
+ * bytes. Returns the number of bytes filled, 0 ends the playback.
+ */
+typedef size_t(*slogic_on_fill_callback) (uint8_t * buffer, size_t size, void *user_data);
+
+struct slogic_playback {
+	struct slogic_sample_rate *sample_rate;
+	slogic_on_fill_callback on_fill_callback;
+	/* Updated by slogic when returning from the playback */
+	enum slogic_recording_state playback_state;
+	/*
+	 * Number of refills submitted after the device should have played all
+	 * the earlier ones at the sample rate, so that it ran out of data
+	 */
+	uint64_t underruns;
+	uint64_t bytes_sent;
+	void *user_data;
+};
+
+static inline void slogic_fill_playback(struct slogic_playback *playback,
+					struct slogic_sample_rate *sample_rate,
+					slogic_on_fill_callback on_fill_callback, void *user_data)
+{
+	playback->sample_rate = sample_rate;
+	playback->on_fill_callback = on_fill_callback;
+	playback->user_data = user_data;
+}
+
+/*
+ * Outputs a pattern on the 8 channels at the given sample rate, keeping
+ * n_transfer_buffers transfers queued on the streaming out endpoint.
+ * Return 0 on success. Needs experimental_commands, the start playback
+ * command is a guess.
+ */
+int slogic_execute_playback(struct slogic_handle *handle, struct slogic_playback *playback);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
 #endif
@@ -0,0 +1,274 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __SLOGIC_HPP__
+#define __SLOGIC_HPP__
+
+/*
+ * Header-only C++ layer on top of the C API in slogic.h. Requires C++20 for
+ * std::span.
+ *
+ * A pipeline is a list of stages composed at compile time:
+ *
+ *   slogic::pipeline<slogic::trigger, slogic::limit, slogic::writer> p{
+ *           slogic::trigger{0x01}, slogic::limit{1000000}, slogic::writer{file}};
+ *   slogic::handle h;
+ *   h.open();
+ *   h.record(slogic_parse_sample_rate("24MHz"), p);
+ *
+ * A stage is any type with a "bool operator()(slogic::chunk &data)". It may
+ * narrow or replace the chunk that is passed on to the next stage and returns
+ * false to end the recording. The stages are called directly from a single
+ * trampoline per pipeline type so the compiler can inline all of them; the
+ * only indirect call per chunk is the one from libslogic into the trampoline.
+ */
+
+#include "slogic.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+namespace slogic {
+
+typedef std::span<const uint8_t> chunk;
+
+class error : public std::runtime_error {
+public:
+	explicit error(const char *what) : std::runtime_error(what) {
+	}
+};
+
+/*
+ * Thrown by handle::record() when slogic_execute_recording fails, with the
+ * state the recording ended in.
+ */
+class recording_error : public error {
+public:
+	explicit recording_error(enum slogic_recording_state state) : error("Recording failed"), state_(state) {
+	}
+
+	enum slogic_recording_state state() const {
+		return state_;
+	}
+
+private:
+	enum slogic_recording_state state_;
+};
+
+/*
+ * Owns a slogic_handle. Movable, not copyable.
+ */
+class handle {
+public:
+	handle() : handle_(slogic_init()) {
+		if (!handle_) {
+			throw error("slogic_init failed");
+		}
+	}
+
+	~handle() {
+		if (handle_) {
+			slogic_close(handle_);
+		}
+	}
+
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+
+	handle(handle &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {
+	}
+
+	handle &operator=(handle &&other) noexcept {
+		if (this != &other) {
+			if (handle_) {
+				slogic_close(handle_);
+			}
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	/*
+	 * Opens the device and uploads the firmware if required. The device
+	 * re-enumerates with the firmware, so it is looked up again after the
+	 * upload until it answers.
+	 */
+	void open() {
+		if (slogic_open(handle_) != 0) {
+			throw error("Failed to open the logic analyzer");
+		}
+		if (slogic_is_firmware_uploaded(handle_)) {
+			return;
+		}
+		slogic_upload_firmware(handle_);
+		for (int attempt = 0; attempt < reopen_attempts; attempt++) {
+			if (slogic_reopen(handle_) == 0 && slogic_is_firmware_uploaded(handle_)) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+		throw error("The logic analyzer did not come back after the firmware upload");
+	}
+
+	/*
+	 * Runs a recording through the pipeline. Throws a recording_error if
+	 * the recording did not complete successfully.
+	 */
+	template <typename Pipeline>
+	void record(struct slogic_sample_rate *sample_rate, Pipeline &pipeline) {
+		struct slogic_recording recording;
+		slogic_fill_recording(&recording, sample_rate, &trampoline<Pipeline>, &pipeline);
+		if (slogic_execute_recording(handle_, &recording) != 0) {
+			throw recording_error(recording.recording_state);
+		}
+	}
+
+	struct slogic_handle *get() const {
+		return handle_;
+	}
+
+private:
+	static constexpr int reopen_attempts = 5;
+
+	template <typename Pipeline>
+	static bool trampoline(uint8_t *data, size_t size, void *user_data) {
+		return (*static_cast<Pipeline *>(user_data))(chunk(data, size));
+	}
+
+	struct slogic_handle *handle_;
+};
+
+/*
+ * Runs the stages in order until one of them returns false.
+ */
+template <typename... Stages>
+class pipeline {
+public:
+	pipeline() = default;
+
+	explicit pipeline(Stages... stages) : stages_(std::move(stages)...) {
+	}
+
+	bool operator()(chunk data) {
+		return run<0>(data);
+	}
+
+	template <size_t I>
+	auto &stage() {
+		return std::get<I>(stages_);
+	}
+
+private:
+	template <size_t I>
+	bool run(chunk &data) {
+		if constexpr (I == sizeof...(Stages)) {
+			return true;
+		} else {
+			return std::get<I>(stages_)(data) && run<I + 1>(data);
+		}
+	}
+
+	std::tuple<Stages...> stages_;
+};
+
+/*
+ * Drops everything until one of the channels in the mask changes, the data
+ * from the first changed sample on is passed on.
+ */
+class trigger {
+public:
+	explicit trigger(uint8_t mask = 0xff) : mask_(mask) {
+	}
+
+	bool operator()(chunk &data) {
+		if (triggered_) {
+			return true;
+		}
+		for (size_t i = 0; i < data.size(); i++) {
+			uint8_t sample = data[i] & mask_;
+			if (have_last_ && sample != last_) {
+				triggered_ = true;
+				data = data.subspan(i);
+				return true;
+			}
+			last_ = sample;
+			have_last_ = true;
+		}
+		data = data.first(0);
+		return true;
+	}
+
+	bool triggered() const {
+		return triggered_;
+	}
+
+private:
+	uint8_t mask_;
+	uint8_t last_ = 0;
+	bool have_last_ = false;
+	bool triggered_ = false;
+};
+
+/*
+ * Passes on at most n_samples samples. The recording is ended with the first
+ * chunk after the limit has been reached.
+ */
+class limit {
+public:
+	explicit limit(uint64_t n_samples) : left_(n_samples) {
+	}
+
+	bool operator()(chunk &data) {
+		if (left_ == 0) {
+			return false;
+		}
+		if (data.size() >= left_) {
+			data = data.first(left_);
+			left_ = 0;
+		} else {
+			left_ -= data.size();
+		}
+		return true;
+	}
+
+	bool done() const {
+		return left_ == 0;
+	}
+
+private:
+	uint64_t left_;
+};
+
+/*
+ * Writes the data to a FILE. Ends the recording if the write fails.
+ */
+class writer {
+public:
+	explicit writer(FILE *file) : file_(file) {
+	}
+
+	bool operator()(chunk &data) {
+		if (!data.empty() && fwrite(data.data(), 1, data.size(), file_) != data.size()) {
+			return false;
+		}
+		written_ += data.size();
+		return true;
+	}
+
+	uint64_t written() const {
+		return written_;
+	}
+
+private:
+	FILE *file_;
+	uint64_t written_ = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,400 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "squelch.h"
+#include "log.h"
+
+#include <endian.h>
+#include <string.h>
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+/*
+ * Idle stretches are found by comparing whole vectors of samples against the
+ * level the signal idles at, with the same generic vectors as the glitch
+ * filter. A chunk without activity costs one XOR and OR per vector.
+ */
+typedef uint8_t vector __attribute__ ((vector_size(16)));
+#define VECTOR_SIZE sizeof(vector)
+#define VECTORS_PER_BLOCK 4
+#define BLOCK_SIZE (VECTORS_PER_BLOCK * VECTOR_SIZE)
+
+static inline vector load(const uint8_t *p)
+{
+	vector v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline bool any(vector v)
+{
+	uint64_t words[2];
+	memcpy(words, &v, sizeof(words));
+	return (words[0] | words[1]) != 0;
+}
+
+/* Index of the first sample that is not value, size if there is none */
+static size_t find_first_not(const uint8_t *data, size_t size, uint8_t value)
+{
+	size_t i = 0;
+	size_t k;
+
+	for (; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+		vector diff = { 0 };
+		for (k = 0; k < BLOCK_SIZE; k += VECTOR_SIZE) {
+			diff |= load(&data[i + k]) ^ value;
+		}
+		if (any(diff)) {
+			break;
+		}
+	}
+	for (; i < size; i++) {
+		if (data[i] != value) {
+			return i;
+		}
+	}
+	return size;
+}
+
+/* Index of the last sample that is not value, size if there is none */
+static size_t find_last_not(const uint8_t *data, size_t size, uint8_t value)
+{
+	size_t i = size;
+	size_t k;
+
+	for (; i >= BLOCK_SIZE; i -= BLOCK_SIZE) {
+		vector diff = { 0 };
+		for (k = VECTOR_SIZE; k <= BLOCK_SIZE; k += VECTOR_SIZE) {
+			diff |= load(&data[i - k]) ^ value;
+		}
+		if (any(diff)) {
+			break;
+		}
+	}
+	while (i > 0) {
+		i--;
+		if (data[i] != value) {
+			return i;
+		}
+	}
+	return size;
+}
+
+static void write_data(struct slogic_squelch *squelch, const void *data, size_t size)
+{
+	if (!squelch->error && fwrite(data, 1, size, squelch->file) != size) {
+		log_printf(&logger, ERR, "Failed to write the squelched capture\n");
+		squelch->error = true;
+	}
+}
+
+static void write_segment_header(struct slogic_squelch *squelch, uint64_t offset, uint64_t size)
+{
+	struct slogic_squelch_segment segment;
+
+	segment.offset = htole64(offset);
+	segment.size = htole64(size);
+	write_data(squelch, &segment, sizeof(segment));
+	squelch->kept_samples += size;
+	squelch->written = offset + size;
+}
+
+/* Writes the samples of [from, to) in the chunk that starts at position */
+static void write_samples(struct slogic_squelch *squelch, const uint8_t *data, uint64_t position, uint64_t from,
+			  uint64_t to)
+{
+	if (to <= from) {
+		return;
+	}
+	write_segment_header(squelch, from, to - from);
+	write_data(squelch, &data[from - position], to - from);
+}
+
+/* The start of a window that lies in an earlier chunk, where the signal was idle at value */
+static void write_constant(struct slogic_squelch *squelch, uint64_t from, uint64_t to, uint8_t value)
+{
+	uint8_t buffer[4096];
+	uint64_t n;
+
+	memset(buffer, value, sizeof(buffer));
+	write_segment_header(squelch, from, to - from);
+	for (; from < to; from += n) {
+		n = to - from < sizeof(buffer) ? to - from : sizeof(buffer);
+		write_data(squelch, buffer, n);
+	}
+}
+
+/*
+ * Writes the open window up to to. The end of a chunk flushes a window only
+ * up to post samples after its last transition, so when the window goes on
+ * in the next chunk the samples in between are still missing. Nothing
+ * changed in them, they have the level before.
+ */
+static void write_window(struct slogic_squelch *squelch, const uint8_t *data, uint64_t position, uint64_t to,
+			 uint8_t before)
+{
+	if (squelch->written < position && squelch->written < to) {
+		write_constant(squelch, squelch->written, to < position ? to : position, before);
+	}
+	write_samples(squelch, data, position, squelch->written, to);
+}
+
+int slogic_squelch_init(struct slogic_squelch *squelch, FILE *file, uint64_t pre, uint64_t post,
+			unsigned int samples_per_second)
+{
+	struct slogic_squelch_header header;
+
+	memset(squelch, 0, sizeof(*squelch));
+	squelch->file = file;
+	squelch->pre = pre;
+	squelch->post = post;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = htole32(SLOGIC_SQUELCH_MAGIC);
+	header.version = htole32(SLOGIC_SQUELCH_VERSION);
+	header.pre = htole64(pre);
+	header.post = htole64(post);
+	header.samples_per_second = htole32(samples_per_second);
+	write_data(squelch, &header, sizeof(header));
+	return squelch->error ? -1 : 0;
+}
+
+/*
+ * A window stays open as long as the next transition comes at most
+ * pre + post samples after the last one. Instead of visiting every
+ * transition of a burst, the scan jumps to the end of that range and looks
+ * backwards for the last transition in it, so a burst is crossed in steps of
+ * up to pre + post samples.
+ */
+int slogic_squelch_feed(struct slogic_squelch *squelch, const uint8_t *data, size_t size)
+{
+	uint64_t position = squelch->n_samples;
+	uint64_t end = position + size;
+	uint64_t reach, bound, from, start;
+	uint8_t before, level, previous;
+	size_t k;
+
+	if (!size) {
+		return squelch->error ? -1 : 0;
+	}
+	if (!squelch->started) {
+		/* The level before the first window */
+		squelch->last = data[0];
+		squelch->started = true;
+		write_samples(squelch, data, position, 0, 1);
+	}
+	before = squelch->last;
+
+	/* Where the scan continues, everything before it has been looked at */
+	from = position;
+	while (from < end) {
+		if (squelch->open) {
+			/* A transition up to reach still belongs to this window */
+			reach = squelch->last_transition + squelch->pre + squelch->post;
+			if (reach >= from) {
+				bound = reach < end ? reach : end - 1;
+				level = data[bound - position];
+				/* The last transition in [from, bound] */
+				k = find_last_not(&data[from - position], bound - from, level);
+				if (k < bound - from) {
+					squelch->last_transition = from + k + 1;
+					from = squelch->last_transition + 1;
+					continue;
+				}
+				previous = from == position ? before : data[from - position - 1];
+				if (previous != level) {
+					squelch->last_transition = from;
+					from++;
+					continue;
+				}
+				if (reach >= end) {
+					break;
+				}
+				from = reach + 1;
+			}
+			/* The window ends post samples after the sample of the last transition */
+			write_window(squelch, data, position, squelch->last_transition + squelch->post + 1, before);
+			squelch->open = false;
+		} else {
+			level = from == position ? before : data[from - position - 1];
+			k = find_first_not(&data[from - position], end - from, level);
+			if (from + k == end) {
+				break;
+			}
+			from += k;
+			start = from > squelch->pre ? from - squelch->pre : 0;
+			if (start < squelch->written) {
+				start = squelch->written;
+			}
+			if (start < position) {
+				write_constant(squelch, start, position, before);
+			} else {
+				squelch->written = start;
+			}
+			squelch->windows++;
+			squelch->open = true;
+			squelch->last_transition = from;
+			from++;
+		}
+	}
+
+	if (squelch->open) {
+		reach = squelch->last_transition + squelch->post + 1;
+		write_window(squelch, data, position, reach < end ? reach : end, before);
+	}
+	squelch->last = data[size - 1];
+	squelch->n_samples = end;
+	return squelch->error ? -1 : 0;
+}
+
+int slogic_squelch_finish(struct slogic_squelch *squelch)
+{
+	uint64_t kept = squelch->kept_samples;
+
+	/* The window has been written up to the last sample, only the end is missing */
+	write_segment_header(squelch, squelch->n_samples, 0);
+	squelch->kept_samples = kept;
+	if (!squelch->error && fflush(squelch->file)) {
+		log_printf(&logger, ERR, "Failed to write the squelched capture\n");
+		squelch->error = true;
+	}
+	log_printf(&logger, DEBUG, "Kept %llu of %llu samples in %llu windows\n",
+		   (unsigned long long)squelch->kept_samples, (unsigned long long)squelch->n_samples,
+		   (unsigned long long)squelch->windows);
+	return squelch->error ? -1 : 0;
+}
+
+int slogic_squelch_reader_open(struct slogic_squelch_reader *reader, FILE *file)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->file = file;
+
+	if (fread(&reader->header, sizeof(reader->header), 1, file) != 1) {
+		log_printf(&logger, ERR, "Failed to read the squelch header\n");
+		return -1;
+	}
+	reader->header.magic = le32toh(reader->header.magic);
+	reader->header.version = le32toh(reader->header.version);
+	reader->header.pre = le64toh(reader->header.pre);
+	reader->header.post = le64toh(reader->header.post);
+	reader->header.samples_per_second = le32toh(reader->header.samples_per_second);
+	if (reader->header.magic != SLOGIC_SQUELCH_MAGIC || reader->header.version != SLOGIC_SQUELCH_VERSION) {
+		log_printf(&logger, ERR, "Not a squelched capture\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Reads the next segment header unless there is one already. Returns 0 on success */
+static int next_segment(struct slogic_squelch_reader *reader)
+{
+	if (reader->have_segment) {
+		return 0;
+	}
+	if (fread(&reader->segment, sizeof(reader->segment), 1, reader->file) != 1) {
+		log_printf(&logger, ERR, "The squelched capture is truncated\n");
+		return -1;
+	}
+	reader->segment.offset = le64toh(reader->segment.offset);
+	reader->segment.size = le64toh(reader->segment.size);
+	if (reader->segment.offset < reader->position) {
+		log_printf(&logger, ERR, "Segment at %llu overlaps the previous one\n",
+			   (unsigned long long)reader->segment.offset);
+		return -1;
+	}
+	reader->have_segment = true;
+	return 0;
+}
+
+ssize_t slogic_squelch_read(struct slogic_squelch_reader *reader, uint8_t *buffer, size_t size)
+{
+	size_t n = 0;
+	size_t k;
+
+	while (n < size && !reader->end) {
+		if (reader->remaining) {
+			k = reader->remaining < size - n ? reader->remaining : size - n;
+			if (fread(&buffer[n], 1, k, reader->file) != k) {
+				log_printf(&logger, ERR, "The squelched capture is truncated\n");
+				return -1;
+			}
+			reader->level = buffer[n + k - 1];
+			reader->remaining -= k;
+			reader->position += k;
+			n += k;
+			continue;
+		}
+		if (next_segment(reader)) {
+			return -1;
+		}
+		if (reader->position < reader->segment.offset) {
+			/* Idle until the next segment */
+			k = reader->segment.offset - reader->position < size - n ?
+			    reader->segment.offset - reader->position : size - n;
+			memset(&buffer[n], reader->level, k);
+			reader->position += k;
+			n += k;
+			continue;
+		}
+		reader->have_segment = false;
+		if (!reader->segment.size) {
+			reader->end = true;
+			reader->n_samples = reader->segment.offset;
+		}
+		reader->remaining = reader->segment.size;
+	}
+	return n;
+}
+
+/* Skips size samples, reading them if the file is a pipe */
+static int skip(struct slogic_squelch_reader *reader, uint64_t size)
+{
+	uint8_t buffer[4096];
+	size_t n;
+
+	if (!fseeko(reader->file, size, SEEK_CUR)) {
+		return 0;
+	}
+	for (; size; size -= n) {
+		n = size < sizeof(buffer) ? size : sizeof(buffer);
+		if (fread(buffer, 1, n, reader->file) != n) {
+			log_printf(&logger, ERR, "The squelched capture is truncated\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int slogic_squelch_next_window(struct slogic_squelch_reader *reader, uint64_t *offset, uint64_t *size)
+{
+	bool found = false;
+
+	while (!reader->end) {
+		if (next_segment(reader)) {
+			return -1;
+		}
+		if (!reader->segment.size) {
+			reader->have_segment = false;
+			reader->end = true;
+			reader->n_samples = reader->segment.offset;
+			break;
+		}
+		if (found && reader->segment.offset != *offset + *size) {
+			/* Belongs to the next window */
+			return 1;
+		}
+		if (!found) {
+			*offset = reader->segment.offset;
+			*size = 0;
+			found = true;
+		}
+		*size += reader->segment.size;
+		reader->position = reader->segment.offset + reader->segment.size;
+		reader->have_segment = false;
+		if (skip(reader, reader->segment.size)) {
+			return -1;
+		}
+	}
+	return found ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __SQUELCH_H__
+#define __SQUELCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Squelched capture: only the windows around activity are kept, from pre
+ * samples before a transition to post samples after the last transition of
+ * a burst. Bursts closer than pre + post samples share a window.
+ *
+ * Nothing changes on any channel between two windows, so every sample that
+ * is left out has the level of the last sample before it and the reader
+ * reconstructs the full timeline exactly.
+ *
+ * The sparse file is a header followed by segments, each a segment header
+ * and size samples. A window can be split over several segments with
+ * contiguous offsets. A segment with size 0 ends the file, its offset is
+ * the total number of samples. All fields are little endian.
+ */
+#define SLOGIC_SQUELCH_MAGIC 0x51534c53	/* "SLSQ" */
+#define SLOGIC_SQUELCH_VERSION 1
+
+struct slogic_squelch_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t pre;
+	uint64_t post;
+	uint32_t samples_per_second;
+	uint32_t reserved;
+};
+
+struct slogic_squelch_segment {
+	/* Index of the first sample of the segment in the capture */
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct slogic_squelch {
+	/* Statistics */
+	uint64_t n_samples;
+	uint64_t kept_samples;
+	uint64_t windows;
+
+	/* Internal */
+	FILE *file;
+	uint64_t pre;
+	uint64_t post;
+	bool started;
+	bool error;
+	uint8_t last;
+	/* A window is open, last_transition is the last transition in it */
+	bool open;
+	uint64_t last_transition;
+	/* Everything before this has been written or skipped */
+	uint64_t written;
+};
+
+/* Writes the header to file. Returns 0 on success */
+int slogic_squelch_init(struct slogic_squelch *squelch, FILE * file, uint64_t pre, uint64_t post,
+			unsigned int samples_per_second);
+
+/* Writes the windows in the next chunk. Returns 0 on success, -1 once a write failed */
+int slogic_squelch_feed(struct slogic_squelch *squelch, const uint8_t * data, size_t size);
+
+/* Writes what is left of the last window and the end of the file. Returns 0 on success */
+int slogic_squelch_finish(struct slogic_squelch *squelch);
+
+struct slogic_squelch_reader {
+	struct slogic_squelch_header header;
+	/* Set once the end of the file has been read */
+	bool end;
+	uint64_t n_samples;
+
+	/* Internal */
+	FILE *file;
+	uint64_t position;
+	uint8_t level;
+	bool have_segment;
+	struct slogic_squelch_segment segment;
+	uint64_t remaining;
+};
+
+/* Reads the header. Returns 0 on success */
+int slogic_squelch_reader_open(struct slogic_squelch_reader *reader, FILE * file);
+
+/*
+ * Reads the next samples of the reconstructed capture into buffer. Returns
+ * the number of samples read, 0 at the end and -1 on a broken file.
+ */
+ssize_t slogic_squelch_read(struct slogic_squelch_reader *reader, uint8_t * buffer, size_t size);
+
+/*
+ * Returns the next window instead of the samples: 1 with a window, 0 at the
+ * end and -1 on a broken file. Don't mix with slogic_squelch_read.
+ */
+int slogic_squelch_next_window(struct slogic_squelch_reader *reader, uint64_t * offset, uint64_t * size);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -0,0 +1,86 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Expands a sparse capture written with main -Q back into the full capture,
+ * the idle stretches filled with the level the signal had. With -l only the
+ * windows are listed, one '<first sample> <number of samples>' line each.
+ */
+#include "squelch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE (1024 * 1024)
+
+int main(int argc, char **argv)
+{
+	struct slogic_squelch_reader reader;
+	bool list = false;
+	uint64_t offset, size;
+	uint8_t *buffer;
+	FILE *in, *out = stdout;
+	ssize_t n;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "l")) != -1) {
+		switch (c) {
+		case 'l':
+			list = true;
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 1 && argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-l] <sparse capture> [<output file>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	in = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+	if (!in) {
+		perror("opening sparse capture");
+		exit(EXIT_FAILURE);
+	}
+	if (slogic_squelch_reader_open(&reader, in)) {
+		exit(EXIT_FAILURE);
+	}
+	if (argc - optind == 2 && strcmp(argv[optind + 1], "-")) {
+		out = fopen(argv[optind + 1], "w");
+		if (!out) {
+			perror("opening output file");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (list) {
+		while ((ret = slogic_squelch_next_window(&reader, &offset, &size)) == 1) {
+			fprintf(out, "%llu %llu\n", (unsigned long long)offset, (unsigned long long)size);
+		}
+		if (ret) {
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "%llu samples\n", (unsigned long long)reader.n_samples);
+	} else {
+		buffer = malloc(BUFFER_SIZE);
+		if (!buffer) {
+			exit(EXIT_FAILURE);
+		}
+		while ((n = slogic_squelch_read(&reader, buffer, BUFFER_SIZE)) > 0) {
+			if (fwrite(buffer, 1, n, out) != (size_t)n) {
+				perror("writing samples");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (n < 0) {
+			exit(EXIT_FAILURE);
+		}
+		free(buffer);
+	}
+
+	if (out != stdout && fclose(out)) {
+		perror("writing samples");
+		exit(EXIT_FAILURE);
+	}
+	return EXIT_SUCCESS;
+}
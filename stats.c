@@ -0,0 +1,297 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "stats.h"
+
+#include <string.h>
+
+void slogic_stats_init(struct slogic_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+void slogic_stats_init_at(struct slogic_stats *stats, uint64_t offset, uint8_t previous)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->offset = offset;
+	stats->last = previous;
+	stats->started = true;
+}
+
+static void add_pulse(uint64_t width, uint64_t *count, uint64_t *min, uint64_t *max, uint64_t *sum)
+{
+	if (!*count || width < *min) {
+		*min = width;
+	}
+	if (width > *max) {
+		*max = width;
+	}
+	*sum += width;
+	(*count)++;
+}
+
+static void merge_pulses(uint64_t count, uint64_t min, uint64_t max, uint64_t sum,
+			 uint64_t *to_count, uint64_t *to_min, uint64_t *to_max, uint64_t *to_sum)
+{
+	if (!count) {
+		return;
+	}
+	if (!*to_count || min < *to_min) {
+		*to_min = min;
+	}
+	if (max > *to_max) {
+		*to_max = max;
+	}
+	*to_sum += sum;
+	*to_count += count;
+}
+
+void slogic_stats_merge(struct slogic_stats *stats, const struct slogic_stats *next)
+{
+	int channel;
+	int state;
+
+	for (state = 0; state < 256; state++) {
+		stats->histogram[state] += next->histogram[state];
+	}
+
+	for (channel = 0; channel < SLOGIC_N_CHANNELS; channel++) {
+		struct slogic_channel_stats *c = &stats->channels[channel];
+		const struct slogic_channel_stats *n = &next->channels[channel];
+
+		if (!n->edges) {
+			continue;
+		}
+
+		merge_pulses(n->high_pulses, n->min_high, n->max_high, n->sum_high,
+			     &c->high_pulses, &c->min_high, &c->max_high, &c->sum_high);
+		merge_pulses(n->low_pulses, n->min_low, n->max_low, n->sum_low,
+			     &c->low_pulses, &c->min_low, &c->max_low, &c->sum_low);
+
+		if (c->edges) {
+			/* The pulse between the last edge here and the first edge in next */
+			if (n->first_edge_rising) {
+				add_pulse(n->first_edge - c->last_edge, &c->low_pulses, &c->min_low, &c->max_low,
+					  &c->sum_low);
+			} else {
+				add_pulse(n->first_edge - c->last_edge, &c->high_pulses, &c->min_high, &c->max_high,
+					  &c->sum_high);
+			}
+		} else {
+			c->first_edge = n->first_edge;
+			c->first_edge_rising = n->first_edge_rising;
+		}
+
+		if (n->rising_edges) {
+			if (!c->rising_edges) {
+				c->first_rising = n->first_rising;
+			}
+			c->last_rising = n->last_rising;
+		}
+		c->edges += n->edges;
+		c->rising_edges += n->rising_edges;
+		c->last_edge = n->last_edge;
+	}
+
+	stats->n_samples += next->n_samples;
+	stats->last = next->last;
+	stats->started = stats->started || next->started;
+}
+
+static inline void stats_edge(struct slogic_stats *stats, int channel, uint64_t position, int level)
+{
+	struct slogic_channel_stats *c = &stats->channels[channel];
+
+	if (c->edges) {
+		uint64_t width = position - c->last_edge;
+		if (level) {
+			/* A rising edge ends a low pulse */
+			add_pulse(width, &c->low_pulses, &c->min_low, &c->max_low, &c->sum_low);
+		} else {
+			add_pulse(width, &c->high_pulses, &c->min_high, &c->max_high, &c->sum_high);
+		}
+	} else {
+		c->first_edge = position;
+		c->first_edge_rising = level;
+	}
+
+	if (level) {
+		if (!c->rising_edges) {
+			c->first_rising = position;
+		}
+		c->last_rising = position;
+		c->rising_edges++;
+	}
+	c->edges++;
+	c->last_edge = position;
+}
+
+/*
+ * Every bit set in changed is an edge on that channel, level is the sample
+ * after the edge.
+ */
+static inline void stats_edges(struct slogic_stats *stats, uint8_t changed, uint8_t level, uint64_t position)
+{
+	while (changed) {
+		int channel = __builtin_ctz(changed);
+		stats_edge(stats, channel, position, (level >> channel) & 1);
+		changed &= changed - 1;
+	}
+}
+
+void slogic_stats_feed(struct slogic_stats *stats, const uint8_t *data, size_t size)
+{
+	uint64_t position = stats->offset + stats->n_samples;
+	uint8_t prev;
+	size_t i = 0;
+
+	if (!size) {
+		return;
+	}
+	prev = stats->started ? stats->last : data[0];
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/*
+	 * Eight samples at a time. Shifting the word up by one sample and
+	 * inserting the previous sample lines every sample up with the one
+	 * before it, so the XOR has a bit set for every edge. Stretches where
+	 * nothing changes, which is most of a typical capture, only cost a
+	 * single histogram update per word.
+	 */
+	for (; i + 8 <= size; i += 8, position += 8) {
+		uint64_t word;
+		uint64_t changed;
+		int bit;
+
+		memcpy(&word, &data[i], sizeof(word));
+		changed = word ^ ((word << 8) | prev);
+		if (!changed) {
+			stats->histogram[prev] += 8;
+			continue;
+		}
+
+		for (bit = 0; bit < 64; bit += 8) {
+			stats->histogram[(word >> bit) & 0xff]++;
+		}
+		while (changed) {
+			bit = __builtin_ctzll(changed);
+			stats_edge(stats, bit & 7, position + (bit >> 3), (word >> bit) & 1);
+			changed &= changed - 1;
+		}
+		prev = word >> 56;
+	}
+#endif
+
+	for (; i < size; i++, position++) {
+		stats->histogram[data[i]]++;
+		stats_edges(stats, data[i] ^ prev, data[i], position);
+		prev = data[i];
+	}
+
+	stats->last = prev;
+	stats->started = true;
+	stats->n_samples = position - stats->offset;
+}
+
+void slogic_find_edges(const uint8_t *data, size_t size, uint64_t offset, uint8_t previous, uint8_t mask,
+		       slogic_on_edge_callback on_edge, void *user_data)
+{
+	uint8_t prev = previous;
+	uint8_t changed;
+	size_t i = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* Same as slogic_stats_feed, but skipping every word without a change on the masked channels */
+	uint64_t word_mask = 0x0101010101010101ULL * mask;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		uint64_t changed_word;
+		int bit;
+
+		memcpy(&word, &data[i], sizeof(word));
+		changed_word = (word ^ ((word << 8) | prev)) & word_mask;
+		prev = word >> 56;
+		while (changed_word) {
+			bit = __builtin_ctzll(changed_word) & ~7;
+			on_edge(offset + i + (bit >> 3), (changed_word >> bit) & 0xff, (word >> bit) & 0xff, user_data);
+			changed_word &= ~(0xffULL << bit);
+		}
+	}
+#endif
+
+	for (; i < size; i++) {
+		changed = (data[i] ^ prev) & mask;
+		if (changed) {
+			on_edge(offset + i, changed, data[i], user_data);
+		}
+		prev = data[i];
+	}
+}
+
+uint64_t slogic_stats_high_samples(const struct slogic_stats *stats, int channel)
+{
+	uint64_t high = 0;
+	int state;
+
+	for (state = 0; state < 256; state++) {
+		if (state & (1 << channel)) {
+			high += stats->histogram[state];
+		}
+	}
+	return high;
+}
+
+static double samples_to_ns(uint64_t samples, unsigned int samples_per_second)
+{
+	return samples * 1e9 / samples_per_second;
+}
+
+void slogic_stats_report(const struct slogic_stats *stats, unsigned int samples_per_second, FILE *file)
+{
+	int channel;
+	int state;
+
+	fprintf(file, "Samples: %llu (%.6fs)\n", (unsigned long long)stats->n_samples,
+		(double)stats->n_samples / samples_per_second);
+	fprintf(file, "\n");
+	fprintf(file, "Channel  Duty %%      Edges   Frequency Hz   High min/mean/max ns            "
+		"Low min/mean/max ns\n");
+
+	for (channel = 0; channel < SLOGIC_N_CHANNELS; channel++) {
+		const struct slogic_channel_stats *c = &stats->channels[channel];
+		double duty = stats->n_samples ?
+		    100.0 * slogic_stats_high_samples(stats, channel) / stats->n_samples : 0;
+		double frequency = 0;
+
+		if (c->rising_edges > 1) {
+			frequency = (c->rising_edges - 1) * (double)samples_per_second /
+			    (c->last_rising - c->first_rising);
+		}
+
+		fprintf(file, "%7d  %6.2f %10llu %14.3f", channel, duty, (unsigned long long)c->edges, frequency);
+		if (c->high_pulses) {
+			fprintf(file, "   %9.0f/%9.0f/%9.0f",
+				samples_to_ns(c->min_high, samples_per_second),
+				samples_to_ns(c->sum_high, samples_per_second) / c->high_pulses,
+				samples_to_ns(c->max_high, samples_per_second));
+		} else {
+			fprintf(file, "   %29s", "-");
+		}
+		if (c->low_pulses) {
+			fprintf(file, "   %9.0f/%9.0f/%9.0f",
+				samples_to_ns(c->min_low, samples_per_second),
+				samples_to_ns(c->sum_low, samples_per_second) / c->low_pulses,
+				samples_to_ns(c->max_low, samples_per_second));
+		} else {
+			fprintf(file, "   %29s", "-");
+		}
+		fprintf(file, "\n");
+	}
+
+	fprintf(file, "\n");
+	fprintf(file, "State histogram:\n");
+	for (state = 0; state < 256; state++) {
+		if (stats->histogram[state]) {
+			fprintf(file, "  0x%02x %12llu %6.2f%%\n", state, (unsigned long long)stats->histogram[state],
+				100.0 * stats->histogram[state] / stats->n_samples);
+		}
+	}
+}
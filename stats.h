@@ -0,0 +1,93 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+#define SLOGIC_N_CHANNELS 8
+
+/*
+ * Streaming signal statistics. The samples are fed chunk by chunk as they are
+ * delivered by slogic_execute_recording, nothing is stored except the
+ * counters below. Positions are sample indexes from the start of the stream.
+ */
+struct slogic_channel_stats {
+	uint64_t edges;
+	uint64_t rising_edges;
+
+	/* Complete pulses only, i.e. between two edges */
+	uint64_t high_pulses;
+	uint64_t min_high;
+	uint64_t max_high;
+	uint64_t sum_high;
+	uint64_t low_pulses;
+	uint64_t min_low;
+	uint64_t max_low;
+	uint64_t sum_low;
+
+	uint64_t first_rising;
+	uint64_t last_rising;
+	/* Position of the first and last edge, only valid if edges > 0 */
+	uint64_t first_edge;
+	bool first_edge_rising;
+	uint64_t last_edge;
+};
+
+struct slogic_stats {
+	/* Position of the first sample */
+	uint64_t offset;
+	uint64_t n_samples;
+	/* Number of samples for each of the 256 logic states */
+	uint64_t histogram[256];
+	struct slogic_channel_stats channels[SLOGIC_N_CHANNELS];
+	/* The last sample of the previous chunk */
+	uint8_t last;
+	bool started;
+};
+
+void slogic_stats_init(struct slogic_stats *stats);
+
+/*
+ * For statistics over a part of a stream: offset is the position of the first
+ * sample and previous the sample before it.
+ */
+void slogic_stats_init_at(struct slogic_stats *stats, uint64_t offset, uint8_t previous);
+
+/*
+ * Adds the statistics of the part of the stream that directly follows the
+ * part in stats, including the pulses that span the two.
+ */
+void slogic_stats_merge(struct slogic_stats *stats, const struct slogic_stats *next);
+
+void slogic_stats_feed(struct slogic_stats *stats, const uint8_t * data, size_t size);
+
+/*
+ * Calls on_edge for every sample where one of the channels in mask changes.
+ * Positions start at offset, previous is the sample before data.
+ */
+typedef void (*slogic_on_edge_callback) (uint64_t position, uint8_t changed, uint8_t level, void *user_data);
+
+void slogic_find_edges(const uint8_t * data, size_t size, uint64_t offset, uint8_t previous, uint8_t mask,
+		       slogic_on_edge_callback on_edge, void *user_data);
+
+/* Number of samples where the channel was high */
+uint64_t slogic_stats_high_samples(const struct slogic_stats *stats, int channel);
+
+/* Writes a human readable report */
+void slogic_stats_report(const struct slogic_stats *stats, unsigned int samples_per_second, FILE * file);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
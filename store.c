@@ -0,0 +1,1010 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "store.h"
+#include "log.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+/* Chunks between the recording and the pack, the queue holds N_SLOTS * SLOGIC_STORE_MAX_CHUNK bytes */
+#define N_SLOTS 256
+#define PACK_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * Gear hash masks as in FastCDC: a cut is harder to hit before the average
+ * size and easier after it, which keeps the sizes close to the average. The
+ * top bits of the hash depend on the last 64 bytes.
+ */
+#define MASK_SMALL 0xfffe000000000000ULL	/* 15 bits */
+#define MASK_LARGE 0xffe0000000000000ULL	/* 11 bits */
+#define GEAR_WINDOW 64
+#define IDLE_RUN SLOGIC_STORE_MIN_CHUNK
+
+struct store_slot {
+	uint8_t *data;
+	size_t size;
+	uint8_t hash[SLOGIC_STORE_HASH_SIZE];
+	bool hashed;
+};
+
+struct index_entry {
+	uint8_t hash[SLOGIC_STORE_HASH_SIZE];
+	uint64_t offset;
+	uint32_t size;
+};
+
+struct slogic_store {
+	char *directory;
+	int index_fd;
+	FILE *index;
+	FILE *pack;
+	uint64_t pack_size;
+	uint64_t gear[256];
+	/* The gear hash after GEAR_WINDOW equal samples */
+	uint64_t idle_hash[256];
+
+	/* Open addressing table of entry numbers + 1, 0 is empty */
+	struct index_entry *entries;
+	size_t n_entries;
+	size_t entries_size;
+	uint32_t *table;
+	size_t table_size;
+
+	/* The capture being written */
+	bool active;
+	char *name;
+	char *manifest_path;
+	FILE *manifest;
+	struct slogic_store_manifest_header header;
+	/* The last run of equal chunks, written once it ends */
+	struct slogic_store_manifest_record pending;
+	struct slogic_store_stats stats;
+	uint64_t rolling;
+	uint64_t run;
+	uint8_t previous;
+
+	/*
+	 * Slots are used in order. The one at filled is being cut by the
+	 * recording, the ones from next_hash to filled wait for a worker and
+	 * the ones from committed are written in order once hashed.
+	 */
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t progress;
+	struct store_slot slots[N_SLOTS];
+	uint64_t filled;
+	uint64_t next_hash;
+	uint64_t committed;
+	bool closing;
+	bool error;
+	pthread_t *workers;
+	unsigned int n_workers;
+	pthread_t writer;
+	bool writer_started;
+};
+
+/* SHA-256 as in FIPS 180-4 */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8
+		    | block[4 * i + 3];
+	}
+	for (; i < 64; i++) {
+		uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+static void sha256(const uint8_t *data, size_t size, uint8_t *hash)
+{
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	uint8_t last[128];
+	uint64_t bits = (uint64_t)size * 8;
+	size_t i, tail;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		sha256_block(state, &data[i]);
+	}
+	tail = size - i;
+	memset(last, 0, sizeof(last));
+	memcpy(last, &data[i], tail);
+	last[tail] = 0x80;
+	tail = tail < 56 ? 64 : 128;
+	for (i = 0; i < 8; i++) {
+		last[tail - 1 - i] = bits >> (8 * i);
+	}
+	sha256_block(state, last);
+	if (tail == 128) {
+		sha256_block(state, &last[64]);
+	}
+	for (i = 0; i < 8; i++) {
+		hash[4 * i] = state[i] >> 24;
+		hash[4 * i + 1] = state[i] >> 16;
+		hash[4 * i + 2] = state[i] >> 8;
+		hash[4 * i + 3] = state[i];
+	}
+}
+
+/* Fixed pseudo random table, the cut points and so the deduplication across runs depend on it */
+static void init_gear(uint64_t *gear, uint64_t *idle_hash)
+{
+	uint64_t x = 0x736c6f6769637374ULL;
+	uint64_t z;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		/* splitmix64 */
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+	for (i = 0; i < 256; i++) {
+		idle_hash[i] = 0;
+		for (j = 0; j < GEAR_WINDOW; j++) {
+			idle_hash[i] = (idle_hash[i] << 1) + gear[i];
+		}
+	}
+}
+
+static size_t table_position(const struct slogic_store *store, const uint8_t *hash)
+{
+	uint64_t key;
+
+	memcpy(&key, hash, sizeof(key));
+	return key & (store->table_size - 1);
+}
+
+static struct index_entry *lookup(const struct slogic_store *store, const uint8_t *hash)
+{
+	size_t i;
+
+	for (i = table_position(store, hash); store->table[i]; i = (i + 1) & (store->table_size - 1)) {
+		struct index_entry *entry = &store->entries[store->table[i] - 1];
+		if (!memcmp(entry->hash, hash, SLOGIC_STORE_HASH_SIZE)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void insert(struct slogic_store *store, size_t n)
+{
+	size_t i;
+
+	i = table_position(store, store->entries[n].hash);
+	while (store->table[i]) {
+		i = (i + 1) & (store->table_size - 1);
+	}
+	store->table[i] = n + 1;
+}
+
+/* Adds a chunk to the in memory index, keeping the table at most half full */
+static int add_entry(struct slogic_store *store, const uint8_t *hash, uint64_t offset, uint32_t size)
+{
+	struct index_entry *entries;
+	uint32_t *table;
+	size_t i;
+
+	if (store->n_entries == store->entries_size) {
+		entries = realloc(store->entries, 2 * store->entries_size * sizeof(*entries));
+		if (!entries) {
+			return -1;
+		}
+		store->entries = entries;
+		store->entries_size *= 2;
+	}
+	if (2 * (store->n_entries + 1) > store->table_size) {
+		table = calloc(2 * store->table_size, sizeof(*table));
+		if (!table) {
+			return -1;
+		}
+		free(store->table);
+		store->table = table;
+		store->table_size *= 2;
+		for (i = 0; i < store->n_entries; i++) {
+			insert(store, i);
+		}
+	}
+	memcpy(store->entries[store->n_entries].hash, hash, SLOGIC_STORE_HASH_SIZE);
+	store->entries[store->n_entries].offset = offset;
+	store->entries[store->n_entries].size = size;
+	insert(store, store->n_entries);
+	store->n_entries++;
+	return 0;
+}
+
+static char *path(const char *directory, const char *name)
+{
+	char *p = malloc(strlen(directory) + strlen(name) + 2);
+
+	if (p) {
+		sprintf(p, "%s/%s", directory, name);
+	}
+	return p;
+}
+
+/* "<directory>/captures/<prefix><name><suffix>" */
+static char *capture_path(const struct slogic_store *store, const char *prefix, const char *name, const char *suffix)
+{
+	size_t size = strlen(store->directory) + strlen(prefix) + strlen(name) + strlen(suffix) + sizeof("/captures/");
+	char *p = malloc(size);
+
+	if (p) {
+		sprintf(p, "%s/captures/%s%s%s", store->directory, prefix, name, suffix);
+	}
+	return p;
+}
+
+/* Makes the entries of a directory, such as a rename into it, durable */
+static int sync_directory(const char *name)
+{
+	int fd = open(name, O_RDONLY | O_DIRECTORY);
+	int ret;
+
+	if (fd < 0) {
+		return -1;
+	}
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+static int make_directory(const char *name)
+{
+	if (mkdir(name, 0777) && errno != EEXIST) {
+		log_printf(&logger, ERR, "Failed to create %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static FILE *open_file(const char *directory, const char *name, int *fd)
+{
+	char *p = path(directory, name);
+	FILE *file = NULL;
+
+	if (!p) {
+		return NULL;
+	}
+	*fd = open(p, O_RDWR | O_CREAT, 0666);
+	if (*fd < 0) {
+		log_printf(&logger, ERR, "Failed to open %s: %s\n", p, strerror(errno));
+	} else {
+		file = fdopen(*fd, "r+");
+		if (!file) {
+			close(*fd);
+		}
+	}
+	free(p);
+	return file;
+}
+
+/*
+ * Loads the index. Records after the first one that doesn't fit the pack
+ * are from a write that didn't finish and are cut off, together with what
+ * the pack has after the last good chunk.
+ */
+static int load_index(struct slogic_store *store)
+{
+	struct slogic_store_file_header header;
+	struct slogic_store_index_record record;
+	struct stat st;
+	uint64_t end = 0;
+	off_t good;
+
+	if (fstat(fileno(store->pack), &st)) {
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, store->index) != 1) {
+		header.magic = htole32(SLOGIC_STORE_INDEX_MAGIC);
+		header.version = htole32(SLOGIC_STORE_VERSION);
+		rewind(store->index);
+		if (fwrite(&header, sizeof(header), 1, store->index) != 1 || fflush(store->index)) {
+			return -1;
+		}
+	} else if (le32toh(header.magic) != SLOGIC_STORE_INDEX_MAGIC
+		   || le32toh(header.version) != SLOGIC_STORE_VERSION) {
+		log_printf(&logger, ERR, "%s is not a capture store\n", store->directory);
+		return -1;
+	}
+
+	good = sizeof(header);
+	while (fread(&record, sizeof(record), 1, store->index) == 1) {
+		record.offset = le64toh(record.offset);
+		record.size = le32toh(record.size);
+		if (record.offset != end || record.offset + record.size > (uint64_t)st.st_size) {
+			break;
+		}
+		if (add_entry(store, record.hash, record.offset, record.size)) {
+			return -1;
+		}
+		end += record.size;
+		good += sizeof(record);
+	}
+	if (ftruncate(fileno(store->index), good) || ftruncate(fileno(store->pack), end)) {
+		log_printf(&logger, ERR, "Failed to repair the index: %s\n", strerror(errno));
+		return -1;
+	}
+	if ((uint64_t)st.st_size != end) {
+		log_printf(&logger, WARNING, "Dropped %llu bytes of unfinished chunks\n",
+			   (unsigned long long)(st.st_size - end));
+	}
+	store->pack_size = end;
+	if (fseeko(store->index, good, SEEK_SET) || fseeko(store->pack, end, SEEK_SET)) {
+		return -1;
+	}
+	log_printf(&logger, DEBUG, "%zu chunks, %llu bytes\n", store->n_entries, (unsigned long long)end);
+	return 0;
+}
+
+/* Stores a chunk if it is new and adds it to the manifest. Only called by the writer thread */
+static int commit(struct slogic_store *store, struct store_slot *slot)
+{
+	struct slogic_store_index_record record;
+	struct slogic_store_manifest_record *run = &store->pending;
+
+	store->stats.chunks++;
+	if (!lookup(store, slot->hash)) {
+		memset(&record, 0, sizeof(record));
+		memcpy(record.hash, slot->hash, SLOGIC_STORE_HASH_SIZE);
+		record.offset = htole64(store->pack_size);
+		record.size = htole32(slot->size);
+		if (fwrite(slot->data, 1, slot->size, store->pack) != slot->size
+		    || fwrite(&record, sizeof(record), 1, store->index) != 1
+		    || add_entry(store, slot->hash, store->pack_size, slot->size)) {
+			log_printf(&logger, ERR, "Failed to add a chunk to the store\n");
+			return -1;
+		}
+		store->pack_size += slot->size;
+		store->stats.new_chunks++;
+		store->stats.new_bytes += slot->size;
+	}
+
+	if (run->count && !memcmp(run->hash, slot->hash, SLOGIC_STORE_HASH_SIZE) && run->count < UINT32_MAX) {
+		run->count++;
+		return 0;
+	}
+	if (run->count) {
+		run->size = htole32(run->size);
+		run->count = htole32(run->count);
+		if (fwrite(run, sizeof(*run), 1, store->manifest) != 1) {
+			log_printf(&logger, ERR, "Failed to write the manifest\n");
+			return -1;
+		}
+		store->stats.manifest_bytes += sizeof(*run);
+	}
+	memcpy(run->hash, slot->hash, SLOGIC_STORE_HASH_SIZE);
+	run->size = slot->size;
+	run->count = 1;
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct slogic_store *store = arg;
+	struct store_slot *slot;
+
+	pthread_mutex_lock(&store->mutex);
+	for (;;) {
+		while (store->next_hash == store->filled && !store->closing) {
+			pthread_cond_wait(&store->work, &store->mutex);
+		}
+		if (store->next_hash == store->filled) {
+			break;
+		}
+		slot = &store->slots[store->next_hash++ % N_SLOTS];
+		pthread_mutex_unlock(&store->mutex);
+
+		sha256(slot->data, slot->size, slot->hash);
+
+		pthread_mutex_lock(&store->mutex);
+		slot->hashed = true;
+		pthread_cond_broadcast(&store->progress);
+	}
+	pthread_mutex_unlock(&store->mutex);
+	return NULL;
+}
+
+/* Writes the hashed chunks in the order of the capture */
+static void *writer_main(void *arg)
+{
+	struct slogic_store *store = arg;
+	struct store_slot *slot;
+	int ret;
+
+	pthread_mutex_lock(&store->mutex);
+	for (;;) {
+		while (!(store->committed < store->filled && store->slots[store->committed % N_SLOTS].hashed)
+		       && !(store->closing && store->committed == store->filled)) {
+			pthread_cond_wait(&store->progress, &store->mutex);
+		}
+		if (store->committed == store->filled) {
+			break;
+		}
+		slot = &store->slots[store->committed % N_SLOTS];
+		pthread_mutex_unlock(&store->mutex);
+
+		ret = store->error ? -1 : commit(store, slot);
+
+		pthread_mutex_lock(&store->mutex);
+		if (ret) {
+			store->error = true;
+		}
+		slot->hashed = false;
+		store->committed++;
+		pthread_cond_broadcast(&store->progress);
+	}
+	pthread_mutex_unlock(&store->mutex);
+	return NULL;
+}
+
+static void stop_threads(struct slogic_store *store)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&store->mutex);
+	store->closing = true;
+	pthread_cond_broadcast(&store->work);
+	pthread_cond_broadcast(&store->progress);
+	pthread_mutex_unlock(&store->mutex);
+
+	for (i = 0; i < store->n_workers; i++) {
+		pthread_join(store->workers[i], NULL);
+	}
+	if (store->writer_started) {
+		pthread_join(store->writer, NULL);
+	}
+}
+
+static void free_store(struct slogic_store *store)
+{
+	int i;
+
+	for (i = 0; i < N_SLOTS; i++) {
+		free(store->slots[i].data);
+	}
+	if (store->pack) {
+		fclose(store->pack);
+	}
+	if (store->index) {
+		/* Also drops the lock */
+		fclose(store->index);
+	}
+	pthread_mutex_destroy(&store->mutex);
+	pthread_cond_destroy(&store->work);
+	pthread_cond_destroy(&store->progress);
+	free(store->workers);
+	free(store->entries);
+	free(store->table);
+	free(store->directory);
+	free(store);
+}
+
+struct slogic_store *slogic_store_open(const char *directory, unsigned int n_workers)
+{
+	struct slogic_store *store;
+	char *captures;
+	int pack_fd;
+	unsigned int i;
+
+	store = calloc(1, sizeof(struct slogic_store));
+	if (!store) {
+		return NULL;
+	}
+	pthread_mutex_init(&store->mutex, NULL);
+	pthread_cond_init(&store->work, NULL);
+	pthread_cond_init(&store->progress, NULL);
+	init_gear(store->gear, store->idle_hash);
+	store->directory = strdup(directory);
+	store->entries_size = 1024;
+	store->entries = malloc(store->entries_size * sizeof(*store->entries));
+	store->table_size = 2048;
+	store->table = calloc(store->table_size, sizeof(*store->table));
+	store->workers = calloc(n_workers ? n_workers : 1, sizeof(pthread_t));
+	if (!store->directory || !store->entries || !store->table || !store->workers) {
+		free_store(store);
+		return NULL;
+	}
+	for (i = 0; i < N_SLOTS; i++) {
+		store->slots[i].data = malloc(SLOGIC_STORE_MAX_CHUNK);
+		if (!store->slots[i].data) {
+			free_store(store);
+			return NULL;
+		}
+	}
+
+	captures = path(directory, "captures");
+	if (!captures || make_directory(directory) || make_directory(captures)) {
+		free(captures);
+		free_store(store);
+		return NULL;
+	}
+	free(captures);
+
+	store->index = open_file(directory, "index", &store->index_fd);
+	if (!store->index) {
+		free_store(store);
+		return NULL;
+	}
+	if (flock(store->index_fd, LOCK_EX | LOCK_NB)) {
+		log_printf(&logger, ERR, "%s is in use by another process\n", directory);
+		free_store(store);
+		return NULL;
+	}
+	store->pack = open_file(directory, "pack", &pack_fd);
+	if (!store->pack || setvbuf(store->pack, NULL, _IOFBF, PACK_BUFFER_SIZE) || load_index(store)) {
+		free_store(store);
+		return NULL;
+	}
+
+	for (i = 0; i < (n_workers ? n_workers : 1); i++) {
+		if (pthread_create(&store->workers[i], NULL, worker_main, store)) {
+			log_printf(&logger, ERR, "Failed to create worker thread\n");
+			stop_threads(store);
+			free_store(store);
+			return NULL;
+		}
+		store->n_workers++;
+	}
+	if (pthread_create(&store->writer, NULL, writer_main, store)) {
+		log_printf(&logger, ERR, "Failed to create writer thread\n");
+		stop_threads(store);
+		free_store(store);
+		return NULL;
+	}
+	store->writer_started = true;
+	return store;
+}
+
+void slogic_store_close(struct slogic_store *store)
+{
+	if (store->active) {
+		slogic_store_end(store, NULL);
+	}
+	stop_threads(store);
+	free_store(store);
+}
+
+static bool valid_name(const char *name)
+{
+	return *name && *name != '.' && !strchr(name, '/');
+}
+
+int slogic_store_begin(struct slogic_store *store, const char *name, unsigned int samples_per_second)
+{
+	if (store->active || !valid_name(name) || strlen(name) + sizeof("..tmp") > NAME_MAX) {
+		log_printf(&logger, ERR, "Invalid capture name: %s\n", name);
+		return -1;
+	}
+	/* Written under a hidden name and renamed when done */
+	store->manifest_path = capture_path(store, ".", name, ".tmp");
+	store->name = strdup(name);
+	if (!store->manifest_path || !store->name) {
+		goto fail;
+	}
+	store->manifest = fopen(store->manifest_path, "w");
+	if (!store->manifest) {
+		log_printf(&logger, ERR, "Failed to create %s: %s\n", store->manifest_path, strerror(errno));
+		goto fail;
+	}
+	memset(&store->header, 0, sizeof(store->header));
+	store->header.magic = htole32(SLOGIC_STORE_MANIFEST_MAGIC);
+	store->header.version = htole32(SLOGIC_STORE_VERSION);
+	store->header.samples_per_second = htole32(samples_per_second);
+	/* The number of samples is filled in at the end */
+	if (fwrite(&store->header, sizeof(store->header), 1, store->manifest) != 1) {
+		fclose(store->manifest);
+		goto fail;
+	}
+
+	memset(&store->stats, 0, sizeof(store->stats));
+	memset(&store->pending, 0, sizeof(store->pending));
+	store->stats.manifest_bytes = sizeof(store->header);
+	store->slots[store->filled % N_SLOTS].size = 0;
+	store->rolling = 0;
+	store->run = 0;
+	store->error = false;
+	store->active = true;
+	return 0;
+
+fail:
+	free(store->manifest_path);
+	free(store->name);
+	return -1;
+}
+
+/* Waits for the slot after filled to be free, returns false once the writer failed */
+static bool next_slot(struct slogic_store *store)
+{
+	bool ok;
+
+	pthread_mutex_lock(&store->mutex);
+	/* Hand over the current slot */
+	store->filled++;
+	pthread_cond_signal(&store->work);
+	if (store->filled - store->committed == N_SLOTS) {
+		store->stats.stalls++;
+		do {
+			pthread_cond_wait(&store->progress, &store->mutex);
+		} while (store->filled - store->committed == N_SLOTS);
+	}
+	ok = !store->error;
+	pthread_mutex_unlock(&store->mutex);
+
+	store->slots[store->filled % N_SLOTS].size = 0;
+	store->rolling = 0;
+	return ok;
+}
+
+/* Number of samples at the start of data that equal value */
+static size_t run_length(const uint8_t *data, size_t size, uint8_t value)
+{
+	uint64_t pattern = 0x0101010101010101ULL * value;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, &data[i], sizeof(word));
+		if (word != pattern) {
+			break;
+		}
+	}
+	for (; i < size && data[i] == value; i++) ;
+	return i;
+}
+
+/*
+ * Returns how many of the samples belong to the current chunk and sets cut
+ * if the chunk ends with them.
+ *
+ * Besides the gear hash, a cut is made once the signal has been idle for
+ * IDLE_RUN samples and right before it changes again, so that a burst is
+ * cut the same way however long the idle stretch before it was. Inside an
+ * idle stretch the gear hash stays at idle_hash and the end of the stretch
+ * is found a word at a time.
+ */
+static size_t find_cut(struct slogic_store *store, size_t length, const uint8_t *data, size_t size, bool *cut)
+{
+	uint64_t hash = store->rolling;
+	uint64_t run = store->run;
+	uint8_t previous = store->previous;
+	size_t end = SLOGIC_STORE_MAX_CHUNK - length < size ? SLOGIC_STORE_MAX_CHUNK - length : size;
+	size_t i, n, chunk_size;
+	uint64_t mask;
+
+	*cut = false;
+	for (i = 0; i < end; i++) {
+		if (run >= IDLE_RUN && length + i >= GEAR_WINDOW && (store->idle_hash[previous] & MASK_LARGE)) {
+			n = run_length(&data[i], end - i, previous);
+			run += n;
+			i += n;
+			hash = store->idle_hash[previous];
+			if (i == end) {
+				break;
+			}
+		}
+		if (data[i] == previous) {
+			run++;
+		} else {
+			if (run >= IDLE_RUN && length + i >= SLOGIC_STORE_MIN_CHUNK) {
+				/* The end of an idle stretch starts the next chunk */
+				*cut = true;
+				break;
+			}
+			previous = data[i];
+			run = 1;
+		}
+		hash = (hash << 1) + store->gear[data[i]];
+		chunk_size = length + i + 1;
+		mask = chunk_size < SLOGIC_STORE_AVG_CHUNK ? MASK_SMALL : MASK_LARGE;
+		if (chunk_size >= SLOGIC_STORE_MIN_CHUNK && (run == IDLE_RUN || !(hash & mask))) {
+			*cut = true;
+			i++;
+			break;
+		}
+	}
+	if (length + i == SLOGIC_STORE_MAX_CHUNK) {
+		*cut = true;
+	}
+	store->rolling = hash;
+	store->run = run;
+	store->previous = previous;
+	return i;
+}
+
+int slogic_store_feed(struct slogic_store *store, const uint8_t *data, size_t size)
+{
+	struct store_slot *slot;
+	size_t n;
+	bool cut;
+
+	store->stats.samples += size;
+	while (size) {
+		slot = &store->slots[store->filled % N_SLOTS];
+		n = find_cut(store, slot->size, data, size, &cut);
+		memcpy(&slot->data[slot->size], data, n);
+		slot->size += n;
+		data += n;
+		size -= n;
+		if (cut && !next_slot(store)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Waits for the writer to commit everything handed over, returns -1 if a write failed */
+static int wait_committed(struct slogic_store *store)
+{
+	int ret;
+
+	pthread_mutex_lock(&store->mutex);
+	while (store->committed != store->filled) {
+		pthread_cond_wait(&store->progress, &store->mutex);
+	}
+	ret = store->error ? -1 : 0;
+	pthread_mutex_unlock(&store->mutex);
+	return ret;
+}
+
+static void end_capture(struct slogic_store *store)
+{
+	free(store->manifest_path);
+	free(store->name);
+	store->active = false;
+}
+
+/*
+ * The chunks are made durable before the manifest that refers to them, the
+ * manifest before it is renamed and the rename before this returns, so a
+ * capture that was reported as stored survives a crash.
+ */
+int slogic_store_end(struct slogic_store *store, struct slogic_store_stats *stats)
+{
+	struct slogic_store_manifest_record *run = &store->pending;
+	char *final_path = NULL;
+	char *captures = NULL;
+	int ret = 0;
+
+	if (!store->active) {
+		return -1;
+	}
+	if (store->slots[store->filled % N_SLOTS].size) {
+		next_slot(store);
+	}
+	ret = wait_committed(store);
+
+	if (!ret && run->count) {
+		run->size = htole32(run->size);
+		run->count = htole32(run->count);
+		if (fwrite(run, sizeof(*run), 1, store->manifest) != 1) {
+			ret = -1;
+		}
+		store->stats.manifest_bytes += sizeof(*run);
+	}
+	store->header.n_samples = htole64(store->stats.samples);
+	if (ret || fseek(store->manifest, 0, SEEK_SET)
+	    || fwrite(&store->header, sizeof(store->header), 1, store->manifest) != 1) {
+		ret = -1;
+	}
+	/* Chunks first, a manifest never refers to chunks that aren't written */
+	if (fflush(store->pack) || fsync(fileno(store->pack)) || fflush(store->index) || fsync(store->index_fd)) {
+		log_printf(&logger, ERR, "Failed to sync the pack: %s\n", strerror(errno));
+		ret = -1;
+	}
+	if (fflush(store->manifest) || fsync(fileno(store->manifest))) {
+		ret = -1;
+	}
+	if (fclose(store->manifest)) {
+		ret = -1;
+	}
+	if (!ret) {
+		final_path = capture_path(store, "", store->name, "");
+		captures = path(store->directory, "captures");
+		if (!final_path || !captures) {
+			ret = -1;
+		} else if (rename(store->manifest_path, final_path)) {
+			log_printf(&logger, ERR, "Failed to rename the manifest: %s\n", strerror(errno));
+			ret = -1;
+		} else if (sync_directory(captures)) {
+			log_printf(&logger, ERR, "Failed to sync %s: %s\n", captures, strerror(errno));
+			ret = -1;
+		}
+	}
+	if (ret) {
+		log_printf(&logger, ERR, "Failed to store the capture %s\n", store->name);
+		unlink(store->manifest_path);
+	}
+
+	log_printf(&logger, DEBUG, "%s: %llu chunks, %llu new, %llu new bytes, %llu stalls\n", store->name,
+		   (unsigned long long)store->stats.chunks, (unsigned long long)store->stats.new_chunks,
+		   (unsigned long long)store->stats.new_bytes, (unsigned long long)store->stats.stalls);
+	if (stats) {
+		*stats = store->stats;
+	}
+	free(final_path);
+	free(captures);
+	end_capture(store);
+	return ret;
+}
+
+void slogic_store_abort(struct slogic_store *store)
+{
+	if (!store->active) {
+		return;
+	}
+	/* The writer may still be adding to the manifest */
+	wait_committed(store);
+	fclose(store->manifest);
+	unlink(store->manifest_path);
+	log_printf(&logger, INFO, "Dropped the capture %s\n", store->name);
+	end_capture(store);
+}
+
+bool slogic_store_contains(struct slogic_store *store, const char *name)
+{
+	char *p = capture_path(store, "", name, "");
+	bool found = p && access(p, F_OK) == 0;
+
+	free(p);
+	return found;
+}
+
+int slogic_store_read(struct slogic_store *store, const char *name, FILE *file)
+{
+	struct slogic_store_manifest_header header;
+	struct slogic_store_manifest_record record;
+	struct index_entry *entry;
+	uint8_t hash[SLOGIC_STORE_HASH_SIZE];
+	uint8_t *data = NULL;
+	uint64_t n_samples = 0;
+	char *manifest_path;
+	FILE *manifest = NULL;
+	uint32_t i;
+	int ret = -1;
+
+	if (!valid_name(name)) {
+		log_printf(&logger, ERR, "Invalid capture name: %s\n", name);
+		return -1;
+	}
+	manifest_path = capture_path(store, "", name, "");
+	data = malloc(SLOGIC_STORE_MAX_CHUNK);
+	if (!manifest_path || !data) {
+		goto out;
+	}
+	manifest = fopen(manifest_path, "r");
+	if (!manifest) {
+		log_printf(&logger, ERR, "Failed to open %s: %s\n", manifest_path, strerror(errno));
+		goto out;
+	}
+	if (fread(&header, sizeof(header), 1, manifest) != 1 || le32toh(header.magic) != SLOGIC_STORE_MANIFEST_MAGIC
+	    || le32toh(header.version) != SLOGIC_STORE_VERSION) {
+		log_printf(&logger, ERR, "%s is not a capture manifest\n", manifest_path);
+		goto out;
+	}
+	if (fflush(store->pack)) {
+		goto out;
+	}
+
+	while (fread(&record, sizeof(record), 1, manifest) == 1) {
+		entry = lookup(store, record.hash);
+		if (!entry || entry->size != le32toh(record.size)) {
+			log_printf(&logger, ERR, "%s refers to a chunk the store doesn't have\n", manifest_path);
+			goto out;
+		}
+		if (pread(fileno(store->pack), data, entry->size, entry->offset) != entry->size) {
+			log_printf(&logger, ERR, "Failed to read a chunk: %s\n", strerror(errno));
+			goto out;
+		}
+		sha256(data, entry->size, hash);
+		if (memcmp(hash, entry->hash, SLOGIC_STORE_HASH_SIZE)) {
+			log_printf(&logger, ERR, "The chunk at %llu of the pack is corrupt\n",
+				   (unsigned long long)entry->offset);
+			goto out;
+		}
+		for (i = 0; i < le32toh(record.count); i++) {
+			if (fwrite(data, 1, entry->size, file) != entry->size) {
+				log_printf(&logger, ERR, "Failed to write the samples\n");
+				goto out;
+			}
+		}
+		n_samples += (uint64_t)entry->size * le32toh(record.count);
+	}
+	if (n_samples != le64toh(header.n_samples)) {
+		log_printf(&logger, ERR, "%s is truncated\n", manifest_path);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	if (manifest) {
+		fclose(manifest);
+	}
+	free(manifest_path);
+	free(data);
+	return ret;
+}
+
+uint64_t slogic_store_pack_size(const struct slogic_store *store)
+{
+	return store->pack_size;
+}
+
+unsigned int slogic_store_threads(const struct slogic_store *store, pthread_t *threads, unsigned int max)
+{
+	unsigned int i;
+
+	for (i = 0; i < store->n_workers && i < max; i++) {
+		threads[i] = store->workers[i];
+	}
+	if (i < max) {
+		threads[i] = store->writer;
+	}
+	return store->n_workers + 1;
+}
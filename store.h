@@ -0,0 +1,135 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Deduplicating capture store. Captures are cut into chunks at positions
+ * picked by a rolling hash of the content and at the start and end of idle
+ * stretches, so a capture that repeats an earlier one, even with its bursts
+ * shifted by some samples, is cut the same way and mostly consists of
+ * chunks the store already has. Only new chunks are written, a capture
+ * itself is a manifest of SHA-256 references.
+ *
+ * A store is a directory with:
+ *  pack         the chunks, appended one after the other
+ *  index        a header and one record per chunk in pack
+ *  captures/    one manifest per capture
+ *
+ * The pack is written before the index, index records that point past the
+ * end of the pack after a crash are dropped when the store is opened. A
+ * manifest only shows up under its name once the capture is complete. Only
+ * one process at a time can write to a store. All fields are little endian.
+ */
+#define SLOGIC_STORE_INDEX_MAGIC 0x49534c53	/* "SLSI" */
+#define SLOGIC_STORE_MANIFEST_MAGIC 0x4d534c53	/* "SLSM" */
+#define SLOGIC_STORE_VERSION 1
+#define SLOGIC_STORE_HASH_SIZE 32
+
+/* Chunk sizes of the chunker, the average is where cuts are made most of the time */
+#define SLOGIC_STORE_MIN_CHUNK (2 * 1024)
+#define SLOGIC_STORE_AVG_CHUNK (8 * 1024)
+#define SLOGIC_STORE_MAX_CHUNK (64 * 1024)
+
+struct slogic_store_file_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct slogic_store_index_record {
+	uint8_t hash[SLOGIC_STORE_HASH_SIZE];
+	uint64_t offset;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+struct slogic_store_manifest_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t n_samples;
+	uint32_t samples_per_second;
+	uint32_t reserved;
+};
+
+/* A run of count equal chunks, as an idle signal gives */
+struct slogic_store_manifest_record {
+	uint8_t hash[SLOGIC_STORE_HASH_SIZE];
+	uint32_t size;
+	uint32_t count;
+};
+
+struct slogic_store_stats {
+	/* Of the capture written last */
+	uint64_t samples;
+	uint64_t chunks;
+	uint64_t new_chunks;
+	/* Bytes written to the pack and the manifest */
+	uint64_t new_bytes;
+	uint64_t manifest_bytes;
+	/* Times the recording had to wait for the hashing workers */
+	uint64_t stalls;
+};
+
+struct slogic_store;
+
+/*
+ * Opens the store in the directory, creating it if needed, and loads the
+ * index. Chunks are hashed by this many worker threads. Returns NULL on
+ * failure.
+ */
+struct slogic_store *slogic_store_open(const char *directory, unsigned int n_workers);
+
+/* Waits for a capture that is still being written and frees the store */
+void slogic_store_close(struct slogic_store *store);
+
+/* Starts a capture with this name, replacing one of the same name when done. Returns 0 on success */
+int slogic_store_begin(struct slogic_store *store, const char *name, unsigned int samples_per_second);
+
+/*
+ * Adds the next samples of the capture. Cuts and copies the chunks and
+ * leaves hashing and writing to the workers, so it only blocks when they
+ * fall a whole queue behind. Returns 0 on success, -1 after a write failed.
+ */
+int slogic_store_feed(struct slogic_store *store, const uint8_t * data, size_t size);
+
+/*
+ * Writes the rest of the capture and its manifest and syncs them to disk.
+ * Returns 0 on success.
+ */
+int slogic_store_end(struct slogic_store *store, struct slogic_store_stats *stats);
+
+/* Drops the capture being written. The chunks it added stay in the pack for later captures */
+void slogic_store_abort(struct slogic_store *store);
+
+/* True if there is a capture with this name */
+bool slogic_store_contains(struct slogic_store *store, const char *name);
+
+/* Writes the samples of a capture to file, checking every chunk against its hash. Returns 0 on success */
+int slogic_store_read(struct slogic_store *store, const char *name, FILE * file);
+
+/* Total size of the pack, the deduplicated size of all captures */
+uint64_t slogic_store_pack_size(const struct slogic_store *store);
+
+/*
+ * The hashing workers and the pack writer, to pin them. Fills in up to max
+ * threads and returns how many there are.
+ */
+unsigned int slogic_store_threads(const struct slogic_store *store, pthread_t * threads, unsigned int max);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -0,0 +1,155 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Ingest throughput and deduplication ratio of the capture store on
+ * synthetic regression runs: the same bursts of bus traffic every run, with
+ * the bursts shifted by a few samples and now and then a different data
+ * word, as repeated captures of the same test come out. Every run is read
+ * back and compared. Use a fresh store directory, the ratio counts the whole
+ * store.
+ */
+#include "store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define SAMPLES_PER_SECOND 24000000
+#define N_SAMPLES (2 * SAMPLES_PER_SECOND)
+#define CHUNK_SIZE (16 * 1024)
+#define BURST_WORDS 2000
+#define WORD_SAMPLES 8
+#define BURST_INTERVAL 250000
+/* One in this many bursts has a different data word than in the other runs */
+#define CHANGE_INTERVAL 20
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint32_t next(uint32_t *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+/* A clock on channel 0 and the data on the other channels, idle between the bursts */
+static void generate(uint8_t *data, size_t size, unsigned int run)
+{
+	uint32_t traffic = 1;
+	uint32_t variation = run + 1;
+	size_t burst, start, i, j;
+	uint8_t word;
+
+	memset(data, 0, size);
+	for (burst = 0; (burst + 1) * BURST_INTERVAL <= size; burst++) {
+		start = burst * BURST_INTERVAL + next(&variation) % 4;
+		for (i = 0; i < BURST_WORDS; i++) {
+			word = next(&traffic) & 0xfe;
+			if (i == BURST_WORDS / 2 && next(&variation) % CHANGE_INTERVAL == 0) {
+				word ^= 0x80;
+			}
+			for (j = 0; j < WORD_SAMPLES; j++) {
+				data[start + i * WORD_SAMPLES + j] = word | (j < WORD_SAMPLES / 2);
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_store *store;
+	struct slogic_store_stats stats;
+	unsigned int n_workers = 2;
+	unsigned int n_runs = 10;
+	const char *directory = "store_bench.store";
+	uint64_t ingested = 0, manifests = 0;
+	uint8_t *data, *check;
+	char name[32];
+	double start, elapsed, total = 0;
+	FILE *file;
+	size_t i, n;
+	unsigned int run;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:w:n:")) != -1) {
+		switch (c) {
+		case 'd':
+			directory = optarg;
+			break;
+		case 'w':
+			n_workers = atoi(optarg);
+			break;
+		case 'n':
+			n_runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d <store directory>] [-w <workers>] [-n <runs>]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	data = malloc(N_SAMPLES);
+	check = malloc(N_SAMPLES);
+	if (!data || !check) {
+		exit(EXIT_FAILURE);
+	}
+	store = slogic_store_open(directory, n_workers);
+	if (!store) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("run   MS/s  chunks    new  new bytes  manifest  total ratio\n");
+	for (run = 0; run < n_runs; run++) {
+		generate(data, N_SAMPLES, run);
+		snprintf(name, sizeof(name), "run-%u", run);
+
+		start = now();
+		if (slogic_store_begin(store, name, SAMPLES_PER_SECOND)) {
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < N_SAMPLES; i += n) {
+			n = N_SAMPLES - i < CHUNK_SIZE ? N_SAMPLES - i : CHUNK_SIZE;
+			if (slogic_store_feed(store, &data[i], n)) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (slogic_store_end(store, &stats)) {
+			exit(EXIT_FAILURE);
+		}
+		elapsed = now() - start;
+		total += elapsed;
+
+		ingested += N_SAMPLES;
+		manifests += stats.manifest_bytes;
+		printf("%3u %6.1f %7llu %6llu %10llu %9llu %11.1f\n", run, N_SAMPLES / elapsed / 1e6,
+		       (unsigned long long)stats.chunks, (unsigned long long)stats.new_chunks,
+		       (unsigned long long)stats.new_bytes, (unsigned long long)stats.manifest_bytes,
+		       (double)ingested / (slogic_store_pack_size(store) + manifests));
+
+		/* Read back through a file, as slogic_store_read writes to one */
+		file = tmpfile();
+		if (!file || slogic_store_read(store, name, file)) {
+			exit(EXIT_FAILURE);
+		}
+		rewind(file);
+		if (fread(check, 1, N_SAMPLES, file) != N_SAMPLES || fgetc(file) != EOF
+		    || memcmp(check, data, N_SAMPLES)) {
+			fprintf(stderr, "%s doesn't read back the same\n", name);
+			exit(EXIT_FAILURE);
+		}
+		fclose(file);
+	}
+	printf("%u workers: %.1f MS/s, %.1f times 24MHz, %llu bytes stored for %llu bytes captured\n", n_workers,
+	       (double)ingested / total / 1e6, (double)ingested / total / SAMPLES_PER_SECOND,
+	       (unsigned long long)(slogic_store_pack_size(store) + manifests), (unsigned long long)ingested);
+
+	slogic_store_close(store);
+	free(data);
+	free(check);
+	return EXIT_SUCCESS;
+}
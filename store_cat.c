@@ -0,0 +1,43 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Writes a capture from a store made with main -D to a file or stdout.
+ * Every chunk is checked against its hash on the way out.
+ */
+#include "store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+	struct slogic_store *store;
+	FILE *out = stdout;
+	int ret;
+
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "usage: %s <store directory> <capture name> [<output file>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* No capture is written, so one worker that stays idle is enough */
+	store = slogic_store_open(argv[1], 1);
+	if (!store) {
+		exit(EXIT_FAILURE);
+	}
+	if (argc == 4 && strcmp(argv[3], "-")) {
+		out = fopen(argv[3], "w");
+		if (!out) {
+			perror("opening output file");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ret = slogic_store_read(store, argv[2], out);
+	if (out != stdout && fclose(out)) {
+		perror("writing samples");
+		ret = -1;
+	}
+	slogic_store_close(store);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
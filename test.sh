@@ -21,7 +21,7 @@ new_entry(){
 }
 
 new_log
-add_entry "counter,speed,buffer_count,timeout,buffer_size,cmd,sucess,success_1"
+add_entry "counter,speed,buffer_count,timeout,buffer_size,cmd,sucess,success_1,startup_ms"
 new_entry
 COUNTER=0
 for buffer_count in  4
@@ -41,7 +41,7 @@ do
 				cmd="./main -f out.log -r $speed -t $buffer_count -o $timeout -b $buffer_size"
 				add_entry "\"$cmd\""
 				echo -n $COUNTER $cmd
-				if ($cmd 2>&1 )  > /dev/null
+				if ($cmd 2>&1 )  > run.log
 				then
 					echo " OK"
 					add_entry OK
@@ -51,6 +51,8 @@ do
 					add_entry NOK
 					add_entry 0
 				fi
+				# Time from the start of the recording to the first sample
+				add_entry `sed -n -e "s,.*First sample after \(.*\)ms,\1,p" run.log`
 				new_entry
 			done
 		done
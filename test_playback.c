@@ -0,0 +1,99 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Playback on the simulated device, see simusb.h. The pattern has to be
+ * queued on EP6 before the start command goes out on EP1 and has to arrive
+ * in order. The fill callback stalls once for longer than the queued
+ * transfers last, which has to show up as exactly the one underrun the
+ * device saw.
+ */
+#include "slogic.h"
+#include "simusb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PATTERN_SIZE (1024 * 1024)
+#define TRANSFER_SIZE (16 * 1024)
+#define N_TRANSFERS 4
+/* 4 transfers of 16KB last about 65ms at 1MHz */
+#define STALL_AT (256 * 1024)
+#define STALL_USEC 300000
+
+struct pattern {
+	uint64_t position;
+	bool stalled;
+};
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	failures += !ok;
+}
+
+static size_t on_fill(uint8_t * buffer, size_t size, void *user_data)
+{
+	struct pattern *pattern = user_data;
+	size_t i;
+
+	if (pattern->position >= STALL_AT && !pattern->stalled) {
+		pattern->stalled = true;
+		usleep(STALL_USEC);
+	}
+	if (size > PATTERN_SIZE - pattern->position) {
+		size = PATTERN_SIZE - pattern->position;
+	}
+	for (i = 0; i < size; i++) {
+		buffer[i] = simusb_sample(pattern->position + i);
+	}
+	pattern->position += size;
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_handle *handle = slogic_init();
+	struct slogic_playback playback;
+	struct pattern pattern = { 0 };
+	const struct simusb_event *events;
+	unsigned int n_events, i, queued_before_start = 0;
+	bool started = false, data_before_start = false;
+	int ret;
+
+	if (!handle || slogic_open(handle)) {
+		exit(EXIT_FAILURE);
+	}
+	handle->transfer_buffer_size = TRANSFER_SIZE;
+	handle->n_transfer_buffers = N_TRANSFERS;
+	slogic_fill_playback(&playback, slogic_parse_sample_rate("1MHz"), on_fill, &pattern);
+
+	ret = slogic_execute_playback(handle, &playback);
+	check(ret != 0 && simusb_events(&events) == 0, "the guessed command needs experimental_commands");
+
+	handle->experimental_commands = true;
+	ret = slogic_execute_playback(handle, &playback);
+	n_events = simusb_events(&events);
+	for (i = 0; i < n_events; i++) {
+		if (events[i].type == SIMUSB_COMMAND) {
+			started = true;
+		} else if (events[i].type == SIMUSB_PLAYBACK_QUEUED && !started) {
+			queued_before_start++;
+		} else if (events[i].type == SIMUSB_PLAYBACK_DATA && !started) {
+			data_before_start = true;
+		}
+	}
+
+	check(ret == 0 && playback.playback_state == COMPLETED_SUCCESSFULLY, "the playback completes");
+	check(playback.bytes_sent == PATTERN_SIZE, "the whole pattern is sent");
+	check(queued_before_start == N_TRANSFERS && !data_before_start, "the pattern is queued before the start");
+	check(simusb_playback_mismatches() == 0, "the device plays the pattern in order");
+	check(simusb_playback_underruns() == 1, "the stall starves the device once");
+	check(playback.underruns == simusb_playback_underruns(), "the underruns reported are the device's");
+	printf("%llu underruns reported, %llu seen by the device\n", (unsigned long long)playback.underruns,
+	       (unsigned long long)simusb_playback_underruns());
+
+	slogic_close(handle);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
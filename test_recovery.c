@@ -0,0 +1,144 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Recovery of a running recording on the simulated device, see simusb.h.
+ * The sampling first stalls until the transfers have timed out too many
+ * times in a row, later the device is unplugged and comes back without its
+ * firmware. Both times the recording has to recover, report the gap and go
+ * on with the data of the restarted device, without any call of the
+ * non-blocking API blocking the loop for long.
+ */
+#include "slogic.h"
+#include "simusb.h"
+#include "rt.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_SAMPLES (8 * 1024 * 1024)
+#define STALL_AT (1 * 1024 * 1024)
+#define UNPLUG_AT (3 * 1024 * 1024)
+#define REPLUG_AFTER_USEC 1500000
+/* Longest a call of slogic_handle_events_nonblocking may take */
+#define MAX_CALL_USEC 50000
+#define MAX_POLL_WAIT_MS 100
+#define MAX_POLLFDS 16
+
+struct test {
+	/* Samples since the device was last (re)started, to check the data against */
+	uint64_t position;
+	uint64_t received;
+	uint64_t corrupt;
+	bool stalled;
+	bool unplugged;
+	bool plugged_back;
+	uint64_t unplugged_at;
+	unsigned int n_gaps;
+	struct slogic_gap gaps[4];
+};
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	failures += !ok;
+}
+
+static bool on_data(uint8_t * data, size_t size, void *user_data)
+{
+	struct test *test = user_data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		test->corrupt += data[i] != simusb_sample(test->position + i);
+	}
+	test->position += size;
+	test->received += size;
+
+	if (test->received >= STALL_AT && !test->stalled) {
+		test->stalled = true;
+		simusb_stall();
+	}
+	if (test->received >= UNPLUG_AT && !test->unplugged) {
+		test->unplugged = true;
+		test->unplugged_at = slogic_rt_now_usec();
+		simusb_unplug();
+	}
+	return test->received < N_SAMPLES;
+}
+
+static void on_gap(const struct slogic_gap *gap, void *user_data)
+{
+	struct test *test = user_data;
+
+	if (test->n_gaps < sizeof(test->gaps) / sizeof(test->gaps[0])) {
+		test->gaps[test->n_gaps] = *gap;
+	}
+	test->n_gaps++;
+	/* The restarted device counts from 0 again */
+	test->position = 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_handle *handle = slogic_init();
+	struct slogic_recording recording;
+	struct pollfd fds[MAX_POLLFDS];
+	struct test test = { 0 };
+	struct timeval tv;
+	uint64_t before, took, longest = 0;
+	int n_fds, timeout, ret;
+
+	if (!handle || slogic_open(handle)) {
+		exit(EXIT_FAILURE);
+	}
+	handle->max_recoveries = 2;
+	/* Short timeouts so that a stall is noticed in a fraction of a second */
+	handle->transfer_timeout = 2;
+
+	slogic_fill_recording(&recording, slogic_parse_sample_rate("24MHz"), on_data, &test);
+	recording.on_gap_callback = on_gap;
+	n_fds = slogic_get_pollfds(handle, fds, MAX_POLLFDS);
+	if (n_fds < 0 || n_fds > MAX_POLLFDS || slogic_start_recording(handle, &recording)) {
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		if (test.unplugged && !test.plugged_back
+		    && slogic_rt_now_usec() - test.unplugged_at > REPLUG_AFTER_USEC) {
+			/* Comes back after a couple of failed lookups */
+			test.plugged_back = true;
+			simusb_plug();
+		}
+		timeout = MAX_POLL_WAIT_MS;
+		if (slogic_get_next_timeout(handle, &tv) == 1 && tv.tv_sec * 1000 + tv.tv_usec / 1000 < timeout) {
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		}
+		poll(fds, n_fds, timeout);
+
+		before = slogic_rt_now_usec();
+		ret = slogic_handle_events_nonblocking(handle);
+		took = slogic_rt_now_usec() - before;
+		longest = took > longest ? took : longest;
+		if (ret <= 0) {
+			break;
+		}
+	}
+	ret = slogic_stop_recording(handle);
+
+	check(ret == 0 && recording.recording_state == COMPLETED_SUCCESSFULLY, "the recording completes");
+	check(test.received >= N_SAMPLES, "all samples are delivered");
+	check(test.corrupt == 0, "the data is the device's, in order");
+	check(test.n_gaps == 2, "two gaps are reported");
+	check(test.n_gaps >= 1 && test.gaps[0].reason == TIMEOUT && test.gaps[0].sample_offset >= STALL_AT,
+	      "the first gap is the stall");
+	check(test.n_gaps >= 2 && test.gaps[1].reason == DEVICE_GONE && test.gaps[1].sample_offset >= UNPLUG_AT
+	      && test.gaps[1].lost_samples > 0, "the second gap is the unplugged device");
+	check(longest < MAX_CALL_USEC, "handling the events never blocks");
+	printf("longest call %llu.%03llums\n", (unsigned long long)longest / 1000,
+	       (unsigned long long)longest % 1000);
+
+	slogic_close(handle);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Round trip of squelched captures: random bursts of activity separated by
+ * idle stretches are squelched with several pre/post settings, fed in
+ * chunks of several sizes, and have to come back from slogic_squelch_read
+ * byte for byte. Every chunk is copied into a buffer of its own size, so
+ * that reading outside of it shows up under a memory checker.
+ */
+#include "squelch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_SAMPLES (1024 * 1024)
+#define MAX_BURST 64
+#define MAX_IDLE 256
+#define READ_SIZE 1000
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	failures += !ok;
+}
+
+/* Bursts of random samples between stretches of a constant level */
+static void generate(uint8_t *data, size_t size)
+{
+	uint8_t level = 0;
+	size_t i = 0, n;
+
+	while (i < size) {
+		n = rand() % MAX_IDLE;
+		for (; n && i < size; n--, i++) {
+			data[i] = level;
+		}
+		n = 1 + rand() % MAX_BURST;
+		for (; n && i < size; n--, i++) {
+			data[i] = rand() % 4 ? level : rand();
+			level = data[i];
+		}
+	}
+}
+
+/* Squelches data in chunks of chunk_size and reads it back, returns true if it matches */
+static bool round_trip(const uint8_t *data, size_t size, uint64_t pre, uint64_t post, size_t chunk_size)
+{
+	struct slogic_squelch squelch;
+	struct slogic_squelch_reader reader;
+	uint8_t *chunk = malloc(chunk_size);
+	uint8_t *expanded = malloc(size + READ_SIZE);
+	FILE *file = tmpfile();
+	size_t offset = 0, n;
+	ssize_t ret;
+	bool ok = true;
+
+	if (!chunk || !expanded || !file || slogic_squelch_init(&squelch, file, pre, post, 24000000)) {
+		exit(EXIT_FAILURE);
+	}
+	for (offset = 0; offset < size; offset += n) {
+		n = size - offset < chunk_size ? size - offset : chunk_size;
+		/* In a buffer of its own, the rest of a short last chunk is never touched */
+		memcpy(chunk, &data[offset], n);
+		ok = ok && slogic_squelch_feed(&squelch, chunk, n) == 0;
+	}
+	ok = ok && slogic_squelch_finish(&squelch) == 0;
+
+	rewind(file);
+	ok = ok && slogic_squelch_reader_open(&reader, file) == 0;
+	offset = 0;
+	while (ok && (ret = slogic_squelch_read(&reader, &expanded[offset], READ_SIZE)) > 0) {
+		offset += ret;
+		if (offset > size) {
+			break;
+		}
+	}
+	ok = ok && ret == 0 && offset == size && memcmp(expanded, data, size) == 0;
+
+	fclose(file);
+	free(expanded);
+	free(chunk);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t chunk_sizes[] = { 1, 7, 16, 48, 512, 4096, 65536 };
+	static const uint64_t windows[][2] = { {0, 0}, {10, 2}, {2, 10}, {100, 100}, {1000, 50} };
+	uint8_t *data = malloc(N_SAMPLES);
+	char what[128];
+	size_t c, w, size;
+
+	if (!data) {
+		exit(EXIT_FAILURE);
+	}
+	srand(1);
+	generate(data, N_SAMPLES);
+
+	for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+		for (c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+			/* Byte sized chunks are slow, a shorter capture does */
+			size = chunk_sizes[c] < 16 ? N_SAMPLES / 16 : N_SAMPLES;
+			snprintf(what, sizeof(what), "pre %llu, post %llu in chunks of %zu",
+				 (unsigned long long)windows[w][0], (unsigned long long)windows[w][1], chunk_sizes[c]);
+			check(round_trip(data, size, windows[w][0], windows[w][1], chunk_sizes[c]), what);
+		}
+	}
+
+	free(data);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
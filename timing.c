@@ -0,0 +1,296 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "timing.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct logger logger = {
+	.name = __FILE__,
+	.verbose = 0,
+};
+
+void slogic_timing_init(struct slogic_timing_checker *checker, slogic_on_violation_callback on_violation,
+			void *user_data)
+{
+	memset(checker, 0, sizeof(*checker));
+	checker->on_violation = on_violation;
+	checker->user_data = user_data;
+}
+
+static bool parse_channel(const char *str, int *channel)
+{
+	char *endptr;
+	long value = strtol(str, &endptr, 10);
+
+	if (*endptr != '\0' || value < 0 || value >= SLOGIC_N_CHANNELS) {
+		return false;
+	}
+	*channel = value;
+	return true;
+}
+
+static bool parse_kind(const char *str, const char *first, const char *second, unsigned int *kind)
+{
+	if (!strcmp(str, first)) {
+		*kind = SLOGIC_TIMING_RISING;
+	} else if (!strcmp(str, second)) {
+		*kind = SLOGIC_TIMING_FALLING;
+	} else if (!strcmp(str, "both")) {
+		*kind = SLOGIC_TIMING_RISING | SLOGIC_TIMING_FALLING;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static uint64_t round_up(double value)
+{
+	uint64_t n = value;
+	return n < value ? n + 1 : n;
+}
+
+/* "<samples>", "<time>ns" or "<time>us", rounded up to whole samples */
+static bool parse_time(const char *str, unsigned int samples_per_second, uint64_t *samples)
+{
+	char *endptr;
+	double value = strtod(str, &endptr);
+	double scale;
+
+	if (endptr == str || value <= 0) {
+		return false;
+	}
+	if (*endptr == '\0') {
+		*samples = round_up(value);
+		return true;
+	}
+	if (!strcmp(endptr, "ns")) {
+		scale = 1e-9;
+	} else if (!strcmp(endptr, "us")) {
+		scale = 1e-6;
+	} else {
+		return false;
+	}
+	if (!samples_per_second) {
+		return false;
+	}
+	/* Leave some room for the rounding of the scale, 40ns at 25MHz is one sample and not two */
+	*samples = round_up(value * scale * samples_per_second - 1e-9);
+	return true;
+}
+
+int slogic_timing_add_rule(struct slogic_timing_checker *checker, const char *rule, unsigned int samples_per_second)
+{
+	struct slogic_timing_rule *r;
+	char type[16], a[16], b[16], c[16], d[32];
+	int n;
+
+	if (checker->n_rules == SLOGIC_TIMING_MAX_RULES) {
+		log_printf(&logger, ERR, "Too many rules, at most %d are supported\n", SLOGIC_TIMING_MAX_RULES);
+		return -1;
+	}
+	r = &checker->rules[checker->n_rules];
+	memset(r, 0, sizeof(*r));
+
+	n = sscanf(rule, "%15s %15s %15s %15s %31s", type, a, b, c, d);
+	if (n == 5 && (!strcmp(type, "setup") || !strcmp(type, "hold"))) {
+		r->type = type[0] == 's' ? SLOGIC_TIMING_SETUP : SLOGIC_TIMING_HOLD;
+		if (!parse_channel(a, &r->channel) || !parse_channel(b, &r->clock) || r->channel == r->clock
+		    || !parse_kind(c, "rising", "falling", &r->edges)
+		    || !parse_time(d, samples_per_second, &r->samples)) {
+			return -1;
+		}
+		checker->mask |= 1 << r->clock;
+		checker->clock_mask |= 1 << r->clock;
+		if (r->edges & SLOGIC_TIMING_RISING) {
+			checker->clock_rules[r->clock][0] |= 1ULL << checker->n_rules;
+		}
+		if (r->edges & SLOGIC_TIMING_FALLING) {
+			checker->clock_rules[r->clock][1] |= 1ULL << checker->n_rules;
+		}
+		if (r->type == SLOGIC_TIMING_HOLD) {
+			checker->hold_rules[r->channel] |= 1ULL << checker->n_rules;
+		}
+	} else if (n == 4 && !strcmp(type, "pulse")) {
+		r->type = SLOGIC_TIMING_PULSE;
+		if (!parse_channel(a, &r->channel) || !parse_kind(b, "high", "low", &r->edges)
+		    || !parse_time(c, samples_per_second, &r->samples)) {
+			return -1;
+		}
+		checker->pulse_rules[r->channel] |= 1ULL << checker->n_rules;
+	} else {
+		return -1;
+	}
+	checker->mask |= 1 << r->channel;
+
+	snprintf(r->text, sizeof(r->text), "%s", rule);
+	checker->n_rules++;
+	return 0;
+}
+
+int slogic_timing_load(struct slogic_timing_checker *checker, const char *file_name,
+		       unsigned int samples_per_second)
+{
+	char line[256];
+	char *p, *end;
+	int line_number = 0;
+	int ret = 0;
+	FILE *file;
+
+	file = fopen(file_name, "r");
+	if (!file) {
+		log_printf(&logger, ERR, "Failed to open %s: %s\n", file_name, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		p = strchr(line, '#');
+		if (p) {
+			*p = '\0';
+		}
+		for (p = line; isspace((unsigned char)*p); p++) ;
+		for (end = p + strlen(p); end > p && isspace((unsigned char)end[-1]); end--) ;
+		*end = '\0';
+		if (!*p) {
+			continue;
+		}
+		if (slogic_timing_add_rule(checker, p, samples_per_second)) {
+			log_printf(&logger, ERR, "%s:%d: invalid rule: %s\n", file_name, line_number, p);
+			ret = -1;
+		}
+	}
+	fclose(file);
+
+	if (!ret && !checker->n_rules) {
+		log_printf(&logger, ERR, "%s has no rules\n", file_name);
+		ret = -1;
+	}
+	return ret;
+}
+
+static void violation(struct slogic_timing_checker *checker, struct slogic_timing_rule *rule, uint64_t position,
+		      uint64_t reference, uint64_t samples)
+{
+	struct slogic_timing_violation v = {
+		.rule = rule,
+		.position = position,
+		.reference = reference,
+		.samples = samples,
+	};
+
+	rule->violations++;
+	checker->violations++;
+	if (checker->on_violation) {
+		checker->on_violation(&v, checker->user_data);
+	}
+}
+
+/* Position of the last clock edge a hold rule applies to, false if there hasn't been one */
+static bool last_clock_edge(const struct slogic_timing_checker *checker, const struct slogic_timing_rule *rule,
+			    uint64_t *position)
+{
+	unsigned int kinds = checker->has_clock[rule->clock] & rule->edges;
+
+	if (!kinds) {
+		return false;
+	}
+	if (kinds == (SLOGIC_TIMING_RISING | SLOGIC_TIMING_FALLING)) {
+		*position = checker->last_clock[rule->clock][0] > checker->last_clock[rule->clock][1] ?
+		    checker->last_clock[rule->clock][0] : checker->last_clock[rule->clock][1];
+	} else {
+		*position = checker->last_clock[rule->clock][kinds - 1];
+	}
+	return true;
+}
+
+/*
+ * level is the sample after the edge, changed has a bit set for every masked
+ * channel that changed. Only the rules of the channels that changed are
+ * looked at, through the per channel rule masks.
+ */
+static void on_edge(uint64_t position, uint8_t changed, uint8_t level, void *user_data)
+{
+	struct slogic_timing_checker *checker = user_data;
+	struct slogic_timing_rule *rule;
+	uint8_t channels = changed;
+	uint64_t rules, edge;
+	unsigned int kind;
+	int channel;
+
+	while (channels) {
+		channel = __builtin_ctz(channels);
+		channels &= channels - 1;
+
+		/* Pulses that end here, a falling edge ends a high pulse */
+		if (checker->has_edge & (1 << channel)) {
+			uint64_t width = position - checker->last_edge[channel];
+			kind = (level >> channel) & 1 ? SLOGIC_TIMING_LOW : SLOGIC_TIMING_HIGH;
+			for (rules = checker->pulse_rules[channel]; rules; rules &= rules - 1) {
+				rule = &checker->rules[__builtin_ctzll(rules)];
+				if ((rule->edges & kind) && width < rule->samples) {
+					violation(checker, rule, checker->last_edge[channel],
+						  checker->last_edge[channel], width);
+				}
+			}
+		}
+		checker->last_edge[channel] = position;
+
+		/* Data changes inside the hold window of an earlier clock edge */
+		for (rules = checker->hold_rules[channel]; rules; rules &= rules - 1) {
+			rule = &checker->rules[__builtin_ctzll(rules)];
+			if (last_clock_edge(checker, rule, &edge) && position - edge < rule->samples) {
+				violation(checker, rule, position, edge, position - edge);
+			}
+		}
+	}
+	checker->has_edge |= changed;
+
+	/* Clock edges, the data edges on this sample are in last_edge by now */
+	channels = changed & checker->clock_mask;
+	while (channels) {
+		channel = __builtin_ctz(channels);
+		channels &= channels - 1;
+
+		kind = (level >> channel) & 1 ? SLOGIC_TIMING_RISING : SLOGIC_TIMING_FALLING;
+		for (rules = checker->clock_rules[channel][kind - 1]; rules; rules &= rules - 1) {
+			rule = &checker->rules[__builtin_ctzll(rules)];
+			if (rule->type == SLOGIC_TIMING_HOLD) {
+				if (changed & (1 << rule->channel)) {
+					violation(checker, rule, position, position, 0);
+				}
+			} else if ((checker->has_edge & (1 << rule->channel))
+				   && position - checker->last_edge[rule->channel] < rule->samples) {
+				violation(checker, rule, checker->last_edge[rule->channel], position,
+					  position - checker->last_edge[rule->channel]);
+			}
+		}
+		checker->last_clock[channel][kind - 1] = position;
+		checker->has_clock[channel] |= kind;
+	}
+}
+
+void slogic_timing_feed(struct slogic_timing_checker *checker, const uint8_t *data, size_t size)
+{
+	if (!size) {
+		return;
+	}
+	if (!checker->started) {
+		checker->last = data[0];
+		checker->started = true;
+	}
+	slogic_find_edges(data, size, checker->position, checker->last, checker->mask, on_edge, checker);
+	checker->position += size;
+	checker->last = data[size - 1];
+}
+
+void slogic_timing_report(const struct slogic_timing_checker *checker, FILE *file)
+{
+	int i;
+
+	fprintf(file, "Violations  Rule\n");
+	for (i = 0; i < checker->n_rules; i++) {
+		fprintf(file, "%10llu  %s\n", (unsigned long long)checker->rules[i].violations, checker->rules[i].text);
+	}
+}
@@ -0,0 +1,122 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Streaming timing checker for parallel buses. Rules are given one per line,
+ * empty lines and everything after a '#' are ignored:
+ *
+ *  setup <data channel> <clock channel> rising|falling|both <time>
+ *      the data channel doesn't change for <time> before the clock edge
+ *  hold <data channel> <clock channel> rising|falling|both <time>
+ *      the data channel doesn't change for <time> after the clock edge
+ *  pulse <channel> high|low|both <time>
+ *      pulses on the channel are at least <time> long
+ *
+ * <time> is a number of samples or a time with an ns or us suffix, which is
+ * rounded up to whole samples. Everything is measured in samples, so a margin
+ * is only known to within one sample period.
+ *
+ * A data change on the same sample as the clock edge violates both setup and
+ * hold, every data change inside a hold window is a violation of its own. A
+ * pulse that started before the first sample is not checked.
+ */
+#define SLOGIC_TIMING_MAX_RULES 64
+#define SLOGIC_TIMING_RULE_TEXT 64
+
+enum slogic_timing_rule_type {
+	SLOGIC_TIMING_SETUP,
+	SLOGIC_TIMING_HOLD,
+	SLOGIC_TIMING_PULSE,
+};
+
+/* Which clock edges a setup or hold rule applies to, or which pulses a pulse rule applies to */
+#define SLOGIC_TIMING_RISING 1
+#define SLOGIC_TIMING_FALLING 2
+#define SLOGIC_TIMING_HIGH SLOGIC_TIMING_RISING
+#define SLOGIC_TIMING_LOW SLOGIC_TIMING_FALLING
+
+struct slogic_timing_rule {
+	enum slogic_timing_rule_type type;
+	int channel;
+	/* Only for setup and hold */
+	int clock;
+	unsigned int edges;
+	uint64_t samples;
+	/* The rule as it was given, for reports */
+	char text[SLOGIC_TIMING_RULE_TEXT];
+	uint64_t violations;
+};
+
+struct slogic_timing_violation {
+	const struct slogic_timing_rule *rule;
+	/* The data change, or the start of the pulse */
+	uint64_t position;
+	/* The clock edge, equal to position for pulses */
+	uint64_t reference;
+	/* The measured margin or pulse width */
+	uint64_t samples;
+};
+
+typedef void (*slogic_on_violation_callback) (const struct slogic_timing_violation * violation, void *user_data);
+
+struct slogic_timing_checker {
+	struct slogic_timing_rule rules[SLOGIC_TIMING_MAX_RULES];
+	int n_rules;
+	uint64_t violations;
+	slogic_on_violation_callback on_violation;
+	void *user_data;
+
+	/* Internal */
+	uint8_t mask;
+	uint64_t position;
+	uint8_t last;
+	bool started;
+	uint8_t clock_mask;
+	/* Position of the last edge per channel, valid once the channel has changed */
+	uint64_t last_edge[SLOGIC_N_CHANNELS];
+	uint8_t has_edge;
+	/* Last rising and falling edge of the clock channels, valid if the bit for that edge is set */
+	uint64_t last_clock[SLOGIC_N_CHANNELS][2];
+	unsigned int has_clock[SLOGIC_N_CHANNELS];
+	/* Bit masks of rule indexes per channel: pulse rules, hold rules by data channel, setup and hold by clock */
+	uint64_t pulse_rules[SLOGIC_N_CHANNELS];
+	uint64_t hold_rules[SLOGIC_N_CHANNELS];
+	uint64_t clock_rules[SLOGIC_N_CHANNELS][2];
+};
+
+void slogic_timing_init(struct slogic_timing_checker *checker, slogic_on_violation_callback on_violation,
+			void *user_data);
+
+/* Adds a rule in the format above. Returns 0 on success */
+int slogic_timing_add_rule(struct slogic_timing_checker *checker, const char *rule, unsigned int samples_per_second);
+
+/* Adds all rules in a file, logging the lines that can't be parsed. Returns 0 on success */
+int slogic_timing_load(struct slogic_timing_checker *checker, const char *file_name,
+		       unsigned int samples_per_second);
+
+/* Checks the next chunk of the stream. Positions count from the first sample fed */
+void slogic_timing_feed(struct slogic_timing_checker *checker, const uint8_t * data, size_t size);
+
+/* Writes the number of violations of every rule */
+void slogic_timing_report(const struct slogic_timing_checker *checker, FILE * file);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif
@@ -0,0 +1,118 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Throughput of the timing checker on synthetic bus traffic: a clock on
+ * channel 0 and seven data lines that change on its falling edge. Now and
+ * then a data line changes right before the rising edge instead, which the
+ * setup rules have to catch, so the run checks the checker as well.
+ */
+#include "timing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define SAMPLES_PER_SECOND 24000000
+#define N_SAMPLES (2 * SAMPLES_PER_SECOND)
+#define CHUNK_SIZE (16 * 1024)
+#define PASSES 10
+/* One in this many clock cycles has a late data change */
+#define VIOLATION_INTERVAL 1000
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Fills data with bus traffic and returns the number of late data changes in it */
+static uint64_t generate(uint8_t *data, size_t size, unsigned int period)
+{
+	uint64_t late = 0;
+	uint8_t value = 0;
+	uint8_t next, late_bit;
+	size_t cycle, i;
+
+	for (cycle = 0; cycle + period <= size; cycle += period) {
+		next = rand() & 0xfe;
+		late_bit = 0;
+		if (rand() % VIOLATION_INTERVAL == 0) {
+			/* Make sure the bit changes, then hold it back until a sample before the next rising edge */
+			late_bit = 2 << (rand() % 7);
+			next = (next & ~late_bit) | (~value & late_bit);
+			late++;
+		}
+		for (i = 0; i < period; i++) {
+			uint8_t clock = i < period / 2;
+			uint8_t v = i < period / 2 ? value : (next & ~late_bit) | (value & late_bit);
+			if (i == period - 1) {
+				v = next;
+			}
+			data[cycle + i] = v | clock;
+		}
+		value = next;
+	}
+	memset(&data[cycle], value, size - cycle);
+	return late;
+}
+
+int main(int argc, char **argv)
+{
+	struct slogic_timing_checker checker;
+	unsigned int period = 8;
+	char rule[64];
+	uint64_t late;
+	uint8_t *data;
+	double start, elapsed;
+	size_t i;
+	int c, pass, channel;
+
+	while ((c = getopt(argc, argv, "p:")) != -1) {
+		switch (c) {
+		case 'p':
+			period = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p <clock period in samples>]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (period < 6) {
+		fprintf(stderr, "The clock period has to be at least 6 samples\n");
+		exit(EXIT_FAILURE);
+	}
+
+	data = malloc(N_SAMPLES);
+	if (!data) {
+		exit(EXIT_FAILURE);
+	}
+	late = generate(data, N_SAMPLES, period);
+
+	start = now();
+	for (pass = 0; pass < PASSES; pass++) {
+		slogic_timing_init(&checker, NULL, NULL);
+		for (channel = 1; channel < SLOGIC_N_CHANNELS; channel++) {
+			snprintf(rule, sizeof(rule), "setup %d 0 rising 2", channel);
+			slogic_timing_add_rule(&checker, rule, SAMPLES_PER_SECOND);
+			snprintf(rule, sizeof(rule), "hold %d 0 rising 2", channel);
+			slogic_timing_add_rule(&checker, rule, SAMPLES_PER_SECOND);
+		}
+		slogic_timing_add_rule(&checker, "pulse 0 both 3", SAMPLES_PER_SECOND);
+
+		for (i = 0; i < N_SAMPLES; i += CHUNK_SIZE) {
+			slogic_timing_feed(&checker, &data[i], N_SAMPLES - i < CHUNK_SIZE ? N_SAMPLES - i : CHUNK_SIZE);
+		}
+	}
+	elapsed = now() - start;
+
+	slogic_timing_report(&checker, stdout);
+	printf("%u samples per clock cycle, %llu violations, %llu expected\n", period,
+	       (unsigned long long)checker.violations, (unsigned long long)late);
+	printf("%.1f MS/s, %.1f times 24MHz\n", (double)N_SAMPLES * PASSES / elapsed / 1e6,
+	       (double)N_SAMPLES * PASSES / elapsed / SAMPLES_PER_SECOND);
+
+	free(data);
+	return checker.violations == late ? EXIT_SUCCESS : EXIT_FAILURE;
+}
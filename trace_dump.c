@@ -0,0 +1,193 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Formats a binary trace written by log_trace_start(). One line per record:
+ *
+ *   <seconds>.<nanoseconds> <thread> <file>:<line> <formatted message>
+ */
+#include "log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct site {
+	char *file;
+	uint32_t line;
+	char *format;
+};
+
+static struct site *sites;
+static uint32_t n_sites;
+
+static int read_u32(FILE *file, uint32_t *value)
+{
+	return fread(value, sizeof(*value), 1, file) == 1 ? 0 : -1;
+}
+
+static char *read_string(FILE *file, uint32_t length)
+{
+	char *s = malloc(length + 1);
+	if (!s || fread(s, 1, length, file) != length) {
+		free(s);
+		return NULL;
+	}
+	s[length] = '\0';
+	return s;
+}
+
+static int read_site(FILE *file)
+{
+	uint32_t id, line, file_length, format_length;
+
+	if (read_u32(file, &id) || read_u32(file, &line) || read_u32(file, &file_length)
+	    || read_u32(file, &format_length)) {
+		return -1;
+	}
+	if (id >= n_sites) {
+		sites = realloc(sites, (id + 1) * sizeof(struct site));
+		if (!sites) {
+			return -1;
+		}
+		memset(&sites[n_sites], 0, (id + 1 - n_sites) * sizeof(struct site));
+		n_sites = id + 1;
+	}
+	sites[id].line = line;
+	sites[id].file = read_string(file, file_length);
+	sites[id].format = read_string(file, format_length);
+	return sites[id].file && sites[id].format ? 0 : -1;
+}
+
+/*
+ * printf the format with the traced arguments. Each conversion is printed on
+ * its own with the length modifier replaced by "ll" as all arguments were
+ * stored as 64 bit integers.
+ */
+static void print_formatted(FILE *out, const char *format, const struct log_trace_record *record)
+{
+	char spec[32];
+	const char *p = format;
+	unsigned int arg = 0;
+	size_t n;
+
+	while (*p) {
+		if (*p != '%') {
+			fputc(*p++, out);
+			continue;
+		}
+		if (p[1] == '%') {
+			fputc('%', out);
+			p += 2;
+			continue;
+		}
+
+		/* flags, width and precision */
+		n = 1 + strspn(p + 1, "-+ #0123456789.");
+		if (n >= sizeof(spec) - 4) {
+			break;
+		}
+		memcpy(spec, p, n);
+		p += n;
+		/* skip the length modifier */
+		p += strspn(p, "hljztL");
+		if (!*p) {
+			break;
+		}
+
+		uint64_t value = arg < record->n_args ? record->args[arg] : 0;
+		arg++;
+		switch (*p) {
+		case 'd':
+		case 'i':
+			memcpy(spec + n, "lld", 4);
+			fprintf(out, spec, (long long)value);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			spec[n] = 'l';
+			spec[n + 1] = 'l';
+			spec[n + 2] = *p;
+			spec[n + 3] = '\0';
+			fprintf(out, spec, (unsigned long long)value);
+			break;
+		case 'c':
+			fputc((int)value, out);
+			break;
+		default:
+			fprintf(out, "<%%%c:0x%llx>", *p, (unsigned long long)value);
+			break;
+		}
+		p++;
+	}
+}
+
+static int dump(FILE *file, FILE *out)
+{
+	char magic[sizeof(LOG_TRACE_MAGIC) - 1];
+	struct log_trace_record record;
+	uint32_t tag, thread, count;
+
+	if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, LOG_TRACE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "Not a trace file\n");
+		return -1;
+	}
+
+	while (read_u32(file, &tag) == 0) {
+		switch (tag) {
+		case LOG_TRACE_TAG_SITE:
+			if (read_site(file)) {
+				fprintf(stderr, "Truncated site\n");
+				return -1;
+			}
+			break;
+		case LOG_TRACE_TAG_RECORDS:
+			if (read_u32(file, &thread) || read_u32(file, &count)) {
+				fprintf(stderr, "Truncated records\n");
+				return -1;
+			}
+			while (count--) {
+				if (fread(&record, sizeof(record), 1, file) != 1) {
+					fprintf(stderr, "Truncated record\n");
+					return -1;
+				}
+				if (record.site >= n_sites || !sites[record.site].format) {
+					fprintf(stderr, "Unknown site: %u\n", record.site);
+					return -1;
+				}
+				fprintf(out, "%llu.%09llu %u %s:%u ",
+					(unsigned long long)(record.timestamp / 1000000000ULL),
+					(unsigned long long)(record.timestamp % 1000000000ULL), thread,
+					sites[record.site].file, sites[record.site].line);
+				print_formatted(out, sites[record.site].format, &record);
+			}
+			break;
+		default:
+			fprintf(stderr, "Unknown tag: %u\n", tag);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *file;
+	int ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	file = fopen(argv[1], "r");
+	if (!file) {
+		perror("opening trace file");
+		exit(EXIT_FAILURE);
+	}
+	ret = dump(file, stdout);
+	fclose(file);
+
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,77 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "uart.h"
+
+#include <string.h>
+
+void slogic_uart_init(struct slogic_uart *uart, int channel, unsigned int baud_rate,
+		      unsigned int samples_per_second)
+{
+	uart->channel = channel;
+	uart->samples_per_bit = (double)samples_per_second / baud_rate;
+}
+
+static inline int level(const struct slogic_uart *uart, const uint8_t *data, size_t position)
+{
+	return (data[position] >> uart->channel) & 1;
+}
+
+/* Returns the position of the first falling edge in [from, limit) or limit */
+static size_t find_start_bit(const struct slogic_uart *uart, const uint8_t *data, size_t from, size_t limit)
+{
+	size_t i = from ? from : 1;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* An idle line is high, skip words where the previous sample and all eight samples are high */
+	uint64_t high = 0x0101010101010101ULL << uart->channel;
+	while (i + 8 <= limit) {
+		uint64_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		if ((word & high) != high || !level(uart, data, i - 1)) {
+			break;
+		}
+		i += 8;
+	}
+#endif
+
+	for (; i < limit; i++) {
+		if (level(uart, data, i - 1) && !level(uart, data, i)) {
+			return i;
+		}
+	}
+	return limit;
+}
+
+int slogic_uart_decode(const struct slogic_uart *uart, const uint8_t *data, size_t size, size_t from, size_t limit,
+		       struct slogic_uart_frame *frame)
+{
+	double spb = uart->samples_per_bit;
+	size_t start;
+	size_t stop;
+	int bit;
+
+	if (limit > size) {
+		limit = size;
+	}
+
+	for (start = find_start_bit(uart, data, from, limit); start < limit;
+	     start = find_start_bit(uart, data, start + 1, limit)) {
+		stop = start + (size_t)(9.5 * spb);
+		if (stop >= size) {
+			return -1;
+		}
+		/* A start bit that isn't low in the middle is a glitch */
+		if (level(uart, data, start + (size_t)(0.5 * spb))) {
+			continue;
+		}
+
+		frame->position = start;
+		frame->end = stop;
+		frame->data = 0;
+		for (bit = 0; bit < 8; bit++) {
+			frame->data |= level(uart, data, start + (size_t)((1.5 + bit) * spb)) << bit;
+		}
+		frame->framing_error = !level(uart, data, stop);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __UART_H__
+#define __UART_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/*
+ * Asynchronous serial decoder, 8 data bits, no parity, one stop bit, idle
+ * high, LSB first.
+ *
+ * The decoder has no state besides the position it continues from: a frame
+ * starts at the first falling edge after that position and the decoder is
+ * idle again from the middle of the stop bit. This makes it possible to
+ * decode parts of a capture independently and stitch the results together,
+ * see analyze.c.
+ */
+struct slogic_uart {
+	int channel;
+	double samples_per_bit;
+};
+
+struct slogic_uart_frame {
+	/* Position of the falling edge of the start bit */
+	uint64_t position;
+	/* Where the decoder is idle again */
+	uint64_t end;
+	uint8_t data;
+	bool framing_error;
+};
+
+void slogic_uart_init(struct slogic_uart *uart, int channel, unsigned int baud_rate,
+		      unsigned int samples_per_second);
+
+/*
+ * Decodes the first frame with a start bit in [from, limit). The frame may
+ * extend past limit, but not past size.
+ *
+ * Returns 1 if a frame was decoded, 0 if there is no start bit before limit
+ * and -1 if the frame doesn't fit in the data.
+ */
+int slogic_uart_decode(const struct slogic_uart *uart, const uint8_t * data, size_t size, size_t from, size_t limit,
+		       struct slogic_uart_frame *frame);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+#endif